@@ -0,0 +1,566 @@
+// Copyright 2024 David Robillard <d@drobilla.net>
+// SPDX-License-Identifier: BSD-2-Clause
+
+#include "comlin/comlin.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define N_TYPED 10000U       // Keys typed at the end of a line
+#define N_EDITED 2000U       // Insertions in the middle of a line
+#define N_PASTED 20000U      // Bytes in a bracketed paste
+#define N_CANDIDATES 10000U  // Completion candidates
+#define N_TABS 20U           // Completion requests to average over
+#define CANDIDATE_SIZE 16U   // Size of a candidate string
+#define OUTPUT_SIZE 262144U  // Size of output read buffer (one datagram)
+
+/// A way of connecting the application to the terminal
+typedef enum {
+    TRANSPORT_PIPE, ///< Input from a pipe, output to a datagram socket
+    TRANSPORT_PTY,  ///< Input and output through a pseudo-terminal
+} Transport;
+
+/// Input for a line edit
+typedef struct {
+    char* data;    ///< Bytes to write to the application
+    size_t* ends;  ///< End offset of each key, or null to write all at once
+    size_t length; ///< Number of bytes in data
+    size_t n_keys; ///< Number of keystrokes (or pasted characters) in data
+} Input;
+
+/// The result of editing a line
+typedef struct {
+    double seconds;  ///< Time taken by comlin_read_line()
+    size_t n_bytes;  ///< Number of bytes written by the application
+    size_t n_writes; ///< Number of writes, or zero if unknown
+} Result;
+
+static char candidates[N_CANDIDATES][CANDIDATE_SIZE];
+
+static double
+now(void)
+{
+    struct timespec ts = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + ((double)ts.tv_nsec / 1000000000.0);
+}
+
+static int
+fail(char const* const message)
+{
+    fprintf(stderr, "error: %s (%s)\n", message, strerror(errno));
+    return 1;
+}
+
+/* Input Generation */
+
+// Allocate input, typed one key at a time unless it's written in one burst
+static bool
+input_init(Input* const input,
+           size_t const size,
+           size_t const n_keys,
+           bool const burst)
+{
+    input->data = (char*)calloc(size, 1U);
+    input->ends = burst ? NULL : (size_t*)calloc(n_keys, sizeof(size_t));
+    input->length = 0U;
+    input->n_keys = 0U;
+    return input->data && (burst || input->ends);
+}
+
+static void
+input_free(Input* const input)
+{
+    free(input->ends);
+    free(input->data);
+}
+
+static void
+input_end_key(Input* const input)
+{
+    if (input->ends) {
+        input->ends[input->n_keys] = input->length;
+    }
+
+    ++input->n_keys;
+}
+
+static void
+input_key(Input* const input, char const* const key)
+{
+    size_t const len = strlen(key);
+    memcpy(input->data + input->length, key, len);
+    input->length += len;
+    input_end_key(input);
+}
+
+static void
+input_text(Input* const input, size_t const n_chars)
+{
+    static char const chars[] = "abcdefghijklmnopqrstuvwxyz ";
+
+    for (size_t i = 0U; i < n_chars; ++i) {
+        input->data[input->length++] = chars[i % (sizeof(chars) - 1U)];
+        input_end_key(input);
+    }
+}
+
+// Type text at the end of a line
+static bool
+typing_input(Input* const input)
+{
+    if (!input_init(input, N_TYPED + 1U, N_TYPED + 1U, false)) {
+        return false;
+    }
+
+    input_text(input, N_TYPED);
+    input_key(input, "\r");
+    return true;
+}
+
+// Move back through a line inserting characters
+static bool
+editing_input(Input* const input)
+{
+    size_t const n_keys = (N_EDITED * 4U) + 2U;
+    if (!input_init(input, (N_EDITED * 8U) + 2U, n_keys, false)) {
+        return false;
+    }
+
+    // Every key moves the cursor, since one that does nothing has no output
+    input_text(input, N_EDITED + 1U);
+    for (size_t i = 0U; i < N_EDITED; ++i) {
+        input_key(input, "\x1B[D");
+        input_key(input, "\x1B[D");
+        input_key(input, "x");
+    }
+
+    input_key(input, "\r");
+    return true;
+}
+
+// Paste text in a single bracketed paste
+static bool
+paste_input(Input* const input)
+{
+    if (!input_init(input, N_PASTED + 13U, 0U, true)) {
+        return false;
+    }
+
+    memcpy(input->data, "\x1B[200~", 6U);
+    input->length = 6U;
+    input_text(input, N_PASTED);
+    memcpy(input->data + input->length, "\x1B[201~\r", 7U);
+    input->length += 7U;
+    return true;
+}
+
+/* Line Editing */
+
+// Run the application in a child process and write the time to result_fd
+static void
+run_application(int const ifd,
+                int const ofd,
+                ComlinModeFlags const flags,
+                int const result_fd)
+{
+    double seconds = -1.0;
+    ComlinState* const state = comlin_new_state(ifd, ofd, "vt100", 0U);
+    if (state) {
+        if (!comlin_set_mode(state, flags)) {
+            double const start = now();
+            if (!comlin_read_line(state, "> ")) {
+                seconds = now() - start;
+            }
+        }
+
+        comlin_free_state(state);
+    }
+
+    _exit(write(result_fd, &seconds, sizeof(seconds)) !=
+          (ssize_t)sizeof(seconds));
+}
+
+/* Act as the terminal for an application in a child process.
+ *
+ * Input is written once the prompt is shown, and output is read until the
+ * application reports its result.  Keys are written one at a time, each after
+ * the output from the previous one arrives, like a user typing who waits for
+ * the echo.  Every read of a datagram socket returns exactly one write, so
+ * writes are only counted for the pipe transport. */
+static int
+run_terminal(int const in_fd,
+             int const out_fd,
+             int const result_fd,
+             Transport const transport,
+             Input const* const input,
+             Result* const result)
+{
+    static char buf[OUTPUT_SIZE];
+
+    size_t offset = 0U;   // Offset of the next byte to write
+    size_t key = 0U;      // Index of the next key to write
+    bool waiting = true;  // Waiting for output (initially, the prompt)
+    bool finished = false;
+    if (fcntl(in_fd, F_SETFL, O_NONBLOCK) ||
+        fcntl(out_fd, F_SETFL, O_NONBLOCK)) {
+        return fail("Failed to set non-blocking mode");
+    }
+
+    while (true) {
+        struct pollfd fds[3] = {{out_fd, POLLIN, 0},
+                                {result_fd, POLLIN, 0},
+                                {in_fd, POLLOUT, 0}};
+
+        size_t const limit = input->ends ? input->ends[key] : input->length;
+        nfds_t const n_fds = (!waiting && offset < limit) ? 3U : 2U;
+        // Give up waiting after a while, in case a key has no visible effect
+        int const timeout = (waiting && offset) ? 1000 : -1;
+        int const n_ready = finished ? 1 : poll(fds, n_fds, timeout);
+        if (n_ready < 0 && errno != EINTR) {
+            return fail("Failed to poll terminal");
+        }
+
+        if (!n_ready) {
+            key += (key + 1U < input->n_keys) ? 1U : 0U;
+            waiting = false;
+        }
+
+        if (finished || (fds[0].revents & (POLLIN | POLLHUP | POLLERR))) {
+            ssize_t const r = read(out_fd, buf, sizeof(buf));
+            if (r > 0) {
+                result->n_bytes += (size_t)r;
+                result->n_writes += transport == TRANSPORT_PIPE ? 1U : 0U;
+                if (waiting && offset) {
+                    key += (key + 1U < input->n_keys) ? 1U : 0U;
+                }
+
+                waiting = false;
+            } else if (finished) {
+                break; // All output has been read
+            }
+        }
+
+        if (fds[1].revents & (POLLIN | POLLHUP)) {
+            if (read(result_fd, &result->seconds, sizeof(result->seconds)) !=
+                  (ssize_t)sizeof(result->seconds) ||
+                result->seconds < 0.0) {
+                return fail("Failed to read a line");
+            }
+
+            finished = true;
+        }
+
+        if (n_fds == 3U && (fds[2].revents & POLLOUT)) {
+            ssize_t const w =
+              write(in_fd, input->data + offset, limit - offset);
+            if (w > 0) {
+                offset += (size_t)w;
+                waiting = input->ends && offset == limit;
+            }
+        }
+    }
+
+    return 0;
+}
+
+// Open a pseudo-terminal, with the controller in fds[0] and terminal in fds[1]
+static int
+open_pty(int fds[2])
+{
+    struct winsize const ws = {24U, 80U, 0U, 0U};
+
+    fds[0] = posix_openpt(O_RDWR | O_NOCTTY);
+    if (fds[0] < 0 || grantpt(fds[0]) || unlockpt(fds[0])) {
+        return fail("Failed to open pseudo-terminal");
+    }
+
+    char const* const name = ptsname(fds[0]);
+    fds[1] = name ? open(name, O_RDWR | O_NOCTTY) : -1;
+    if (fds[1] < 0 || ioctl(fds[0], TIOCSWINSZ, &ws)) {
+        return fail("Failed to open pseudo-terminal device");
+    }
+
+    return 0;
+}
+
+static int
+edit_line(Transport const transport,
+          ComlinModeFlags const flags,
+          Input const* const input,
+          Result* const result)
+{
+    int in[2] = {-1, -1};     // Terminal input (the application reads in[0])
+    int out[2] = {-1, -1};    // Terminal output (the application writes out[1])
+    int results[2] = {-1, -1}; // Result from the application
+
+    if (pipe(results)) {
+        return fail("Failed to create result pipe");
+    }
+
+    if (transport == TRANSPORT_PTY) {
+        if (open_pty(out)) {
+            return 1;
+        }
+
+        in[0] = out[1];
+        in[1] = out[0];
+    } else if (pipe(in) || socketpair(AF_UNIX, SOCK_DGRAM, 0, out)) {
+        return fail("Failed to create pipes");
+    }
+
+    pid_t const pid = fork();
+    if (pid < 0) {
+        return fail("Failed to fork");
+    }
+
+    if (!pid) {
+        close(results[0]);
+        run_application(in[0], out[1], flags, results[1]);
+    }
+
+    close(results[1]);
+    close(out[1]);
+    if (transport == TRANSPORT_PIPE) {
+        close(in[0]);
+    }
+
+    int const rc =
+      run_terminal(in[1], out[0], results[0], transport, input, result);
+
+    int status = 0;
+    waitpid(pid, &status, 0);
+    close(results[0]);
+    close(out[0]);
+    if (transport == TRANSPORT_PIPE) {
+        close(in[1]);
+    }
+
+    return rc || !WIFEXITED(status) || WEXITSTATUS(status);
+}
+
+static int
+bench_edit(char const* const name,
+           Transport const transport,
+           ComlinModeFlags const flags,
+           Input const* const input)
+{
+    Result result = {0.0, 0U, 0U};
+    int const rc = edit_line(transport, flags, input, &result);
+    if (rc) {
+        return rc;
+    }
+
+    double const n_keys = (double)input->n_keys;
+    printf("{\"benchmark\": \"%s\", \"transport\": \"%s\", \"mode\": \"%s\", "
+           "\"keys\": %zu, \"seconds\": %.6f, \"keys_per_second\": %.0f, "
+           "\"bytes_per_key\": %.3f, ",
+           name,
+           transport == TRANSPORT_PTY ? "pty" : "pipe",
+           (flags & COMLIN_MODE_MULTI_LINE) ? "multi" : "single",
+           input->n_keys,
+           result.seconds,
+           n_keys / result.seconds,
+           (double)result.n_bytes / n_keys);
+
+    if (result.n_writes) {
+        printf("\"writes_per_key\": %.3f}\n", (double)result.n_writes / n_keys);
+    } else {
+        printf("\"writes_per_key\": null}\n");
+    }
+
+    return 0;
+}
+
+static int
+bench_edits(void)
+{
+    static Transport const transports[] = {TRANSPORT_PIPE, TRANSPORT_PTY};
+    static ComlinModeFlags const modes[] = {0U, COMLIN_MODE_MULTI_LINE};
+
+    Input typing = {NULL, NULL, 0U, 0U};
+    Input editing = {NULL, NULL, 0U, 0U};
+    Input pasting = {NULL, NULL, 0U, 0U};
+    int rc = !typing_input(&typing) || !editing_input(&editing) ||
+             !paste_input(&pasting);
+
+    for (unsigned t = 0U; !rc && t < 2U; ++t) {
+        for (unsigned m = 0U; !rc && m < 2U; ++m) {
+            Transport const transport = transports[t];
+            ComlinModeFlags const flags = modes[m];
+            ComlinModeFlags const paste = flags | COMLIN_MODE_BRACKETED_PASTE;
+
+            rc = bench_edit("typing", transport, flags, &typing) ||
+                 bench_edit("editing", transport, flags, &editing) ||
+                 bench_edit("pasting", transport, paste, &pasting);
+        }
+    }
+
+    input_free(&pasting);
+    input_free(&editing);
+    input_free(&typing);
+    return rc;
+}
+
+/* History */
+
+// Write a history file with the given number of distinct lines
+static bool
+write_history(char const* const path, size_t const n_lines)
+{
+    FILE* const file = fopen(path, "w");
+    if (!file) {
+        return false;
+    }
+
+    bool success = true;
+    for (size_t i = 0U; success && i < n_lines; ++i) {
+        success = fprintf(file, "command --option=%zu argument\n", i) > 0;
+    }
+
+    return !fclose(file) && success;
+}
+
+static int
+bench_history(size_t const n_lines)
+{
+    static char const* const load_path = "bench_comlin_load.txt";
+    static char const* const save_path = "bench_comlin_save.txt";
+
+    if (!write_history(load_path, n_lines)) {
+        return fail("Failed to write history");
+    }
+
+    ComlinState* const state = comlin_new_state(0, 1, "vt100", n_lines);
+    if (!state) {
+        return fail("Failed to create state");
+    }
+
+    double const t0 = now();
+    ComlinStatus const load_st = comlin_history_load(state, load_path);
+    double const t1 = now();
+    ComlinStatus const save_st = comlin_history_save(state, save_path);
+    double const t2 = now();
+
+    comlin_free_state(state);
+    remove(save_path);
+    remove(load_path);
+    if (load_st || save_st) {
+        return fail("Failed to load and save history");
+    }
+
+    printf("{\"benchmark\": \"history_load\", \"lines\": %zu, "
+           "\"seconds\": %.6f}\n",
+           n_lines,
+           t1 - t0);
+    printf("{\"benchmark\": \"history_save\", \"lines\": %zu, "
+           "\"seconds\": %.6f}\n",
+           n_lines,
+           t2 - t1);
+    return 0;
+}
+
+/* Completion */
+
+static void
+complete_all(char const* const line, ComlinCompletions* const lc)
+{
+    (void)line;
+    for (size_t i = 0U; i < N_CANDIDATES; ++i) {
+        comlin_add_completion(lc, candidates[i]);
+    }
+}
+
+// Time pressing Tab after a prefix, with completions from a callback or index
+static int
+bench_completion(char const* const source,
+                 ComlinCompletionIndex* const index,
+                 ComlinModeFlags const flags,
+                 char const* const prefix)
+{
+    int const null = open("/dev/null", O_WRONLY);
+    if (null < 0) {
+        return fail("Failed to open /dev/null");
+    }
+
+    ComlinState* const state = comlin_new_state(0, null, "vt100", 0U);
+    if (!state) {
+        close(null);
+        return fail("Failed to create state");
+    }
+
+    if (index) {
+        comlin_set_completion_index(state, index);
+    } else {
+        comlin_set_completion_callback(state, complete_all);
+    }
+
+    comlin_set_mode(state, flags);
+
+    double total = 0.0;
+    size_t n_used = 0U;
+    for (unsigned i = 0U; i < N_TABS; ++i) {
+        comlin_edit_start(state, "> ");
+        comlin_edit_feed_bytes(state, prefix, strlen(prefix), &n_used);
+
+        double const start = now();
+        comlin_edit_feed_bytes(state, "\t", 1U, &n_used);
+        total += now() - start;
+
+        comlin_edit_feed_bytes(state, "\x03", 1U, &n_used); // Ctrl-C
+        comlin_edit_stop(state);
+    }
+
+    comlin_free_state(state);
+    close(null);
+
+    printf("{\"benchmark\": \"completion\", \"source\": \"%s\", "
+           "\"candidates\": %u, \"seconds_per_tab\": %.6f}\n",
+           source,
+           N_CANDIDATES,
+           total / N_TABS);
+    return 0;
+}
+
+static int
+bench_completions(void)
+{
+    char const* words[N_CANDIDATES] = {NULL};
+    for (unsigned i = 0U; i < N_CANDIDATES; ++i) {
+        snprintf(candidates[i], CANDIDATE_SIZE, "candidate%05u", i);
+        words[i] = candidates[i];
+    }
+
+    ComlinCompletionIndex* const index =
+      comlin_new_completion_index(words, N_CANDIDATES);
+    if (!index) {
+        return fail("Failed to create completion index");
+    }
+
+    int const rc =
+      bench_completion("callback", NULL, 0U, "cand") ||
+      bench_completion("index", index, 0U, "cand") ||
+      bench_completion("fuzzy", index, COMLIN_MODE_FUZZY_COMPLETE, "cdt");
+
+    comlin_free_completion_index(index);
+    return rc;
+}
+
+int
+main(void)
+{
+    return bench_edits() || bench_history(10000U) || bench_history(1000000U) ||
+           bench_completions();
+}
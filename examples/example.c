@@ -8,6 +8,8 @@
 #include <sys/time.h>
 #include <unistd.h>
 
+#include <errno.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -21,6 +23,43 @@ completion(char const* buf, ComlinCompletions* const lc)
     }
 }
 
+static char const*
+hint(char const* buf, char const** const style)
+{
+    if (!strcmp(buf, "hello")) {
+        *style = "35";
+        return " World";
+    }
+
+    return NULL;
+}
+
+/* In async mode, completions are requested when the user presses <tab>, and
+ * pushed later from the main loop, as if they came from some slow source. */
+static size_t pending_request = 0U;
+static char pending_line[256] = {0};
+
+static void
+request_completion(ComlinState* const state,
+                   size_t const request,
+                   char const* const buf)
+{
+    (void)state;
+    pending_request = request;
+    (void)snprintf(pending_line, sizeof(pending_line), "%s", buf);
+}
+
+/* In async mode, the terminal width is updated from the main loop after a
+ * SIGWINCH, since the handler itself can't safely touch the state. */
+static volatile sig_atomic_t resized = 0;
+
+static void
+handle_resize(int const sig)
+{
+    (void)sig;
+    resized = 1;
+}
+
 static void
 printString(char const* const str)
 {
@@ -61,6 +100,7 @@ main(int argc, char** argv)
     /* Set the completion callback. This will be called every time the
      * user uses the <tab> key. */
     comlin_set_completion_callback(state, completion);
+    comlin_set_hint_callback(state, hint);
 
     /* Load history from file. The history file is just a plain text file
      * where entries are separated by newlines. */
@@ -86,8 +126,15 @@ main(int argc, char** argv)
             /* Asynchronous mode using the multiplexing API: wait for
              * data on stdin, and simulate async data coming from some source
              * using the select(2) timeout. */
+            comlin_set_async_completion_callback(state, request_completion);
+            signal(SIGWINCH, handle_resize);
             comlin_edit_start(state, "hello> ");
             while (1) {
+                if (resized) {
+                    resized = 0;
+                    comlin_notify_resize(state, 0U);
+                }
+
                 fd_set readfds;
                 struct timeval tv;
 
@@ -97,6 +144,10 @@ main(int argc, char** argv)
                 tv.tv_usec = 0;
 
                 int const retval = select(1, &readfds, NULL, NULL, &tv);
+                if (retval == -1 && errno == EINTR) {
+                    continue; // Interrupted by a signal, probably SIGWINCH
+                }
+
                 if (retval == -1) {
                     perror("select()");
                     return 1;
@@ -113,6 +164,13 @@ main(int argc, char** argv)
                         line = comlin_text(state);
                         break;
                     }
+                } else if (pending_request) {
+                    // Timeout occurred, deliver requested completions
+                    ComlinCompletions completions = {0U, NULL, 0U, NULL, NULL};
+                    completion(pending_line, &completions);
+                    comlin_push_completions(
+                      state, pending_request, &completions);
+                    pending_request = 0U;
                 } else {
                     // Timeout occurred
                     static int counter = 0;
@@ -136,8 +194,8 @@ main(int argc, char** argv)
             printString("echo: '");
             printString(line);
             printString("'\n");
-            comlin_history_add(state, line);           // Add to the history
-            comlin_history_save(state, "history.txt"); // Save history to disk
+            comlin_history_add(state, line);             // Add to the history
+            comlin_history_append(state, "history.txt"); // Save it to disk
         } else if (!strncmp(line, "/mask", 5)) {
             comlin_set_mode(
               state,
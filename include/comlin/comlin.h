@@ -45,6 +45,7 @@ typedef enum {
     COMLIN_BAD_READ,     ///< Failed to read from input
     COMLIN_BAD_WRITE,    ///< Failed to write to output
     COMLIN_BAD_TERMINAL, ///< Failed to configure terminal
+    COMLIN_WOULD_BLOCK,  ///< No input is available yet
 } ComlinStatus;
 
 /**
@@ -63,8 +64,13 @@ typedef struct ComlinStateImpl ComlinState;
 
 /// A flag to configure the presentation of the command line
 typedef enum {
-    COMLIN_MODE_MASKED = 1U << 0U,
-    COMLIN_MODE_MULTI_LINE = 1U << 1U,
+    COMLIN_MODE_MASKED = 1U << 0U,          ///< Show asterisks instead of input
+    COMLIN_MODE_MULTI_LINE = 1U << 1U,      ///< Wrap long lines over many rows
+    COMLIN_MODE_BRACKETED_PASTE = 1U << 2U, ///< Insert pastes as plain text
+    COMLIN_MODE_UNIQUE_HISTORY = 1U << 3U,  ///< Erase older duplicates
+    COMLIN_MODE_FUZZY_COMPLETE = 1U << 4U,  ///< Complete subsequences from index
+    COMLIN_MODE_STREAM = 1U << 5U,          ///< Read piped input as lines
+    COMLIN_MODE_PREFIX_HISTORY = 1U << 6U,  ///< Step through lines with prefix
 } ComlinModeFlag;
 
 /// Bitwise OR of ComlinModeFlag values
@@ -87,6 +93,13 @@ typedef unsigned ComlinModeFlags;
  *
  * @param max_history_len The maximum number of lines to store in the history.
  *
+ * A new state only allocates itself, which is about 1.5 KiB on 64-bit systems.
+ * Everything else is allocated when it's first needed.  The history grows up
+ * to its maximum length, using about 24 bytes per entry plus its text (or 56
+ * in unique mode).  Editing uses 4 KiB for input, and a few buffers that grow
+ * with the line, which are freed when the next line starts if they grew past
+ * 1 KiB.
+ *
  * @return A new state that must be freed with #comlin_free_state.
  */
 COMLIN_API ComlinState*
@@ -95,6 +108,32 @@ comlin_new_state(int in_fd,
                  char const* term,
                  size_t max_history_len);
 
+/** Functions to allocate memory with, like malloc(), realloc(), and free().
+ *
+ * Every function is called with the handle as its first argument, so it can
+ * be used to allocate from a particular arena or pool.
+ */
+typedef struct {
+    void* handle;                                           ///< User data
+    void* (*alloc)(void* handle, size_t size);              ///< Allocate memory
+    void* (*realloc)(void* handle, void* ptr, size_t size); ///< Resize memory
+    void (*free)(void* handle, void* ptr);                  ///< Free memory
+} ComlinAllocator;
+
+/** Create a new terminal session that allocates memory with an allocator.
+ *
+ * This is like #comlin_new_state, but the state itself and everything it owns
+ * is allocated with the given functions, which must all be set.  The
+ * allocator is copied, but its handle must remain valid until the state is
+ * freed.
+ */
+COMLIN_API ComlinState*
+comlin_new_state_with_allocator(int in_fd,
+                                int out_fd,
+                                char const* term,
+                                size_t max_history_len,
+                                ComlinAllocator const* allocator);
+
 /** Free a terminal session.
  *
  * If a line edit is still in progress, this will reset the terminal to normal
@@ -103,11 +142,38 @@ comlin_new_state(int in_fd,
 COMLIN_API void
 comlin_free_state(ComlinState* state);
 
+/** Free the memory that a state only needs while editing a line.
+ *
+ * This frees the buffers used for editing and drawing the line, cached
+ * completions, the indices used to search the history, and the input buffer
+ * if it's empty.  These are allocated again when they're next needed, so this
+ * can be called for idle sessions to leave only the state and its history.
+ * The text of the last line is also freed, so #comlin_text returns an empty
+ * string afterwards, and the kill ring is emptied.  This must not be called
+ * while editing a line.
+ */
+COMLIN_API void
+comlin_trim_state(ComlinState* state);
+
 /** Set or unset mode flags.
  *
  * This can be used to adjust the behaviour of the command line.  The changed
  * mode will be applied on the next call to a read or edit function.
  *
+ * With #COMLIN_MODE_STREAM, if the input isn't a terminal (like a pipe from a
+ * script), then lines are read from it directly in large blocks, without a
+ * prompt, echo, editing, or history.  Otherwise, input is always processed as
+ * keys typed into a terminal, even if it isn't one.
+ *
+ * With #COMLIN_MODE_PREFIX_HISTORY, stepping through the history only shows
+ * entries that start with the text before the cursor, and the cursor stays
+ * where it is, so pressing up repeatedly finds older lines with the same start.
+ * Entries are kept sorted in an index, so the entries with a prefix are found
+ * in logarithmic time, and are only sorted by age again when the prefix
+ * changes, so each following step is a binary search through them.  Adding a
+ * line to the index moves the entries sorted after it, which takes linear
+ * time, but is only a single memory move.
+ *
  * @return #COMLIN_SUCCESS.
  */
 COMLIN_API ComlinStatus
@@ -135,6 +201,9 @@ comlin_set_mode(ComlinState* state, ComlinModeFlags flags);
  * destroy the buffer, as long as the #ComlinState is still valid in the
  * context of the caller.
  *
+ * The prompt may contain escape sequences, like colours, which aren't
+ * counted as taking up any columns on the terminal.
+ *
  * @return #COMLIN_SUCCESS, or an error if configuring or writing to the
  * terminal fails.
  */
@@ -143,20 +212,53 @@ comlin_edit_start(ComlinState* l, char const* prompt);
 
 /** Read input during a non-blocking line edit.
  *
- * This will read an input character if possible, and update the state
- * accordingly.  The return status indicates how to proceed:
+ * This will read input if none is already buffered, then process every
+ * buffered character and update the state accordingly.  The line is redrawn
+ * once after the whole batch, so a burst of input (like a paste) is handled
+ * with a single read and a single refresh.  The return status indicates how to
+ * proceed:
  *
  * #COMLIN_SUCCESS: Line is entered and available via #comlin_text.
  * #COMLIN_EDITING: Editing continues, further calls required.
  * #COMLIN_INTERRUPTED: Input interrupted with Ctrl-C.
  * #COMLIN_END: Input ended with Ctrl-D.
+ * #COMLIN_WOULD_BLOCK: The input is non-blocking and had nothing to read.
+ *
+ * This only reads once, and escape sequences split across reads are finished
+ * by the next call, so it only blocks if the input does.
  *
  * @return #COMLIN_SUCCESS, #COMLIN_EDITING, #COMLIN_END, #COMLIN_INTERRUPTED,
- * or an error if communicating with the terminal failed.
+ * #COMLIN_WOULD_BLOCK, or an error if communicating with the terminal failed.
  */
 COMLIN_API ComlinStatus
 comlin_edit_feed(ComlinState* l);
 
+/** Process input that the application has already read.
+ *
+ * This is like #comlin_edit_feed, but takes input from a buffer and never
+ * reads from the input itself, for applications that read input from an event
+ * loop.  Escape sequences may be split across calls.
+ *
+ * If the edit finishes before the end of the data, the remaining bytes are not
+ * processed, and should be fed to the next edit.
+ *
+ * In stream mode, feeding no bytes signals the end of the input, which
+ * finishes a partial last line, or returns #COMLIN_END if there is none.
+ *
+ * @param l The terminal state.
+ * @param data Input bytes.
+ * @param len Number of bytes in `data`.
+ * @param[out] n_used Set to the number of bytes processed.
+ *
+ * @return #COMLIN_SUCCESS, #COMLIN_EDITING, #COMLIN_END, #COMLIN_INTERRUPTED,
+ * or an error if writing to the terminal failed.
+ */
+COMLIN_API ComlinStatus
+comlin_edit_feed_bytes(ComlinState* l,
+                       char const* data,
+                       size_t len,
+                       size_t* n_used);
+
 /** Finish a non-blocking line edit.
  *
  * This restores the terminal state modified by #comlin_edit_start if
@@ -178,10 +280,14 @@ comlin_edit_stop(ComlinState* l);
  * for debugging purposes, although in this state the line should never be
  * interpreted as a "sensible" line the user has entered.
  *
+ * The line is only made contiguous when it's needed, so this may move text
+ * around in the edit buffer, and the returned pointer is only valid until the
+ * line is edited again.
+ *
  * @return A pointer to a string, or null.
  */
 COMLIN_API char const*
-comlin_text(ComlinState const* l);
+comlin_text(ComlinState* l);
 
 /** Pause a non-blocking line edit.
  *
@@ -207,6 +313,37 @@ comlin_hide(ComlinState* l);
 COMLIN_API ComlinStatus
 comlin_show(ComlinState* l);
 
+/** Write any pending output to the terminal.
+ *
+ * Output is buffered and written once at the end of every function that
+ * changes the display, or at the end of a batch of input, so this is only
+ * needed to show output immediately from a callback during a batch.
+ *
+ * @return #COMLIN_SUCCESS, or an error if writing to the terminal failed.
+ */
+COMLIN_API ComlinStatus
+comlin_flush(ComlinState* l);
+
+/** Notify the line editor that the terminal was resized.
+ *
+ * This should be called when the width of the terminal may have changed,
+ * typically after receiving SIGWINCH.  It isn't safe to call it from a signal
+ * handler, so the handler should only set a flag (or write to a pipe that is
+ * polled along with the input) so it can be called from the main loop.
+ *
+ * If an edit is in progress, the line is cleared and redrawn for the new width
+ * with a single refresh.
+ *
+ * @param l The state of the terminal that was resized.
+ *
+ * @param cols The new width of the terminal in columns, or zero to get it from
+ * the terminal.
+ *
+ * @return #COMLIN_SUCCESS, or an error if writing to the terminal failed.
+ */
+COMLIN_API ComlinStatus
+comlin_notify_resize(ComlinState* l, size_t cols);
+
 /**
    @}
    @defgroup comlin_blocking Blocking API
@@ -231,24 +368,105 @@ comlin_read_line(ComlinState* state, char const* prompt);
    @{
 */
 
+/// A block of storage for the text of completions
+typedef struct ComlinCompletionChunkImpl ComlinCompletionChunk;
+
 /** A sequence of applicable completions.
  *
  * This is passed to the completion callback, which can add completions to it
- * with #comlin_add_completion.
+ * with #comlin_add_completion and friends.  The array grows geometrically, and
+ * copied strings are stored in a few large chunks rather than allocated
+ * individually.
+ *
+ * Memory is allocated with the allocator, or with malloc() if it's null.  The
+ * completions passed to a callback use the allocator of the state.
  */
 typedef struct {
-    size_t len;  ///< Number of elements in cvec
-    char** cvec; ///< Array of string pointers
+    size_t len;                       ///< Number of elements in cvec
+    char const** cvec;                ///< Array of string pointers
+    size_t size;                      ///< Allocated size of cvec
+    ComlinCompletionChunk* chunks;    ///< Storage for copied strings
+    ComlinAllocator const* allocator; ///< Allocator for cvec and chunks
 } ComlinCompletions;
 
 /// Completion callback
 typedef void(ComlinCompletionCallback)(char const*, ComlinCompletions*);
 
+/** Asynchronous completion callback.
+ *
+ * This is called with a request number and the current line, which is only
+ * valid during the call.  It should start fetching completions and return
+ * immediately, then later pass them to #comlin_push_completions.
+ */
+typedef void(ComlinAsyncCompletionCallback)(ComlinState*, size_t, char const*);
+
 /// Register a callback function to be called for tab-completion
 COMLIN_API void
 comlin_set_completion_callback(ComlinState* state,
                                ComlinCompletionCallback* fn);
 
+/** Register a callback function to request completions asynchronously.
+ *
+ * If set, this is used instead of the synchronous completion callback when
+ * the user presses `TAB`, and editing continues while the request is pending.
+ * This is only useful when editing with #comlin_edit_feed, since completions
+ * must be pushed from the application's event loop.
+ */
+COMLIN_API void
+comlin_set_async_completion_callback(ComlinState* state,
+                                     ComlinAsyncCompletionCallback* fn);
+
+/** Provide the completions for an asynchronous completion request.
+ *
+ * If the request is current, and the line still starts with the text it was
+ * made for, then completions that start with the current line are shown as
+ * if `TAB` was pressed.  Otherwise, the completions are dropped and the line
+ * isn't redrawn.  Either way, this takes ownership of the contents of
+ * `completions` and leaves it empty.
+ *
+ * @return #COMLIN_SUCCESS if the completions were shown or dropped, or an
+ * error if the line couldn't be redrawn.
+ */
+COMLIN_API ComlinStatus
+comlin_push_completions(ComlinState* state,
+                        size_t request,
+                        ComlinCompletions* completions);
+
+/// A static vocabulary of completions, sorted for fast prefix lookup
+typedef struct ComlinCompletionIndexImpl ComlinCompletionIndex;
+
+/** Create an index of completion words.
+ *
+ * The words are copied and sorted into a single block, so `words` doesn't
+ * need to stay valid after this returns.  Duplicate words are only stored
+ * once.  The index isn't owned by a state, so it's allocated with malloc().
+ *
+ * @return A new index that must be freed with #comlin_free_completion_index,
+ * or null if memory allocation failed.
+ */
+COMLIN_API ComlinCompletionIndex*
+comlin_new_completion_index(char const* const* words, size_t n_words);
+
+/// Free an index created with #comlin_new_completion_index
+COMLIN_API void
+comlin_free_completion_index(ComlinCompletionIndex* index);
+
+/** Set an index of words to complete from.
+ *
+ * If set, pressing `TAB` proposes every word in the index that starts with
+ * the current line, and any completion callbacks aren't called.  The index
+ * isn't copied, and must remain valid until it's unset by passing null, or
+ * the state is freed.
+ *
+ * With #COMLIN_MODE_FUZZY_COMPLETE, every word that contains the characters
+ * of the line in order (ignoring ASCII case) is proposed instead, so "cfgsrv"
+ * matches "config_server".  These are ranked with consecutive characters and
+ * characters at the start of words scoring higher, then shorter words first.
+ */
+COMLIN_API void
+comlin_set_completion_index(ComlinState* state,
+                            ComlinCompletionIndex const* index);
+
 /** Add completion options for the current input string.
  *
  * This is used by completion callback to add completion options given the
@@ -260,6 +478,89 @@ comlin_set_completion_callback(ComlinState* state,
 COMLIN_API ComlinStatus
 comlin_add_completion(ComlinCompletions* lc, char const* str);
 
+/** Add a completion option from a string with a length.
+ *
+ * This is like #comlin_add_completion, but copies exactly `len` bytes from
+ * `str`, which doesn't need to be null-terminated.
+ */
+COMLIN_API ComlinStatus
+comlin_add_completion_n(ComlinCompletions* lc, char const* str, size_t len);
+
+/** Add a completion option without copying it.
+ *
+ * This is like #comlin_add_completion, but only stores the pointer, which is
+ * a cheap way to add strings from a static table.  The string must remain
+ * valid until the completions are freed, which is after the line is changed
+ * or the state is freed.
+ */
+COMLIN_API ComlinStatus
+comlin_add_static_completion(ComlinCompletions* lc, char const* str);
+
+/**
+   @}
+   @defgroup comlin_highlighting Hints and Highlighting
+   @{
+*/
+
+/// The styles of a line, which are added by the highlight callback
+typedef struct ComlinHighlightsImpl ComlinHighlights;
+
+/** Highlight callback.
+ *
+ * This is called with the line when it's drawn after any change to its text,
+ * and should add a span with #comlin_add_highlight for every part of it that
+ * is shown in a style.  The spans are kept until the text changes again, so
+ * redrawing the line or moving the cursor doesn't call this again.
+ */
+typedef void(ComlinHighlightCallback)(char const*, ComlinHighlights*);
+
+/** Hint callback.
+ *
+ * This is called like the highlight callback, and returns text to show after
+ * the line, or null.  The hint is copied, so it only needs to be valid until
+ * the callback is called again.  It's shown in grey, unless `*style` is set
+ * to another style like with #comlin_add_highlight.
+ */
+typedef char const*(ComlinHintCallback)(char const*, char const**);
+
+/// Register a callback function to highlight the line
+COMLIN_API void
+comlin_set_highlight_callback(ComlinState* state, ComlinHighlightCallback* fn);
+
+/** Register a callback function to show a hint after the line.
+ *
+ * The hint is shown after the end of the line while editing, and is removed
+ * when the line is entered.  In single-line mode, only as much of it as fits
+ * on the row is shown.  Hints and highlighting are never shown in mask mode.
+ */
+COMLIN_API void
+comlin_set_hint_callback(ComlinState* state, ComlinHintCallback* fn);
+
+/** Show a span of the line in a style.
+ *
+ * This is used by the highlight callback, with spans added in order from the
+ * start of the line.  Spans that overlap a previous one are ignored, and the
+ * ends of a span are moved forwards to the start of a character if needed.
+ *
+ * @param highlights The highlights passed to the callback.
+ *
+ * @param start Offset of the first byte of the span in the line.
+ *
+ * @param end Offset one past the last byte of the span in the line.
+ *
+ * @param style The parameters of an SGR escape sequence, like "1;31" for bold
+ * red, which may only contain digits, colons, and semicolons.  This is
+ * copied, and each distinct style is only stored (and formatted) once.
+ *
+ * @return #COMLIN_SUCCESS if the span was added or ignored, or
+ * #COMLIN_NO_MEMORY if memory allocation failed.
+ */
+COMLIN_API ComlinStatus
+comlin_add_highlight(ComlinHighlights* highlights,
+                     size_t start,
+                     size_t end,
+                     char const* style);
+
 /**
    @}
    @defgroup comlin_history History
@@ -278,12 +579,31 @@ COMLIN_API ComlinStatus
 comlin_history_add(ComlinState* state, char const* line);
 
 /** Save the history in the specified file.
+ *
+ * The history is written to a temporary file which is then renamed over the
+ * file, so other processes reading it never see a partially written file.
  *
  * @return #COMLIN_SUCCESS if the history was saved, #COMLIN_NO_FILE if the
- * file couldn't be opened, or #COMLIN_BAD_WRITE if a write error occurred.
+ * file couldn't be opened, #COMLIN_NO_MEMORY if no memory is available, or
+ * #COMLIN_BAD_WRITE if a write error occurred.
+ */
+COMLIN_API ComlinStatus
+comlin_history_save(ComlinState* state, char const* filename);
+
+/** Append new history entries to the specified file.
+ *
+ * This writes only the entries that were added since the history was last
+ * loaded, saved, or appended, which is much cheaper than saving the whole
+ * history after every line.  When the file grows to more than twice the
+ * maximum history length, it is rewritten with #comlin_history_save instead,
+ * which drops old and duplicate lines.
+ *
+ * @return #COMLIN_SUCCESS if the entries were written, #COMLIN_NO_FILE if the
+ * file couldn't be opened, #COMLIN_NO_MEMORY if no memory is available, or
+ * #COMLIN_BAD_WRITE if a write error occurred.
  */
 COMLIN_API ComlinStatus
-comlin_history_save(ComlinState const* state, char const* filename);
+comlin_history_append(ComlinState* state, char const* filename);
 
 /** Load the history from the specified file.
  *
@@ -293,6 +613,47 @@ comlin_history_save(ComlinState const* state, char const* filename);
 COMLIN_API ComlinStatus
 comlin_history_load(ComlinState* state, char const* filename);
 
+/// A read-only history that can be used by many states at once
+typedef struct ComlinHistoryImpl ComlinHistory;
+
+/** Create a shared history with a copy of the history of a state.
+ *
+ * Every entry the state shows, including those from any shared history that
+ * it uses, is copied with a search index built once for all users.  So, a
+ * large history file can be loaded into one state, then shared with many
+ * sessions without each having a copy.  The history isn't owned by a state,
+ * so it's allocated with malloc().
+ *
+ * @return A new history that must be freed with #comlin_free_shared_history,
+ * or null if memory allocation failed.
+ */
+COMLIN_API ComlinHistory*
+comlin_new_shared_history(ComlinState const* state);
+
+/// Free a history created with #comlin_new_shared_history
+COMLIN_API void
+comlin_free_shared_history(ComlinHistory* history);
+
+/** Set a shared history of entries older than those of a state.
+ *
+ * The shared entries come before the state's own when stepping through,
+ * searching, or saving the history.  New entries are only added to the
+ * state's own history, which is limited to its maximum length as usual.
+ * Shared entries are never changed, so edits made to one while stepping
+ * through the history are discarded, and unique mode only erases older
+ * duplicates in the state's own history.
+ *
+ * Since a shared history is never modified, states on different threads can
+ * use it at once without any locking.  To publish new entries, create a new
+ * shared history (for example, from a state that loads a file that sessions
+ * append to), set it in each state between lines, and free the old one once
+ * no state uses it.  The history isn't copied, and must remain valid until
+ * it's unset by passing null, or the state is freed.  This must not be called
+ * while editing a line.
+ */
+COMLIN_API void
+comlin_set_shared_history(ComlinState* state, ComlinHistory const* history);
+
 /**
    @}
    @defgroup comlin_utilities Utilities
@@ -308,6 +669,46 @@ comlin_history_load(ComlinState* state, char const* filename);
 COMLIN_API ComlinStatus
 comlin_clear_screen(ComlinState* state);
 
+/**
+   @}
+   @defgroup comlin_statistics Statistics
+   @{
+*/
+
+/// Counts of the work done by a terminal session
+typedef struct {
+    size_t n_reads;             ///< Number of read() calls
+    size_t n_writes;            ///< Number of write() calls
+    size_t n_bytes_read;        ///< Number of bytes read
+    size_t n_bytes_written;     ///< Number of bytes written
+    size_t n_full_refreshes;    ///< Number of times the line was drawn anew
+    size_t n_partial_refreshes; ///< Number of times changes were drawn
+    size_t n_allocations;       ///< Number of allocations and reallocations
+    size_t n_bytes_allocated;   ///< Total size of allocations
+    size_t n_history_adds;      ///< Number of entries added to the history
+    size_t n_history_evictions; ///< Number of oldest entries dropped
+    size_t n_completion_calls;  ///< Number of completion callback calls
+    double completion_seconds;  ///< Total time spent in completion callbacks
+} ComlinStats;
+
+/**
+ * Get the statistics of a terminal session.
+ *
+ * These are counted from when the state was created, or the last call to
+ * #comlin_reset_stats.  Counting only increments a few fields in the state,
+ * and can be compiled out by building with `-Dstats=false`, in which case the
+ * statistics are always zero.
+ *
+ * Allocations only include memory owned by the state, not completion
+ * indices, or completions added by callbacks.
+ */
+COMLIN_API void
+comlin_get_stats(ComlinState const* state, ComlinStats* stats);
+
+/// Reset all the statistics of a terminal session to zero
+COMLIN_API void
+comlin_reset_stats(ComlinState* state);
+
 /**
    @}
    @}
@@ -18,6 +18,7 @@
 
 #include <fcntl.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <termios.h>
@@ -26,8 +27,11 @@
 #include <assert.h>
 #include <errno.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #ifndef O_CLOEXEC
 #    define O_CLOEXEC 0
@@ -36,6 +40,25 @@
 // The two characters that begin a VT-100 escape sequence: `ESC [`
 #define VTESC "\x1B["
 
+// The size of the input buffer (a power of two)
+#define COMLIN_INPUT_SIZE 4096U
+
+// The largest size of a line buffer that's kept for the next line
+#define COMLIN_KEEP_SIZE 1024U
+
+// The largest length of a line, so each of its columns fits in a Column
+#define COMLIN_MAX_LENGTH 0x40000000U
+
+// The number of killed strings that are kept to be yanked
+#define COMLIN_KILL_RING_SIZE 8U
+
+// Add to a statistics counter, which does nothing if statistics are disabled
+#ifndef COMLIN_NO_STATS
+#    define COMLIN_COUNT(state, counter, n) ((state)->stats.counter += (n))
+#else
+#    define COMLIN_COUNT(state, counter, n) ((void)(state), (void)(n))
+#endif
+
 // A resizable buffer that contains a string
 typedef struct {
     char* data;    ///< Pointer to string buffer
@@ -43,62 +66,366 @@ typedef struct {
     size_t size;   ///< Size of data
 } StringBuf;
 
+/* A column on the terminal, which there is one of for every byte of text.
+ *
+ * These are 32 bits on any system, so an index of them is only four times
+ * the size of its text, which the length limit of a line ensures is enough.
+ */
+typedef uint32_t Column;
+
+// The columns of the characters in some text, see columns_build()
+typedef struct {
+    Column* data; ///< Column of each byte, then the total width
+    size_t size;  ///< Allocated number of elements in data
+    bool valid;   ///< Columns are up to date with the text
+} ColumnIndex;
+
+// The line being edited, a gap buffer with the columns of its bytes
+typedef struct {
+    char* data;        ///< Text before the gap, then the gap, then text after
+    Column* columns;   ///< Columns of bytes in data, see line_column()
+    size_t length;     ///< Length of text, not including the gap
+    size_t size;       ///< Size of data, and of valid columns less one
+    size_t gap;        ///< Offset of the gap in the text
+    size_t width;      ///< Total width of the text in columns
+    size_t generation; ///< Number of the last change, unique to the state
+    bool valid;        ///< Columns are up to date with the text
+} LineBuf;
+
+// How an edit is grouped with the previous one in the undo log
+typedef enum {
+    UNDO_NEW,    ///< The start of a separate change
+    UNDO_TYPING, ///< Typing, which extends the last edit if it was typing too
+    UNDO_JOINED, ///< Part of the same change as the last edit
+} UndoGroup;
+
+// An insertion or deletion of text in the line, which can be undone
+typedef struct {
+    size_t pos;    ///< Offset of the text in the line
+    size_t cursor; ///< Cursor position before the edit
+    size_t end;    ///< Offset of the end of the edit's text in the log
+    bool deleted;  ///< Text was deleted, otherwise it was inserted
+    bool joined;   ///< Undone and redone along with the previous edit
+} UndoEdit;
+
+/* The edits made to the line, which are undone and redone in order.
+ *
+ * Only the text inserted or deleted by each edit is stored, one after another
+ * in a single buffer, so the log takes space in proportion to the edits, not
+ * to the length of the line.  The edits after the current one are those that
+ * were undone, which can be redone until a new edit replaces them.
+ */
+typedef struct {
+    StringBuf text;    ///< Text of every edit, in order
+    UndoEdit* edits;   ///< Edits in the order they were made
+    size_t nedits;     ///< Number of edits that are done
+    size_t count;      ///< Number of edits, including undone ones after nedits
+    size_t size;       ///< Allocated size of edits
+    size_t generation; ///< Generation of the line after the last edit
+    bool typing;       ///< The last edit was typing, so may be extended
+} UndoLog;
+
+// Recently killed text, which can be yanked back into a line
+typedef struct {
+    StringBuf text;                     ///< Text of every kill, oldest first
+    size_t ends[COMLIN_KILL_RING_SIZE]; ///< Offset of the end of each kill
+    size_t count;                       ///< Number of kills
+    size_t yanked;                      ///< Index of the last kill yanked
+    size_t start;                       ///< Offset of the yanked text in line
+    size_t pos;                         ///< Cursor after the last kill or yank
+    size_t generation;                  ///< Generation of the line after that
+    bool yanking;                       ///< Last kill or yank was a yank
+} KillRing;
+
+// A ring buffer of input bytes that have been read but not yet processed
+typedef struct {
+    char* data;   ///< Buffered input bytes, allocated when first read
+    size_t head;  ///< Index of the next byte to process
+    size_t count; ///< Number of buffered bytes
+} InputBuf;
+
+// The maximum number of parameters in a control sequence that are used
+#define COMLIN_MAX_PARAMS 2U
+
+// The part of an escape sequence that has been read
+typedef enum {
+    ESCAPE_NONE,  ///< Not in an escape sequence
+    ESCAPE_START, ///< After ESC
+    ESCAPE_CSI,   ///< In a control sequence after `ESC [`
+    ESCAPE_SS3,   ///< After `ESC O`
+} EscapeState;
+
+// The state of an escape sequence being read, like `ESC [ 1 ; 5 C`
+typedef struct {
+    EscapeState state;                  ///< Part of the sequence read so far
+    unsigned params[COMLIN_MAX_PARAMS]; ///< Numeric parameters read so far
+    unsigned n_params;                  ///< Index of the current parameter
+    bool ignored;                       ///< Has private or intermediate bytes
+} EscapeReader;
+
+// The offset of an erased history entry
+#define HISTORY_ERASED SIZE_MAX
+
+// A history entry, whose text is stored in the history arena
+typedef struct {
+    size_t offset; ///< Offset of text in the arena, or HISTORY_ERASED
+    size_t length; ///< Length of text, not including the null terminator
+    size_t seq;    ///< Sequence number, which increases as entries are added
+} HistoryEntry;
+
+// A bucket in the hash index of history entries
+typedef struct {
+    size_t slot; ///< Index of entry in the history ring plus one, or zero
+    size_t hash; ///< Hash of entry text
+} HistoryBucket;
+
+// The sequence numbers of history entries that contain a trigram
+typedef struct {
+    uint32_t key;   ///< Trigram bytes plus one, or zero for an empty bucket
+    uint32_t count; ///< Number of sequence numbers in seqs
+    uint32_t size;  ///< Allocated size of seqs
+    uint32_t* seqs; ///< Sequence numbers of entries, oldest first
+} SearchPostings;
+
+// Reverse history search state and the trigram index it uses
+typedef struct {
+    SearchPostings* postings; ///< Hash table of postings for trigrams
+    size_t nbuckets;          ///< Number of buckets in postings, or zero
+    size_t nkeys;             ///< Number of trigrams in postings
+    size_t nindexed;          ///< Number of entries indexed since built
+    bool stale;               ///< Index must be rebuilt before it's used
+    bool active;              ///< Currently searching
+    StringBuf query;          ///< Text being searched for
+    StringBuf prompt;         ///< Prompt shown while searching
+    size_t* results;          ///< Matches, then unchecked candidates
+    size_t nresults;          ///< Number of checked matches in results
+    size_t next;              ///< Index of the next unchecked candidate
+    size_t end;               ///< End of the candidates in results
+    size_t results_size;      ///< Allocated size of results
+    uint32_t const* lazy;     ///< Shared candidates after results, or null
+    size_t nlazy;             ///< Number of unchecked shared candidates
+    size_t current;           ///< Index of the shown result
+    size_t shown;             ///< Sequence number of shown entry, or SIZE_MAX
+    size_t match;             ///< Offset of the match in the shown entry
+} HistorySearch;
+
+// History entries sorted by their text, to find those that start with a prefix
+typedef struct {
+    size_t* seqs;        ///< Sequence numbers of entries, sorted by text
+    size_t count;        ///< Number of entries in seqs
+    size_t size;         ///< Allocated size of seqs
+    size_t pending;      ///< One more than the edited line's seq, or zero
+    bool built;          ///< Order is built and kept up to date
+    bool matches_valid;  ///< Matches are up to date with the history
+    StringBuf prefix;    ///< Prefix of the matches
+    size_t* matches;     ///< Search numbers of matching entries, oldest first
+    size_t nmatches;     ///< Number of matching entries
+    size_t matches_size; ///< Allocated size of matches
+} HistoryOrder;
+
+/* A history shared by several states, which is never modified once created.
+ *
+ * Entries have no erased gaps and are ordered from the oldest, so the sequence
+ * number of each is its index, and also its number in the reverse search.
+ */
+struct ComlinHistoryImpl {
+    size_t len;            ///< Number of entries
+    HistoryEntry* entries; ///< Entries, oldest first
+    char* arena;           ///< Null-terminated text of entries
+    HistorySearch search;  ///< Trigram index of entries (nothing else is used)
+    size_t* sorted;        ///< Sequence numbers of entries, sorted by text
+};
+
+// A span of the line shown in a style
+typedef struct {
+    size_t start;  ///< Offset of the first byte of the span in the line
+    size_t end;    ///< Offset one past the last byte of the span
+    size_t escape; ///< Offset of the span's escape sequence in escapes
+} StyleSpan;
+
+/* The styles and hint of a line, which are kept until its text changes.
+ *
+ * Escape sequences for styles are stored once each in a buffer that's kept
+ * between lines, so spans in the same style share the same sequence.
+ */
+struct ComlinHighlightsImpl {
+    ComlinState* state;  ///< State that owns these highlights
+    char const* line;    ///< Text being highlighted, only set in callback
+    size_t length;       ///< Length of line
+    StyleSpan* spans;    ///< Spans of the line in a style, in order
+    size_t nspans;       ///< Number of spans
+    size_t spans_size;   ///< Allocated size of spans
+    StringBuf escapes;   ///< Distinct escape sequences used by spans
+    StringBuf hint;      ///< Hint shown after the line
+    size_t hint_escape;  ///< Offset of the hint's escape sequence in escapes
+    size_t generation;   ///< Generation of the line these are for, or zero
+    bool failed;         ///< Memory allocation failed in a callback
+};
+
+// Completions to show, which may be a view of the words in an index
+typedef struct {
+    size_t len;              ///< Number of completions
+    char const* const* cvec; ///< Completion strings
+} CompletionList;
+
+typedef struct {
+    unsigned score; ///< Match score, higher is better
+    size_t length;  ///< Length of word
+    size_t index;   ///< Index of word in completion index
+} FuzzyMatch;
+
 typedef struct termios ComlinTerminalState;
 
 struct ComlinStateImpl {
+    // Memory
+    ComlinAllocator allocator; ///< Functions to allocate memory with
+
     // Completion
-    ComlinCompletionCallback* completion_callback; ///< Get completions
+    ComlinCompletionCallback* completion_callback;   ///< Get completions
+    ComlinAsyncCompletionCallback* async_completion; ///< Request completions
+    ComlinCompletionIndex const* completion_index;   ///< Static completions
+    ComlinCompletions completions;                   ///< Cached completions
+    CompletionList index_matches;                    ///< Matches in index
+    FuzzyMatch* fuzzy_matches;                       ///< Scored fuzzy matches
+    char const** fuzzy_words;                        ///< Ranked fuzzy matches
+    size_t fuzzy_size;                               ///< Size of fuzzy arrays
+    StringBuf completion_line;                       ///< Line of completions
+    size_t completion_request;                       ///< Current request
+    bool completion_pending;                         ///< Request is pending
+    bool completions_set;                            ///< Cache is valid
+
+    // Highlighting
+    ComlinHighlightCallback* highlight_callback; ///< Get styles of line
+    ComlinHintCallback* hint_callback;           ///< Get hint for line
+    ComlinHighlights highlights;                 ///< Cached styles and hint
 
     // Terminal session state
-    int ifd;       ///< Terminal stdin file descriptor
-    int ofd;       ///< Terminal stdout file descriptor
-    size_t cols;   ///< Number of columns in terminal
-    bool maskmode; ///< Show asterisks instead of input (for passwords)
-    bool rawmode;  ///< Terminal is currently in raw mode
-    bool mlmode;   ///< Multi-line mode (default is single line)
-    bool dumb;     ///< True if terminal is unsupported (no features)
+    int ifd;            ///< Terminal stdin file descriptor
+    int ofd;            ///< Terminal stdout file descriptor
+    size_t cols;        ///< Number of columns in terminal
+    size_t probed_cols; ///< Columns found by asking the terminal, or zero
+    bool maskmode;      ///< Show asterisks instead of input (for passwords)
+    bool rawmode;       ///< Terminal is currently in raw mode
+    bool mlmode;        ///< Multi-line mode (default is single line)
+    bool bpmode;        ///< Bracketed paste mode
+    bool uniqmode;      ///< Erase older duplicates from the history
+    bool fuzzymode;     ///< Complete subsequences from the completion index
+    bool streammode;    ///< Read lines directly from input that isn't a tty
+    bool prefixmode;    ///< Only step through entries that start with a prefix
+    bool dumb;          ///< True if terminal is unsupported (no features)
 
     // History
-    size_t history_max_len; ///< Maximum number of history entries to keep
-    size_t history_len;     ///< Number of history entries
-    char** history;         ///< History entries
+    size_t history_max_len;         ///< Maximum number of entries to keep
+    size_t history_len;             ///< Number of history entries
+    size_t history_size;            ///< Number of entries allocated in history
+    size_t history_start;           ///< Index of the oldest entry
+    size_t history_erased;          ///< Number of erased entries
+    HistoryEntry* history;          ///< Ring buffer of history entries
+    char* history_arena;            ///< Null-terminated text of entries
+    size_t history_arena_len;       ///< Number of bytes used in history_arena
+    size_t history_arena_size;      ///< Size of history_arena
+    size_t history_garbage;         ///< Bytes in history_arena used by no entry
+    size_t history_next_seq;        ///< Sequence number of the next entry
+    size_t history_saved_seq;       ///< Sequence number of first unsaved entry
+    size_t history_file_lines;      ///< Number of lines in the history file
+    size_t history_nbuckets;        ///< Number of buckets in history_buckets
+    HistoryBucket* history_buckets; ///< Hash index of entries (unique mode)
+    HistorySearch search;           ///< Reverse search state and index
+    HistoryOrder history_order;     ///< Entries sorted by text (prefix mode)
+    ComlinHistory const* shared;    ///< Older entries shared with other states
 
     // Terminal state
     ComlinTerminalState cooked; ///< Terminal settings before raw mode
+    InputBuf input;             ///< Pending input from the terminal
 
     // Line editing state
-    StringBuf buf;         ///< Editing line buffer
+    LineBuf buf;           ///< Editing line buffer
+    LineBuf shown;         ///< Completion or search result being shown
+    UndoLog undo;          ///< Edits to the line that can be undone
+    KillRing kills;        ///< Recently killed text that can be yanked
+    char partial[4];       ///< Incomplete UTF-8 character being typed
+    size_t partial_len;    ///< Number of bytes in partial
+    EscapeReader escape;   ///< Escape sequence being read
+    StringBuf paste;       ///< Pasted text being read
+    size_t paste_matched;  ///< Length of the paste end matched so far
+    bool pasting;          ///< Reading a bracketed paste
     char const* prompt;    ///< Prompt to display
     size_t plen;           ///< Prompt length
     size_t pos;            ///< Current cursor position
     size_t history_index;  ///< The history index we're currently editing
+    size_t generation;     ///< Generation of the last change to a line
     bool in_completion;    ///< Currently doing a completion
     size_t completion_idx; ///< Index of next completion to propose
-
-    // Multi-line refresh state
-    size_t oldpos;  ///< Previous refresh cursor position
-    size_t oldrows; ///< Rows used by last refreshed line (multi-line)
+    bool defer_refresh;    ///< Processing a batch of input, refresh at end
+    bool refresh_pending;  ///< Line changed since the last full refresh
+    bool streaming;        ///< Reading lines from a stream without editing
+
+    // Refresh state
+    StringBuf drawn;           ///< Rows as currently shown on screen
+    StringBuf row;             ///< Rows being rendered by a refresh
+    StringBuf output;          ///< Output waiting to be written
+    ColumnIndex drawn_columns; ///< Columns of drawn
+    ColumnIndex row_columns;   ///< Columns of row
+    size_t drawn_row;          ///< Row of the cursor on screen
+    size_t drawn_col;          ///< Column of the cursor on screen
+    size_t oldrows;            ///< Number of rows on screen used by the line
+
+#ifndef COMLIN_NO_STATS
+    // Statistics
+    ComlinStats stats; ///< Counts of the work done by the session
+#endif
 };
 
 static char const* const unsupported_term[] = {"dumb", "cons25", "emacs", NULL};
 
 static void
-buf_append(StringBuf* buf, char const* s, size_t len);
+buf_append(ComlinState* state, StringBuf* buf, char const* s, size_t len);
+
+static bool
+line_set(ComlinState* state,
+         LineBuf* line,
+         char const* text,
+         size_t len,
+         bool masked);
+
+static char const*
+line_text(ComlinState* state, LineBuf* line);
+
+static bool
+line_starts_with(LineBuf const* line, char const* prefix, size_t len);
+
+static bool
+edit_replace(ComlinState* state, char const* text, size_t len);
+
+static ComlinStatus
+history_append(ComlinState* state, char const* line, size_t len);
+
+static void
+order_insert(ComlinState* state, HistoryEntry const* entry);
+
+static void
+order_remove(ComlinState* state, HistoryEntry const* entry);
 
 static ComlinStatus
 refresh_line_with_completion(ComlinState* ls,
-                             ComlinCompletions const* lc,
+                             CompletionList const* lc,
                              unsigned flags);
 
 static ComlinStatus
 refresh_line_with_flags(ComlinState* l, unsigned flags);
 
+static ComlinStatus
+refresh_search(ComlinState* l);
+
 typedef enum {
     CTRL_C = 3,   // ^C (ETX)
     CTRL_D = 4,   // ^D (EOT)
+    CTRL_G = 7,   // ^G (BEL)
+    CTRL_H = 8,   // ^H (BS)
     TAB = 9,      // ^I (HT) - Tab
     LFEED = 10,   // ^J (LF) - Usually "Enter" or "Return"
     CRETURN = 13, // ^M (CR) - Carriage Return
+    CTRL_R = 18,  // ^R (DC2)
     ESC = 27,     // ^[ (ESC)
     DEL = 127     // ^? (DEL) - Usually "Backspace"
 } ControlCharacter;
@@ -112,6 +439,127 @@ static ComlinRefreshFlags const REFRESH_ALL = 3U;
 static ComlinStatus
 comlin_edit_refresh(ComlinState* l);
 
+/* Memory */
+
+static void*
+default_alloc(void* const handle, size_t const size)
+{
+    (void)handle;
+    return malloc(size);
+}
+
+static void*
+default_realloc(void* const handle, void* const ptr, size_t const size)
+{
+    (void)handle;
+    return realloc(ptr, size);
+}
+
+static void
+default_free(void* const handle, void* const ptr)
+{
+    (void)handle;
+    free(ptr);
+}
+
+// The allocator used if none is given, which uses the standard functions
+static ComlinAllocator const default_allocator = {
+  NULL, default_alloc, default_realloc, default_free};
+
+// Allocate memory owned by a state
+static void*
+state_malloc(ComlinState* const state, size_t const size)
+{
+    COMLIN_COUNT(state, n_allocations, 1U);
+    COMLIN_COUNT(state, n_bytes_allocated, size);
+    return state->allocator.alloc(state->allocator.handle, size);
+}
+
+// Allocate zeroed memory owned by a state
+static void*
+state_calloc(ComlinState* const state, size_t const count, size_t const size)
+{
+    if (count && size > SIZE_MAX / count) {
+        return NULL;
+    }
+
+    void* const ptr = state_malloc(state, count * size);
+    if (ptr) {
+        memset(ptr, 0, count * size);
+    }
+
+    return ptr;
+}
+
+// Resize memory owned by a state, or allocate it if ptr is null
+static void*
+state_realloc(ComlinState* const state, void* const ptr, size_t const size)
+{
+    COMLIN_COUNT(state, n_allocations, 1U);
+    COMLIN_COUNT(state, n_bytes_allocated, size);
+    return state->allocator.realloc(state->allocator.handle, ptr, size);
+}
+
+// Free memory owned by a state, which may be null
+static void
+state_free(ComlinState* const state, void* const ptr)
+{
+    if (ptr) {
+        state->allocator.free(state->allocator.handle, ptr);
+    }
+}
+
+// Return the allocator for some completions
+static ComlinAllocator const*
+completions_allocator(ComlinCompletions const* const lc)
+{
+    return lc->allocator ? lc->allocator : &default_allocator;
+}
+
+/* Statistics */
+
+// Return the time a completion callback is called, for counting its duration
+static double
+completion_start(void)
+{
+#ifndef COMLIN_NO_STATS
+    struct timespec now = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec + ((double)now.tv_nsec / 1000000000.0);
+#else
+    return 0.0;
+#endif
+}
+
+// Count a completion callback call that started at the given time
+static void
+completion_end(ComlinState* const state, double const start)
+{
+    COMLIN_COUNT(state, n_completion_calls, 1U);
+    COMLIN_COUNT(state, completion_seconds, completion_start() - start);
+}
+
+void
+comlin_get_stats(ComlinState const* const state, ComlinStats* const stats)
+{
+#ifndef COMLIN_NO_STATS
+    *stats = state->stats;
+#else
+    (void)state;
+    memset(stats, 0, sizeof(ComlinStats));
+#endif
+}
+
+void
+comlin_reset_stats(ComlinState* const state)
+{
+#ifndef COMLIN_NO_STATS
+    memset(&state->stats, 0, sizeof(ComlinStats));
+#else
+    (void)state;
+#endif
+}
+
 /* Terminal Communication */
 
 // Return true if a `real` TERM value matches an `ideal` one
@@ -145,30 +593,97 @@ is_unsupported_term(char const* const term)
     return false;
 }
 
+// Read as much input as is available into the free space of the input buffer
+static ComlinStatus
+fill_input(ComlinState* const state)
+{
+    InputBuf* const in = &state->input;
+    assert(in->count < COMLIN_INPUT_SIZE);
+
+    if (!in->data &&
+        !(in->data = (char*)state_malloc(state, COMLIN_INPUT_SIZE))) {
+        return COMLIN_NO_MEMORY;
+    }
+
+    if (!in->count) {
+        in->head = 0U; // Read into the whole buffer if possible
+    }
+
+    size_t const tail = (in->head + in->count) & (COMLIN_INPUT_SIZE - 1U);
+    size_t const end = tail < in->head ? in->head : COMLIN_INPUT_SIZE;
+    ssize_t const r = read(state->ifd, in->data + tail, end - tail);
+    COMLIN_COUNT(state, n_reads, 1U);
+    if (r <= 0) {
+        return (!r)                                        ? COMLIN_END
+               : (errno == EAGAIN || errno == EWOULDBLOCK) ? COMLIN_WOULD_BLOCK
+                                                           : COMLIN_BAD_READ;
+    }
+
+    in->count += (size_t)r;
+    COMLIN_COUNT(state, n_bytes_read, (size_t)r);
+    return COMLIN_SUCCESS;
+}
+
+// Read the next input byte, blocking only if nothing is buffered
 static ComlinStatus
-read_char(int const fd, char* const buf)
+read_char(ComlinState* const state, char* const buf)
 {
-    ssize_t const r = read(fd, buf, 1);
+    InputBuf* const in = &state->input;
+    if (!in->count) {
+        ComlinStatus const st = fill_input(state);
+        if (st) {
+            return st;
+        }
+    }
 
-    return r < 0 ? COMLIN_BAD_READ : r == 0 ? COMLIN_END : COMLIN_SUCCESS;
+    *buf = in->data[in->head];
+    in->head = (in->head + 1U) & (COMLIN_INPUT_SIZE - 1U);
+    --in->count;
+    return COMLIN_SUCCESS;
 }
 
 static ComlinStatus
-write_string(int const fd, char const* const buf, size_t const count)
+write_string(ComlinState* const state,
+             int const fd,
+             char const* const buf,
+             size_t const count)
 {
     size_t offset = 0U;
     while (offset < count) {
         ssize_t const r = write(fd, buf + offset, count - offset);
+        COMLIN_COUNT(state, n_writes, 1U);
         if (r < 0) {
             return COMLIN_BAD_WRITE;
         }
 
         offset += (size_t)r;
+        COMLIN_COUNT(state, n_bytes_written, (size_t)r);
     }
 
     return COMLIN_SUCCESS;
 }
 
+/* Write any pending output to the terminal.
+ *
+ * Output is appended to a buffer in the state, then written only once at the
+ * end of a public call, or at the end of a batch of input if one is being
+ * processed, so a burst of keys costs one write.
+ */
+static ComlinStatus
+flush_output(ComlinState* const state)
+{
+    StringBuf* const output = &state->output;
+    if (state->defer_refresh || !output->length) {
+        return COMLIN_SUCCESS;
+    }
+
+    ComlinStatus const st =
+      write_string(state, state->ofd, output->data, output->length);
+
+    output->length = 0U;
+    return st;
+}
+
 // Set terminal to raw input mode and preserve the original settings
 static ComlinStatus
 enable_raw_mode(ComlinState* const state)
@@ -219,23 +734,23 @@ disable_raw_mode(ComlinState* const state)
 
 // Get the cursor position by communicating with the terminal
 static int
-get_cursor_position(int const ifd, int const ofd)
+get_cursor_position(ComlinState* const state)
 {
     // Send request for cursor location
-    if (write_string(ofd, VTESC "6n", 5)) {
+    if (write_string(state, state->ofd, VTESC "6n", 5)) {
         return -1;
     }
 
     // Read start of response: ESC [
     char buf[32] = {0};
-    if (read_char(ifd, &buf[0]) || buf[0] != ESC || //
-        read_char(ifd, &buf[1]) || buf[1] != '[') {
+    if (read_char(state, &buf[0]) || buf[0] != ESC || //
+        read_char(state, &buf[1]) || buf[1] != '[') {
         return -1;
     }
 
     // Read response body: rows ; cols R
     unsigned int i = 2;
-    while (i < sizeof(buf) && !read_char(ifd, buf + i) && buf[i] != 'R') {
+    while (i < sizeof(buf) && !read_char(state, buf + i) && buf[i] != 'R') {
         ++i;
     }
 
@@ -261,402 +776,3794 @@ get_cursor_position(int const ifd, int const ofd)
     return (int)cols;
 }
 
-// Get the number of columns in the terminal, or fall back to 80
-static int
+/* Get the number of columns in the terminal, or fall back to 80.
+ *
+ * If the terminal doesn't support TIOCGWINSZ, this asks the terminal itself,
+ * but only the first time, since that needs a round trip which can be slow.
+ */
+static size_t
 get_columns(ComlinState* const state)
 {
-    int const ifd = state->ifd;
     int const ofd = state->ofd;
     struct winsize ws = {24U, 80U, 640U, 480U};
 
-    if (isatty(ofd) && (ioctl(ofd, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0)) {
+    if (!isatty(ofd) || (ioctl(ofd, TIOCGWINSZ, &ws) != -1 && ws.ws_col)) {
+        return ws.ws_col;
+    }
+
+    if (!state->probed_cols) {
         // ioctl() failed. Try to query the terminal itself
-        ws.ws_col = 80U;
-        enable_raw_mode(state);
-        if (!write_string(ofd, VTESC "999C", 6)) { // Go to the right margin
-            int const cols = get_cursor_position(ifd, ofd); // Get the column
-            write_string(ofd, "\r", 1); // Return to the left margin
-            ws.ws_col = cols > 0 ? (unsigned short)cols : 80U;
+        bool const raw = state->rawmode;
+        state->probed_cols = 80U;
+        if (!raw) {
+            enable_raw_mode(state);
+        }
+
+        // Write any pending output, then go to the right margin
+        if (!flush_output(state) &&
+            !write_string(state, ofd, VTESC "999C", 6)) {
+            int const cols = get_cursor_position(state); // Get the column
+            write_string(state, ofd, "\r", 1); // Return to the left margin
+            state->probed_cols = cols > 0 ? (size_t)cols : 80U;
+        }
+
+        if (!raw) {
+            disable_raw_mode(state);
         }
-        disable_raw_mode(state);
     }
 
-    return ws.ws_col;
+    return state->probed_cols;
 }
 
 ComlinStatus
 comlin_clear_screen(ComlinState* const state)
 {
-    return write_string(state->ofd, VTESC "H" VTESC "2J", 7);
+    state->drawn.length = 0U;
+    state->drawn_row = 0U;
+    state->drawn_col = 0U;
+    state->oldrows = 1U;
+    buf_append(state, &state->output, VTESC "H" VTESC "2J", 7U);
+    return flush_output(state);
+}
+
+ComlinStatus
+comlin_flush(ComlinState* const state)
+{
+    bool const deferred = state->defer_refresh;
+    state->defer_refresh = false;
+    ComlinStatus const st = flush_output(state);
+    state->defer_refresh = deferred;
+    return st;
 }
 
 /* Beep, used for completion when there is nothing to complete or when all
  * the choices were already shown. */
 static void
-comlin_beep(ComlinState const* const state)
+comlin_beep(ComlinState* const state)
 {
-    if (write(state->ofd, "\x07", 1) != 1) {
-        // Failed to write ASCII BEL, oh well
-    }
+    buf_append(state, &state->output, "\x07", 1U);
 }
 
 /* Completion */
 
+// The minimum size of a chunk of completion text
+#define COMLIN_CHUNK_SIZE 4096U
+
+struct ComlinCompletionIndexImpl {
+    size_t n_words;        ///< Number of words
+    uint32_t const* masks; ///< Character set of each word
+    char const* words[];   ///< Sorted words, followed by masks and text
+};
+
+struct ComlinCompletionChunkImpl {
+    ComlinCompletionChunk* next; ///< Next (older and full) chunk
+    size_t size;                 ///< Size of data
+    size_t length;               ///< Number of bytes used in data
+    char data[];                 ///< Null-terminated completion strings
+};
+
 // Free a list of completion option populated by comlin_add_completion()
 static void
 free_completions(ComlinCompletions* const lc)
 {
-    for (size_t i = 0U; i < lc->len; ++i) {
-        free(lc->cvec[i]);
+    ComlinAllocator const* const allocator = completions_allocator(lc);
+    for (ComlinCompletionChunk* c = lc->chunks; c;) {
+        ComlinCompletionChunk* const next = c->next;
+        allocator->free(allocator->handle, c);
+        c = next;
     }
-    if (lc->cvec != NULL) {
-        free(lc->cvec);
+
+    if (lc->cvec) {
+        allocator->free(allocator->handle, (void*)lc->cvec);
     }
+
+    lc->len = 0U;
+    lc->cvec = NULL;
+    lc->size = 0U;
+    lc->chunks = NULL;
 }
 
-// Show the current line with the proposed completion
-static ComlinStatus
-refresh_line_with_completion(ComlinState* const ls,
-                             ComlinCompletions const* const lc,
-                             unsigned const flags)
+// Return true if the completion line is a prefix of (or equal to) the line
+static bool
+completion_line_matches(ComlinState const* const ls, bool const exact)
 {
-    // Show the edited line with completion if possible, or just refresh
-    if (ls->completion_idx < lc->len) {
-        size_t const saved_pos = ls->pos;
-        StringBuf const saved_buf = ls->buf;
-        ls->buf.data = lc->cvec[ls->completion_idx];
-        ls->pos = ls->buf.length = strlen(ls->buf.data);
-        refresh_line_with_flags(ls, flags);
-        ls->buf = saved_buf;
-        ls->pos = saved_pos;
-        return COMLIN_SUCCESS;
-    }
-    return refresh_line_with_flags(ls, flags);
+    StringBuf const* const line = &ls->completion_line;
+
+    return (!exact || ls->buf.length == line->length) &&
+           line_starts_with(&ls->buf, line->data, line->length);
 }
 
-/* Helper for when the user presses Tab, or another key during completion.
- *
- * If the return is non-zero, it should be handled as a byte read from the
- * input, and process it as usual.  Otherwise, the character was consumed by
- * this function.
- */
-static char
-complete_line(ComlinState* const ls, char const keypressed)
+// Set the completion line to the current line
+static void
+set_completion_line(ComlinState* const ls)
 {
-    ComlinCompletions lc = {0, NULL};
-    char c = keypressed;
-
-    if (ls->buf.length) {
-        ls->completion_callback(ls->buf.data, &lc);
-    }
+    ls->completion_line.length = 0U;
+    buf_append(ls,
+               &ls->completion_line,
+               line_text(ls, &ls->buf),
+               ls->buf.length);
+}
 
-    if (lc.len == 0) {
-        comlin_beep(ls);
-        ls->in_completion = false;
-    } else {
-        switch (c) {
-        case TAB:
-            if (!ls->in_completion) {
-                ls->in_completion = true;
-                ls->completion_idx = 0;
-            } else {
-                ls->completion_idx = (ls->completion_idx + 1) % (lc.len + 1);
-                if (ls->completion_idx == lc.len) {
-                    comlin_beep(ls);
-                }
-            }
-            c = 0;
-            break;
-        case ESC:
-            // Re-show original buffer
-            if (ls->completion_idx < lc.len) {
-                comlin_edit_refresh(ls);
-            }
-            ls->in_completion = false;
-            c = 0;
-            break;
-        default:
-            // Update buffer and return
-            if (ls->completion_idx < lc.len) {
-                ls->pos = strlen(lc.cvec[ls->completion_idx]);
-                ls->buf.length = 0U;
-                buf_append(&ls->buf, lc.cvec[ls->completion_idx], ls->pos);
-            }
-            ls->in_completion = false;
-            break;
-        }
+// Return true if there are cached completions for the current line
+static bool
+have_completions(ComlinState const* const ls)
+{
+    return ls->completions_set && completion_line_matches(ls, true);
+}
 
-        // Show completion or original buffer
-        if (ls->in_completion) {
-            refresh_line_with_completion(ls, &lc, REFRESH_ALL);
+// Return the index of the first word that doesn't sort before a prefix
+static size_t
+index_lower_bound(ComlinCompletionIndex const* const index,
+                  char const* const prefix,
+                  size_t const len,
+                  int const bias)
+{
+    size_t lo = 0U;
+    size_t hi = index->n_words;
+    while (lo < hi) {
+        size_t const mid = lo + ((hi - lo) / 2U);
+        if (strncmp(index->words[mid], prefix, len) < bias) {
+            lo = mid + 1U;
         } else {
-            comlin_edit_refresh(ls);
+            hi = mid;
         }
     }
 
-    free_completions(&lc);
-    return c; // Return last read character
+    return lo;
 }
 
-void
-comlin_set_completion_callback(ComlinState* const state,
-                               ComlinCompletionCallback* const fn)
+// Return a character converted to ASCII lowercase
+static char
+fold_case(char const c)
 {
-    state->completion_callback = fn;
+    return (c >= 'A' && c <= 'Z') ? (char)(c - 'A' + 'a') : c;
 }
 
-static char*
-comlin_copy_string(char const* const str)
+// Return true if a character is an ASCII letter or digit
+static bool
+is_word_char(char const c)
 {
-    size_t const len = strlen(str);
-    size_t const total_size = len + 1U;
-    char* const copy = (char*)malloc(total_size);
+    char const f = fold_case(c);
+    return (f >= 'a' && f <= 'z') || (c >= '0' && c <= '9');
+}
 
-    if (copy) {
-        memcpy(copy, str, total_size);
+/* Return a set of the characters in a string.
+ *
+ * Each character maps to one bit, ignoring case, so a word can only match a
+ * query if its mask contains every bit in the query's.  This rejects most
+ * candidates with a single test, before scoring.
+ */
+static uint32_t
+char_mask(char const* const str, size_t const len)
+{
+    uint32_t mask = 0U;
+    for (size_t i = 0U; i < len; ++i) {
+        mask |= 1U << ((unsigned)(unsigned char)fold_case(str[i]) & 31U);
     }
 
-    return copy;
+    return mask;
 }
 
-ComlinStatus
-comlin_add_completion(ComlinCompletions* const lc, char const* const str)
+// Return the score of a fuzzy match of a query in a word, or 0 if none
+static unsigned
+fuzzy_score(char const* const word,
+            char const* const query,
+            size_t const query_len)
 {
-    size_t const cvec_size = sizeof(char*) * (lc->len + 1U);
-    char** const cvec = (char**)realloc(lc->cvec, cvec_size);
-    if (!cvec) {
-        return COMLIN_NO_MEMORY;
-    }
+    unsigned score = 0U;
+    bool consecutive = false;
+    size_t q = 0U;
+    for (size_t i = 0U; word[i] && q < query_len; ++i) {
+        if (fold_case(word[i]) != fold_case(query[q])) {
+            consecutive = false;
+            continue;
+        }
 
-    lc->cvec = cvec;
+        bool const start = !i || !is_word_char(word[i - 1U]) ||
+                           (word[i - 1U] >= 'a' && word[i - 1U] <= 'z' &&
+                            word[i] >= 'A' && word[i] <= 'Z');
 
-    char* const copy = comlin_copy_string(str);
-    if (!copy) {
+        score += 1U + (consecutive ? 2U : 0U) + (start ? 3U : 0U);
+        consecutive = true;
+        ++q;
+    }
+
+    return (q == query_len) ? score : 0U;
+}
+
+static int
+compare_fuzzy_matches(void const* const lhs, void const* const rhs)
+{
+    FuzzyMatch const* const l = (FuzzyMatch const*)lhs;
+    FuzzyMatch const* const r = (FuzzyMatch const*)rhs;
+
+    if (l->score != r->score) {
+        return (l->score > r->score) ? -1 : 1;
+    }
+
+    if (l->length != r->length) {
+        return (l->length < r->length) ? -1 : 1;
+    }
+
+    return (l->index < r->index) ? -1 : (l->index > r->index);
+}
+
+// Set the index matches to the ranked words that fuzzily match the line
+static CompletionList
+get_fuzzy_completions(ComlinState* const ls)
+{
+    ComlinCompletionIndex const* const index = ls->completion_index;
+    CompletionList* const matches = &ls->index_matches;
+    if (have_completions(ls)) {
+        return *matches; // Ranking for this line is still valid
+    }
+
+    // Grow the arrays of matches to fit every word if necessary
+    matches->len = 0U;
+    if (ls->fuzzy_size < index->n_words) {
+        FuzzyMatch* const fuzzy = (FuzzyMatch*)state_realloc(
+          ls, ls->fuzzy_matches, index->n_words * sizeof(FuzzyMatch));
+        if (fuzzy) {
+            ls->fuzzy_matches = fuzzy;
+        }
+
+        char const** const words = (char const**)state_realloc(
+          ls, (void*)ls->fuzzy_words, index->n_words * sizeof(char const*));
+        if (words) {
+            ls->fuzzy_words = words;
+        }
+
+        if (!fuzzy || !words) {
+            return *matches;
+        }
+
+        ls->fuzzy_size = index->n_words;
+    }
+
+    // Score every word that has all the characters in the line
+    char const* const line = line_text(ls, &ls->buf);
+    size_t const len = ls->buf.length;
+    uint32_t const mask = char_mask(line, len);
+    size_t n = 0U;
+    for (size_t i = 0U; len && i < index->n_words; ++i) {
+        if ((index->masks[i] & mask) == mask) {
+            char const* const word = index->words[i];
+            unsigned const score = fuzzy_score(word, line, len);
+            if (score) {
+                FuzzyMatch const match = {score, strlen(word), i};
+                ls->fuzzy_matches[n++] = match;
+            }
+        }
+    }
+
+    // Rank the matches
+    qsort(ls->fuzzy_matches, n, sizeof(FuzzyMatch), compare_fuzzy_matches);
+    for (size_t i = 0U; i < n; ++i) {
+        ls->fuzzy_words[i] = index->words[ls->fuzzy_matches[i].index];
+    }
+
+    matches->cvec = ls->fuzzy_words;
+    matches->len = n;
+    set_completion_line(ls);
+    ls->completions_set = true;
+    return *matches;
+}
+
+// Set the index matches to the range of words that start with the line
+static CompletionList
+get_index_completions(ComlinState* const ls)
+{
+    if (ls->fuzzymode) {
+        return get_fuzzy_completions(ls);
+    }
+
+    ComlinCompletionIndex const* const index = ls->completion_index;
+    CompletionList* const matches = &ls->index_matches;
+    char const* const line = line_text(ls, &ls->buf);
+    size_t const len = ls->buf.length;
+
+    matches->len = 0U;
+    if (len) {
+        size_t const first = index_lower_bound(index, line, len, 0);
+        size_t const last = index_lower_bound(index, line, len, 1);
+        matches->cvec = &index->words[first];
+        matches->len = last - first;
+    }
+
+    return *matches;
+}
+
+// Return the completions for the current line, calling the callback if needed
+static CompletionList
+get_completions(ComlinState* const ls)
+{
+    if (ls->completion_index) {
+        return get_index_completions(ls);
+    }
+
+    if (!have_completions(ls)) {
+        free_completions(&ls->completions);
+        ls->completions.allocator = &ls->allocator;
+        if (ls->buf.length && ls->completion_callback) {
+            char const* const line = line_text(ls, &ls->buf);
+            double const start = completion_start();
+            ls->completion_callback(line, &ls->completions);
+            completion_end(ls, start);
+        }
+
+        set_completion_line(ls);
+        ls->completions_set = true;
+    }
+
+    CompletionList const list = {ls->completions.len, ls->completions.cvec};
+    return list;
+}
+
+// Forget any cached completions, so the callback is called again
+static void
+reset_completions(ComlinState* const ls)
+{
+    free_completions(&ls->completions);
+    ls->completions_set = false;
+    ls->completion_pending = false;
+}
+
+// Start an asynchronous request for completions of the current line
+static ComlinStatus
+request_completions(ComlinState* const ls)
+{
+    if (!ls->buf.length) {
+        comlin_beep(ls);
+        return COMLIN_EDITING;
+    }
+
+    reset_completions(ls);
+    set_completion_line(ls);
+    ls->completion_pending = true;
+
+    double const start = completion_start();
+    ls->async_completion(
+      ls, ++ls->completion_request, ls->completion_line.data);
+    completion_end(ls, start);
+    return COMLIN_EDITING;
+}
+
+// Show the current line with the proposed completion
+static ComlinStatus
+refresh_line_with_completion(ComlinState* const ls,
+                             CompletionList const* const lc,
+                             unsigned const flags)
+{
+    // Show the edited line with completion if possible, or just refresh
+    if (ls->completion_idx < lc->len) {
+        char const* const candidate = lc->cvec[ls->completion_idx];
+        size_t const saved_pos = ls->pos;
+        LineBuf const saved_buf = ls->buf;
+        if (!line_set(
+              ls, &ls->shown, candidate, strlen(candidate), ls->maskmode)) {
+            return COMLIN_NO_MEMORY;
+        }
+
+        ls->buf = ls->shown;
+        ls->pos = ls->buf.length;
+        refresh_line_with_flags(ls, flags);
+        ls->shown = ls->buf;
+        ls->buf = saved_buf;
+        ls->pos = saved_pos;
+        return COMLIN_SUCCESS;
+    }
+    return refresh_line_with_flags(ls, flags);
+}
+
+/* Helper for when the user presses Tab, or another key during completion.
+ *
+ * If the return is non-zero, it should be handled as a byte read from the
+ * input, and process it as usual.  Otherwise, the character was consumed by
+ * this function.
+ */
+static char
+complete_line(ComlinState* const ls, char const keypressed)
+{
+    CompletionList const lc = get_completions(ls);
+    char c = keypressed;
+
+    if (lc.len == 0) {
+        comlin_beep(ls);
+        ls->in_completion = false;
+    } else {
+        switch (c) {
+        case TAB:
+            if (!ls->in_completion) {
+                ls->in_completion = true;
+                ls->completion_idx = 0;
+            } else {
+                ls->completion_idx = (ls->completion_idx + 1) % (lc.len + 1);
+                if (ls->completion_idx == lc.len) {
+                    comlin_beep(ls);
+                }
+            }
+            c = 0;
+            break;
+        case ESC:
+            // Re-show original buffer
+            if (ls->completion_idx < lc.len) {
+                comlin_edit_refresh(ls);
+            }
+            ls->in_completion = false;
+            c = 0;
+            break;
+        default:
+            // Update buffer and return
+            if (ls->completion_idx < lc.len) {
+                char const* const candidate = lc.cvec[ls->completion_idx];
+                size_t const len = strlen(candidate);
+                ls->pos = edit_replace(ls, candidate, len) ? len : 0U;
+            }
+            ls->in_completion = false;
+            break;
+        }
+
+        // Show completion or original buffer
+        if (ls->in_completion) {
+            refresh_line_with_completion(ls, &lc, REFRESH_ALL);
+        } else {
+            comlin_edit_refresh(ls);
+        }
+    }
+
+    return c; // Return last read character
+}
+
+void
+comlin_set_completion_callback(ComlinState* const state,
+                               ComlinCompletionCallback* const fn)
+{
+    state->completion_callback = fn;
+    reset_completions(state);
+}
+
+static int
+compare_words(void const* const lhs, void const* const rhs)
+{
+    return strcmp(*(char const* const*)lhs, *(char const* const*)rhs);
+}
+
+ComlinCompletionIndex*
+comlin_new_completion_index(char const* const* const words,
+                            size_t const n_words)
+{
+    // Allocate a single block for the header, word pointers, masks, and text
+    size_t const header_size =
+      sizeof(ComlinCompletionIndex) +
+      (n_words * (sizeof(char const*) + sizeof(uint32_t)));
+    size_t size = header_size;
+    for (size_t i = 0U; i < n_words; ++i) {
+        size += strlen(words[i]) + 1U;
+    }
+
+    ComlinCompletionIndex* const index = (ComlinCompletionIndex*)malloc(size);
+    if (!index) {
+        return NULL;
+    }
+
+    // Copy the text and sort the pointers to it
+    char* text = (char*)index + header_size;
+    for (size_t i = 0U; i < n_words; ++i) {
+        size_t const len = strlen(words[i]);
+        memcpy(text, words[i], len + 1U);
+        index->words[i] = text;
+        text += len + 1U;
+    }
+
+    qsort((void*)index->words, n_words, sizeof(char const*), compare_words);
+
+    // Remove duplicates (leaving their text unused)
+    size_t n = 0U;
+    for (size_t i = 0U; i < n_words; ++i) {
+        if (!n || strcmp(index->words[n - 1U], index->words[i])) {
+            index->words[n++] = index->words[i];
+        }
+    }
+
+    // Calculate the character set of every word for fuzzy matching
+    uint32_t* const masks = (uint32_t*)(void*)(index->words + n_words);
+    for (size_t i = 0U; i < n; ++i) {
+        masks[i] = char_mask(index->words[i], strlen(index->words[i]));
+    }
+
+    index->n_words = n;
+    index->masks = masks;
+    return index;
+}
+
+void
+comlin_free_completion_index(ComlinCompletionIndex* const index)
+{
+    free(index);
+}
+
+void
+comlin_set_completion_index(ComlinState* const state,
+                            ComlinCompletionIndex const* const index)
+{
+    state->completion_index = index;
+    reset_completions(state);
+}
+
+void
+comlin_set_async_completion_callback(ComlinState* const state,
+                                     ComlinAsyncCompletionCallback* const fn)
+{
+    state->async_completion = fn;
+    reset_completions(state);
+}
+
+ComlinStatus
+comlin_push_completions(ComlinState* const state,
+                        size_t const request,
+                        ComlinCompletions* const completions)
+{
+    static ComlinCompletions const empty = {0U, NULL, 0U, NULL, NULL};
+
+    // Drop stale completions without redrawing
+    if (!state->completion_pending || request != state->completion_request ||
+        !completion_line_matches(state, false)) {
+        free_completions(completions);
+        return COMLIN_SUCCESS;
+    }
+
+    // Drop candidates that don't match what has been typed since the request
+    if (state->buf.length > state->completion_line.length) {
+        char const* const line = line_text(state, &state->buf);
+        size_t n = 0U;
+        for (size_t i = 0U; i < completions->len; ++i) {
+            char const* const candidate = completions->cvec[i];
+            if (!strncmp(candidate, line, state->buf.length)) {
+                completions->cvec[n++] = candidate;
+            }
+        }
+
+        completions->len = n;
+    }
+
+    // Take over the completions and show them like a synchronous completion
+    ComlinAllocator const* const allocator = completions->allocator;
+    reset_completions(state);
+    state->completions = *completions;
+    *completions = empty;
+    completions->allocator = allocator;
+    set_completion_line(state);
+    state->completions_set = true;
+    if (!state->completions.len) {
+        comlin_beep(state);
+        return flush_output(state);
+    }
+
+    state->in_completion = true;
+    state->completion_idx = 0U;
+    CompletionList const lc = {state->completions.len,
+                               state->completions.cvec};
+    ComlinStatus const st =
+      refresh_line_with_completion(state, &lc, REFRESH_ALL);
+    return st ? st : flush_output(state);
+}
+
+ComlinStatus
+comlin_add_static_completion(ComlinCompletions* const lc,
+                             char const* const str)
+{
+    if (lc->len == lc->size) {
+        ComlinAllocator const* const allocator = completions_allocator(lc);
+        size_t const size = lc->size ? 2U * lc->size : 16U;
+        char const** const cvec = (char const**)allocator->realloc(
+          allocator->handle, (void*)lc->cvec, size * sizeof(char*));
+        if (!cvec) {
+            return COMLIN_NO_MEMORY;
+        }
+
+        lc->cvec = cvec;
+        lc->size = size;
+    }
+
+    lc->cvec[lc->len++] = str;
+    return COMLIN_SUCCESS;
+}
+
+ComlinStatus
+comlin_add_completion_n(ComlinCompletions* const lc,
+                        char const* const str,
+                        size_t const len)
+{
+    // Start a new chunk, twice as large as the last, if there's no space
+    ComlinCompletionChunk* chunk = lc->chunks;
+    if (!chunk || chunk->size - chunk->length <= len) {
+        size_t size = chunk ? 2U * chunk->size : COMLIN_CHUNK_SIZE;
+        while (size <= len) {
+            size *= 2U;
+        }
+
+        ComlinAllocator const* const allocator = completions_allocator(lc);
+        chunk = (ComlinCompletionChunk*)allocator->alloc(
+          allocator->handle, sizeof(ComlinCompletionChunk) + size);
+        if (!chunk) {
+            return COMLIN_NO_MEMORY;
+        }
+
+        chunk->next = lc->chunks;
+        chunk->size = size;
+        chunk->length = 0U;
+        lc->chunks = chunk;
+    }
+
+    char* const copy = chunk->data + chunk->length;
+    ComlinStatus const st = comlin_add_static_completion(lc, copy);
+    if (!st) {
+        memcpy(copy, str, len);
+        copy[len] = '\0';
+        chunk->length += len + 1U;
+    }
+
+    return st;
+}
+
+ComlinStatus
+comlin_add_completion(ComlinCompletions* const lc, char const* const str)
+{
+    return comlin_add_completion_n(lc, str, strlen(str));
+}
+
+/* String Buffer */
+
+static void
+buf_append(ComlinState* const state,
+           StringBuf* const buf,
+           char const* const s,
+           size_t const len)
+{
+    assert(s);
+
+    size_t const new_length = buf->length + len;
+    size_t const needed_size = new_length + 1U;
+    if (needed_size > buf->size) {
+        // Grow geometrically so repeated appends don't reallocate every time
+        size_t const new_size =
+          needed_size > 2U * buf->size ? needed_size : 2U * buf->size;
+        char* const new_data = (char*)state_realloc(state, buf->data, new_size);
+        if (!new_data) {
+            return;
+        }
+
+        buf->data = new_data;
+        buf->size = new_size;
+    }
+
+    assert(buf->data);
+    memcpy(buf->data + buf->length, s, len);
+    buf->data[new_length] = '\0';
+    buf->length = new_length;
+}
+
+static size_t
+format_size(char* const buf, size_t x)
+{
+    size_t i = 0U;
+
+    // Write digits backwards
+    do {
+        buf[i++] = (char)('0' + (x % 10U));
+        x /= 10U;
+    } while (x);
+
+    // Terminate and reverse string
+    buf[i] = '\0';
+    if (i) {
+        for (size_t l = 0U, r = i - 1U; l < r; ++l, --r) {
+            char const t = buf[l];
+            buf[l] = buf[r];
+            buf[r] = t;
+        }
+    }
+
+    return i;
+}
+
+// Append an escape like `ESC [ n s` with a number and a suffix letter
+static void
+buf_append_vtesc(ComlinState* const state,
+                 StringBuf* const buf,
+                 size_t const num,
+                 char const suffix)
+{
+    size_t end = 2U;
+    char seq[64] = {'\x1B', '[', 0};
+
+    end += format_size(seq + 2U, num);
+    seq[end++] = suffix;
+
+    buf_append(state, buf, seq, end);
+}
+
+// Append a horizontal cursor movement from column `from` to column `to`
+static void
+buf_append_column_move(ComlinState* const state,
+                       StringBuf* const buf,
+                       size_t const from,
+                       size_t const to)
+{
+    if (!to && from) {
+        buf_append(state, buf, "\r", 1U);
+    } else if (to < from) {
+        buf_append_vtesc(state, buf, from - to, 'D');
+    } else if (to > from) {
+        buf_append_vtesc(state, buf, to - from, 'C');
+    }
+}
+
+static void
+buf_free(ComlinState* const state, StringBuf* const buf)
+{
+    state_free(state, buf->data);
+}
+
+/* UTF-8 */
+
+// A range of code points
+typedef struct {
+    uint32_t first; ///< First code point in range
+    uint32_t last;  ///< Last code point in range
+} CodeRange;
+
+// Return true if a byte is a UTF-8 continuation byte
+static inline bool
+is_continuation(char const c)
+{
+    return ((uint8_t)c & 0xC0U) == 0x80U;
+}
+
+// Return the length of a UTF-8 sequence from its first byte, or 1 if invalid
+static size_t
+utf8_sequence_length(char const c)
+{
+    uint8_t const b = (uint8_t)c;
+    return (b >= 0xC2U && b <= 0xDFU)   ? 2U
+           : (b >= 0xE0U && b <= 0xEFU) ? 3U
+           : (b >= 0xF0U && b <= 0xF4U) ? 4U
+                                        : 1U;
+}
+
+/* Decode the character at the start of some text.
+ *
+ * Returns the length of the character in bytes, and sets `*code` to its code
+ * point.  An invalid or truncated sequence is treated as a single replacement
+ * character, so a byte that isn't a continuation always starts a character.
+ */
+static size_t
+utf8_decode(char const* const text, size_t const len, uint32_t* const code)
+{
+    static uint32_t const min_code[] = {0U, 0U, 0x80U, 0x800U, 0x10000U};
+
+    size_t const n = utf8_sequence_length(text[0]);
+    uint32_t c = (uint8_t)text[0];
+    bool valid = n <= len && (n > 1U || c < 0x80U);
+    if (n > 1U) {
+        c &= 0x7FU >> n;
+        for (size_t i = 1U; valid && i < n; ++i) {
+            valid = is_continuation(text[i]);
+            c = (c << 6U) | ((uint8_t)text[i] & 0x3FU);
+        }
+
+        valid = valid && c >= min_code[n] && c <= 0x10FFFFU &&
+                (c < 0xD800U || c > 0xDFFFU);
+    }
+
+    *code = valid ? c : 0xFFFDU;
+    return valid ? n : 1U;
+}
+
+// Return true if a code point is in a sorted array of ranges
+static bool
+in_ranges(CodeRange const* const ranges, size_t const n, uint32_t const code)
+{
+    size_t lo = 0U;
+    size_t hi = n;
+    while (lo < hi) {
+        size_t const mid = lo + ((hi - lo) / 2U);
+        if (code > ranges[mid].last) {
+            lo = mid + 1U;
+        } else if (code < ranges[mid].first) {
+            hi = mid;
+        } else {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/* Return the number of columns a character takes up on a terminal.
+ *
+ * This is an approximation of `wcwidth()` that doesn't depend on the locale,
+ * with combining marks and zero-width spaces taking no columns, and the East
+ * Asian wide and fullwidth blocks (and emoji) taking two.
+ */
+static size_t
+char_width(uint32_t const code)
+{
+    static CodeRange const zero[] = {
+      {0x0300U, 0x036FU}, {0x0483U, 0x0489U}, {0x0591U, 0x05BDU},
+      {0x0610U, 0x061AU}, {0x064BU, 0x065FU}, {0x0E31U, 0x0E31U},
+      {0x0E34U, 0x0E3AU}, {0x1AB0U, 0x1AFFU}, {0x1DC0U, 0x1DFFU},
+      {0x200BU, 0x200FU}, {0x20D0U, 0x20FFU}, {0xFE00U, 0xFE0FU},
+      {0xFE20U, 0xFE2FU},
+    };
+
+    static CodeRange const wide[] = {
+      {0x1100U, 0x115FU},   {0x231AU, 0x231BU},   {0x2329U, 0x232AU},
+      {0x23E9U, 0x23ECU},   {0x23F0U, 0x23F0U},   {0x23F3U, 0x23F3U},
+      {0x25FDU, 0x25FEU},   {0x2614U, 0x2615U},   {0x2648U, 0x2653U},
+      {0x267FU, 0x267FU},   {0x2693U, 0x2693U},   {0x26A1U, 0x26A1U},
+      {0x26AAU, 0x26ABU},   {0x26BDU, 0x26BEU},   {0x26C4U, 0x26C5U},
+      {0x26CEU, 0x26CEU},   {0x26D4U, 0x26D4U},   {0x26EAU, 0x26EAU},
+      {0x26F2U, 0x26F3U},   {0x26F5U, 0x26F5U},   {0x26FAU, 0x26FAU},
+      {0x26FDU, 0x26FDU},   {0x2705U, 0x2705U},   {0x270AU, 0x270BU},
+      {0x2728U, 0x2728U},   {0x274CU, 0x274CU},   {0x274EU, 0x274EU},
+      {0x2753U, 0x2755U},   {0x2757U, 0x2757U},   {0x2795U, 0x2797U},
+      {0x27B0U, 0x27B0U},   {0x27BFU, 0x27BFU},   {0x2B1BU, 0x2B1CU},
+      {0x2B50U, 0x2B50U},   {0x2B55U, 0x2B55U},   {0x2E80U, 0x303EU},
+      {0x3041U, 0x33FFU},   {0x3400U, 0x4DBFU},   {0x4E00U, 0x9FFFU},
+      {0xA000U, 0xA4CFU},   {0xA960U, 0xA97FU},   {0xAC00U, 0xD7A3U},
+      {0xF900U, 0xFAFFU},   {0xFE10U, 0xFE19U},   {0xFE30U, 0xFE6FU},
+      {0xFF00U, 0xFF60U},   {0xFFE0U, 0xFFE6U},   {0x16FE0U, 0x16FE4U},
+      {0x17000U, 0x18CFFU}, {0x1B000U, 0x1B2FFU}, {0x1F004U, 0x1F004U},
+      {0x1F0CFU, 0x1F0CFU}, {0x1F18EU, 0x1F18EU}, {0x1F191U, 0x1F19AU},
+      {0x1F200U, 0x1F202U}, {0x1F210U, 0x1F23BU}, {0x1F240U, 0x1F248U},
+      {0x1F250U, 0x1F251U}, {0x1F260U, 0x1F265U}, {0x1F300U, 0x1F64FU},
+      {0x1F680U, 0x1F6FFU}, {0x1F7E0U, 0x1F7EBU}, {0x1F90CU, 0x1F9FFU},
+      {0x1FA70U, 0x1FAFFU}, {0x20000U, 0x2FFFDU}, {0x30000U, 0x3FFFDU},
+    };
+
+    return (code < 0x0300U)                                       ? 1U
+           : in_ranges(zero, sizeof(zero) / sizeof(CodeRange), code) ? 0U
+           : in_ranges(wide, sizeof(wide) / sizeof(CodeRange), code) ? 2U
+                                                                     : 1U;
+}
+
+/* Return the length of the escape sequence at the start of some text.
+ *
+ * This is a control sequence like `ESC [ 3 1 m`, an operating system command
+ * ended by BEL or `ESC \`, or ESC and one other character.  A sequence that
+ * isn't finished takes up the rest of the text.
+ */
+static size_t
+escape_length(char const* const text, size_t const len)
+{
+    if (len < 2U) {
+        return len;
+    }
+
+    size_t i = 2U;
+    if (text[1] == '[') {
+        // Skip parameter and intermediate bytes to the final byte
+        while (i < len && (uint8_t)text[i] >= 0x20U &&
+               (uint8_t)text[i] <= 0x3FU) {
+            ++i;
+        }
+
+        return i < len ? i + 1U : len;
+    }
+
+    if (text[1] == ']') {
+        for (; i < len; ++i) {
+            if (text[i] == '\a') {
+                return i + 1U;
+            }
+
+            if (text[i] == ESC && i + 1U < len && text[i + 1U] == '\\') {
+                return i + 2U;
+            }
+        }
+
+        return len;
+    }
+
+    return 2U;
+}
+
+// Return true if an escape sequence of some length sets or resets the style
+static inline bool
+is_style_escape(char const* const text, size_t const len)
+{
+    return len >= 3U && text[1] == '[' && text[len - 1U] == 'm';
+}
+
+// Return true if an escape sequence of some length resets the style
+static inline bool
+is_reset_escape(char const* const text, size_t const len)
+{
+    return is_style_escape(text, len) &&
+           (len == 3U || (len == 4U && text[2] == '0'));
+}
+
+// Return the number of columns some text takes up, where escapes take none
+static size_t
+text_width(char const* const text, size_t const len)
+{
+    size_t width = 0U;
+    for (size_t i = 0U; i < len;) {
+        if (text[i] == ESC) {
+            i += escape_length(text + i, len - i);
+        } else {
+            uint32_t code = 0U;
+            i += utf8_decode(text + i, len - i, &code);
+            width += char_width(code);
+        }
+    }
+
+    return width;
+}
+
+/* Columns */
+
+/* The columns of every byte in rendered text are kept in an index, so the
+ * layout can be calculated without decoding the text on every refresh.  Each
+ * byte maps to the column where its character starts, followed by the total
+ * width, so the array is sorted and can be binary searched to map a column
+ * back to a byte offset. */
+
+// Reserve space for the columns of some text
+static bool
+columns_reserve(ComlinState* const state,
+                ColumnIndex* const index,
+                size_t const len)
+{
+    if (len + 1U > index->size) {
+        size_t const size =
+          len + 1U > 2U * index->size ? len + 1U : 2U * index->size;
+        Column* const data =
+          (Column*)state_realloc(state, index->data, size * sizeof(Column));
+        if (!data) {
+            return false;
+        }
+
+        index->data = data;
+        index->size = size;
+    }
+
+    return true;
+}
+
+/* Set the columns of characters from `i`, which starts at column `*col`.
+ *
+ * This continues up to `end`, and past it to the end of the character there,
+ * then returns the offset where it stopped.  Masked characters are one column
+ * wide, since each is shown as an asterisk.
+ */
+static size_t
+columns_scan(Column* const columns,
+             char const* const text,
+             size_t const len,
+             size_t i,
+             size_t* const col,
+             size_t const end,
+             bool const masked)
+{
+    while (i < len && (i < end || is_continuation(text[i]))) {
+        uint32_t code = 0U;
+        size_t const n = utf8_decode(text + i, len - i, &code);
+        for (size_t k = 0U; k < n; ++k) {
+            columns[i + k] = (Column)*col;
+        }
+
+        *col += masked ? 1U : char_width(code);
+        i += n;
+    }
+
+    return i;
+}
+
+/* Set the columns of some rendered text, starting at column `*col`.
+ *
+ * The text may contain escape sequences, which take no columns, so every byte
+ * in one has the column of the character after it.
+ */
+static void
+columns_scan_rendered(Column* const columns,
+                      char const* const text,
+                      size_t const len,
+                      size_t* const col)
+{
+    for (size_t i = 0U; i < len;) {
+        if (text[i] == ESC) {
+            size_t const n = escape_length(text + i, len - i);
+            for (size_t k = 0U; k < n; ++k) {
+                columns[i + k] = (Column)*col;
+            }
+
+            i += n;
+        } else {
+            char const* const esc = (char const*)memchr(text + i, ESC, len - i);
+            size_t const end = esc ? (size_t)(esc - text) : len;
+            i = columns_scan(columns, text, len, i, col, end, false);
+        }
+    }
+}
+
+// Calculate the columns of all of some rendered text
+static bool
+columns_build(ComlinState* const state,
+              ColumnIndex* const index,
+              char const* const text,
+              size_t const len)
+{
+    index->valid = columns_reserve(state, index, len);
+    if (index->valid) {
+        size_t col = 0U;
+        columns_scan_rendered(index->data, text, len, &col);
+        index->data[len] = (Column)col;
+    }
+
+    return index->valid;
+}
+
+// Return the start of the code point that ends at `pos` in some text
+static size_t
+prev_code_point(char const* const text, size_t const pos, uint32_t* const code)
+{
+    size_t i = pos - 1U;
+    while (i && pos - i < 4U && is_continuation(text[i])) {
+        --i;
+    }
+
+    if (utf8_decode(text + i, pos - i, code) != pos - i) {
+        utf8_decode(text + pos - 1U, 1U, code);
+        i = pos - 1U;
+    }
+
+    return i;
+}
+
+/* Return the end of a row of text that starts at `from`.
+ *
+ * This is the start of the first character that ends past the column
+ * `limit`, or `to` if everything fits.  A wide character that straddles the
+ * limit is moved to the next row, but a row always contains at least one
+ * character.
+ */
+static size_t
+row_end(char const* const text,
+        Column const* const columns,
+        size_t const from,
+        size_t const to,
+        size_t const limit)
+{
+    if (columns[to] <= limit) {
+        return to;
+    }
+
+    // Find the first byte that starts past the limit
+    size_t lo = from + 1U;
+    size_t hi = to;
+    while (lo < hi) {
+        size_t const mid = lo + ((hi - lo) / 2U);
+        if (columns[mid] <= limit) {
+            lo = mid + 1U;
+        } else {
+            hi = mid;
+        }
+    }
+
+    // The character before it is the first that doesn't fit
+    size_t end = lo - 1U;
+    while (end > from && is_continuation(text[end])) {
+        --end;
+    }
+
+    return end > from ? end : lo;
+}
+
+// Return true if the character at `i` in some text has no width
+static bool
+is_zero_width(char const* const text,
+              Column const* const columns,
+              size_t const i,
+              size_t const len)
+{
+    if (text[i] == ESC) {
+        return false; // The start of an escape sequence, not a character
+    }
+
+    size_t next = i + 1U;
+    while (next < len && is_continuation(text[next])) {
+        ++next;
+    }
+
+    return columns[next] == columns[i];
+}
+
+/* Line Buffer */
+
+/* The line is stored in a gap buffer, with the free space where it was last
+ * edited, so typing or deleting at the cursor doesn't move the rest of the
+ * line.  The gap is only moved to the end, to make the text contiguous, when
+ * the whole string is needed.
+ *
+ * The columns of bytes are kept in a parallel array with a gap in the same
+ * place.  Before the gap, each is the column where the byte's character
+ * starts.  After it, each is the distance from there to the end of the line,
+ * so an edit doesn't change the columns of anything after it.  There is an
+ * extra zero at the end, for the end of the line.  When the line is edited,
+ * only the characters in the edit are decoded. */
+
+// Return the length of the gap in the line
+static inline size_t
+line_gap_length(LineBuf const* const line)
+{
+    return line->size - line->length;
+}
+
+// Return the byte at an offset in the line
+static inline char
+line_byte(LineBuf const* const line, size_t const i)
+{
+    return line->data[i < line->gap ? i : i + line_gap_length(line)];
+}
+
+// Return the column of the byte at an offset in the line, or the width
+static inline size_t
+line_column(LineBuf const* const line, size_t const i)
+{
+    return (i < line->gap)
+             ? line->columns[i]
+             : line->width - line->columns[i + line_gap_length(line)];
+}
+
+// Allocate the columns of the line if necessary, which are empty
+static bool
+line_reserve_columns(ComlinState* const state, LineBuf* const line)
+{
+    if (!line->columns) {
+        line->columns = (Column*)state_realloc(
+          state, NULL, (line->size + 1U) * sizeof(Column));
+        if (!line->columns) {
+            return false;
+        }
+
+        line->columns[line->size] = 0U;
+    }
+
+    return true;
+}
+
+/* Reserve space to insert some bytes, keeping at least one for a terminator.
+ *
+ * The columns are only kept while they're valid, so they're freed when the
+ * line grows otherwise, and never allocated for a line that's never shown,
+ * like one read from a stream.  They're either null, or one larger than the
+ * text.
+ */
+static bool
+line_reserve(ComlinState* const state, LineBuf* const line, size_t const len)
+{
+    if (len > COMLIN_MAX_LENGTH - line->length) {
+        return false; // Too long for the columns to fit
+    }
+
+    if (line->length + len >= line->size) {
+        size_t const needed = line->length + len + 1U;
+        size_t const size =
+          needed > 2U * line->size ? needed : 2U * line->size;
+
+        char* const data = (char*)state_realloc(state, line->data, size);
+        if (!data) {
+            return false;
+        }
+
+        line->data = data;
+        Column* columns = NULL;
+        if (line->valid) {
+            columns = (Column*)state_realloc(
+              state, line->columns, (size + 1U) * sizeof(Column));
+            if (!columns) {
+                return false;
+            }
+        } else {
+            state_free(state, line->columns);
+        }
+
+        // Move the text and columns after the gap to the new end
+        size_t const tail = line->length - line->gap;
+        line->columns = columns;
+        memmove(data + size - tail, data + line->size - tail, tail);
+        if (columns) {
+            memmove(columns + size - tail,
+                    columns + line->size - tail,
+                    tail * sizeof(Column));
+            columns[size] = 0U;
+        }
+
+        line->size = size;
+    }
+
+    return !line->valid || line_reserve_columns(state, line);
+}
+
+// Move the gap in the line to an offset
+static void
+line_move_gap(LineBuf* const line, size_t const pos)
+{
+    size_t const gap_len = line_gap_length(line);
+    char* const data = line->data;
+    Column* const columns = line->columns;
+    Column const width = (Column)line->width;
+    if (pos < line->gap) {
+        // Move text before the gap to after it, measuring from the end
+        size_t const n = line->gap - pos;
+        memmove(data + pos + gap_len, data + pos, n);
+        for (size_t i = n; line->valid && i-- > 0U;) {
+            columns[pos + gap_len + i] = width - columns[pos + i];
+        }
+    } else if (pos > line->gap) {
+        // Move text after the gap to before it, measuring from the start
+        size_t const n = pos - line->gap;
+        memmove(data + line->gap, data + line->gap + gap_len, n);
+        for (size_t i = 0U; line->valid && i < n; ++i) {
+            columns[line->gap + i] = width - columns[line->gap + gap_len + i];
+        }
+    }
+
+    line->gap = pos;
+}
+
+// Calculate the columns of the whole line if they aren't up to date
+static bool
+line_update_columns(ComlinState* const state,
+                    LineBuf* const line,
+                    bool const masked)
+{
+    if (!line->valid && line_reserve(state, line, 0U) &&
+        line_reserve_columns(state, line)) {
+        line_move_gap(line, line->length);
+
+        size_t col = 0U;
+        columns_scan(line->columns,
+                     line->data,
+                     line->length,
+                     0U,
+                     &col,
+                     line->length,
+                     masked);
+        line->width = col;
+        line->valid = true;
+    }
+
+    return line->valid;
+}
+
+// Insert text at an offset in the line
+static bool
+line_insert(ComlinState* const state,
+            LineBuf* const line,
+            size_t const pos,
+            char const* const text,
+            size_t const len,
+            bool const masked)
+{
+    if (!line_reserve(state, line, len)) {
+        return false;
+    }
+
+    line_move_gap(line, pos);
+    memcpy(line->data + pos, text, len);
+
+    // Calculate the columns of the inserted text, unless it joins a neighbour
+    bool const joins =
+      (len && is_continuation(text[0])) ||
+      (pos < line->length && is_continuation(line_byte(line, pos)));
+    if (line->valid && !joins) {
+        size_t const start = line_column(line, pos);
+        size_t col = start;
+        columns_scan(
+          line->columns, line->data, pos + len, pos, &col, pos + len, masked);
+        line->width += col - start;
+    } else {
+        line->valid = false;
+    }
+
+    line->gap += len;
+    line->length += len;
+    line->generation = ++state->generation;
+    return true;
+}
+
+// Erase a range of text from the line
+static void
+line_erase(ComlinState* const state,
+           LineBuf* const line,
+           size_t const start,
+           size_t const end)
+{
+    if (start == end) {
+        return;
+    }
+
+    // Recalculate everything if this splits a character
+    if (is_continuation(line_byte(line, start)) ||
+        (end < line->length && is_continuation(line_byte(line, end)))) {
+        line->valid = false;
+    }
+
+    // Extend the gap forwards or backwards over the range
+    line_move_gap(line, line->gap <= start ? start : end);
+    if (line->valid) {
+        line->width -= line_column(line, end) - line_column(line, start);
+    }
+
+    line->gap = start;
+
+    line->length -= end - start;
+    line->generation = ++state->generation;
+}
+
+// Replace the text in the line
+static bool
+line_set(ComlinState* const state,
+         LineBuf* const line,
+         char const* const text,
+         size_t const len,
+         bool const masked)
+{
+    line->length = line->gap = line->width = 0U;
+    line->valid = true;
+    return line_insert(state, line, 0U, text, len, masked);
+}
+
+// Return the line as a null-terminated string, moving the gap to the end
+static char const*
+line_text(ComlinState* const state, LineBuf* const line)
+{
+    if (!line_reserve(state, line, 0U)) {
+        return "";
+    }
+
+    line_move_gap(line, line->length);
+    line->data[line->length] = '\0';
+    return line->data;
+}
+
+// Return true if the line starts with a prefix
+static bool
+line_starts_with(LineBuf const* const line,
+                 char const* const prefix,
+                 size_t const len)
+{
+    if (len > line->length) {
+        return false;
+    }
+
+    size_t const head = len < line->gap ? len : line->gap;
+    return !memcmp(line->data, prefix, head) &&
+           !memcmp(line->data + head + line_gap_length(line),
+                   prefix + head,
+                   len - head);
+}
+
+// Append a range of text in the line to a string
+static void
+line_copy(ComlinState* const state,
+          LineBuf const* const line,
+          size_t const start,
+          size_t const end,
+          StringBuf* const out)
+{
+    size_t const mid = start > line->gap ? start
+                       : end < line->gap ? end
+                                         : line->gap;
+
+    buf_append(state, out, line->data + start, mid - start);
+    buf_append(state, out, line->data + mid + line_gap_length(line), end - mid);
+}
+
+// Return the start of the character before `pos`, with any combining marks
+static size_t
+prev_char(LineBuf* const line, size_t const pos)
+{
+    line_move_gap(line, pos);
+
+    uint32_t code = 0U;
+    size_t i = prev_code_point(line->data, pos, &code);
+    while (i && !char_width(code)) {
+        i = prev_code_point(line->data, i, &code);
+    }
+
+    return i;
+}
+
+// Return the end of the character at `pos`, with any combining marks
+static size_t
+next_char(LineBuf* const line, size_t const pos)
+{
+    line_move_gap(line, pos);
+
+    char const* const text = line->data + pos + line_gap_length(line);
+    size_t const len = line->length - pos;
+    uint32_t code = 0U;
+    size_t i = utf8_decode(text, len, &code);
+    while (i < len) {
+        size_t const n = utf8_decode(text + i, len - i, &code);
+        if (char_width(code)) {
+            break;
+        }
+
+        i += n;
+    }
+
+    return pos + i;
+}
+
+// Return the first offset in a range of the line at or past a column
+static size_t
+line_find_column(LineBuf const* const line,
+                 size_t lo,
+                 size_t hi,
+                 size_t const col)
+{
+    while (lo < hi) {
+        size_t const mid = lo + ((hi - lo) / 2U);
+        if (line_column(line, mid) < col) {
+            lo = mid + 1U;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo;
+}
+
+// Return the end of a row of the line like row_end()
+static size_t
+line_row_end(LineBuf const* const line, size_t const from, size_t const limit)
+{
+    size_t const len = line->length;
+    if (line->width <= limit) {
+        return len;
+    }
+
+    size_t const past = line_find_column(line, from + 1U, len, limit + 1U);
+    size_t end = past - 1U;
+    while (end > from && is_continuation(line_byte(line, end))) {
+        --end;
+    }
+
+    return end > from ? end : past;
+}
+
+/* Highlighting */
+
+/* Return the offset of the escape sequence for a style, adding it if needed.
+ *
+ * Returns SIZE_MAX if the style is invalid, or memory allocation failed.
+ */
+static size_t
+style_escape(ComlinHighlights* const h, char const* const style)
+{
+    size_t const len = strspn(style, "0123456789:;");
+    if (style[len]) {
+        return SIZE_MAX;
+    }
+
+    // Find an existing escape with the same parameters
+    StringBuf* const escapes = &h->escapes;
+    for (size_t i = 0U; i < escapes->length;) {
+        size_t const n = escape_length(escapes->data + i, escapes->length - i);
+        if (n == len + 3U && !memcmp(escapes->data + i + 2U, style, len)) {
+            return i;
+        }
+
+        i += n;
+    }
+
+    // Add a new escape to the end
+    size_t const offset = escapes->length;
+    buf_append(h->state, escapes, VTESC, 2U);
+    buf_append(h->state, escapes, style, len);
+    buf_append(h->state, escapes, "m", 1U);
+    if (escapes->length != offset + len + 3U) {
+        escapes->length = offset;
+        h->failed = true;
+        return SIZE_MAX;
+    }
+
+    return offset;
+}
+
+/* Update the styles and hint of the line if its text changed.
+ *
+ * The callbacks are only called when the line is shown with text that hasn't
+ * been highlighted yet, so redrawing it or moving the cursor reuses the last
+ * results.  Returns the highlights to show, or null if there are none.
+ */
+static ComlinHighlights const*
+update_highlights(ComlinState* const l)
+{
+    ComlinHighlights* const h = &l->highlights;
+    if (l->maskmode || l->search.active ||
+        (!l->highlight_callback && !l->hint_callback)) {
+        return NULL;
+    }
+
+    if (h->generation != l->buf.generation) {
+        h->nspans = 0U;
+        h->hint.length = 0U;
+        if (h->escapes.length > COMLIN_KEEP_SIZE) {
+            h->escapes.length = 0U; // Drop styles that may no longer be used
+        }
+
+        h->state = l;
+        h->line = line_text(l, &l->buf);
+        h->length = l->buf.length;
+        h->failed = h->line != l->buf.data;
+        if (l->highlight_callback && !h->failed) {
+            l->highlight_callback(h->line, h);
+        }
+
+        if (l->hint_callback && !h->failed) {
+            char const* style = NULL;
+            char const* const hint = l->hint_callback(h->line, &style);
+            size_t const len = hint ? strlen(hint) : 0U;
+            if (len) {
+                h->hint_escape = style_escape(h, style ? style : "90");
+                if (h->hint_escape != SIZE_MAX) {
+                    buf_append(l, &h->hint, hint, len);
+                    h->failed = h->failed || h->hint.length != len;
+                }
+            }
+        }
+
+        // Only keep the results if everything was stored
+        h->line = NULL;
+        h->generation = h->failed ? 0U : l->buf.generation;
+    }
+
+    return h;
+}
+
+void
+comlin_set_highlight_callback(ComlinState* const state,
+                              ComlinHighlightCallback* const fn)
+{
+    state->highlight_callback = fn;
+    state->highlights.generation = 0U;
+}
+
+void
+comlin_set_hint_callback(ComlinState* const state, ComlinHintCallback* const fn)
+{
+    state->hint_callback = fn;
+    state->highlights.generation = 0U;
+}
+
+ComlinStatus
+comlin_add_highlight(ComlinHighlights* const highlights,
+                     size_t start,
+                     size_t end,
+                     char const* const style)
+{
+    ComlinHighlights* const h = highlights;
+    char const* const line = h->line;
+    size_t const len = h->length;
+    if (!line) {
+        return COMLIN_SUCCESS; // Not called from a highlight callback
+    }
+
+    // Move the ends to the start of a character, and ignore empty or overlaps
+    StyleSpan* const last = h->nspans ? &h->spans[h->nspans - 1U] : NULL;
+    end = end < len ? end : len;
+    while (start < end && is_continuation(line[start])) {
+        ++start;
+    }
+
+    while (end < len && is_continuation(line[end])) {
+        ++end;
+    }
+
+    if (start >= end || (last && start < last->end)) {
+        return COMLIN_SUCCESS;
+    }
+
+    size_t const escape = style_escape(h, style);
+    if (escape == SIZE_MAX) {
+        return h->failed ? COMLIN_NO_MEMORY : COMLIN_SUCCESS;
+    }
+
+    // Extend the last span if this continues it in the same style
+    if (last && last->end == start && last->escape == escape) {
+        last->end = end;
+        return COMLIN_SUCCESS;
+    }
+
+    if (h->nspans == h->spans_size) {
+        size_t const size = h->spans_size ? 2U * h->spans_size : 16U;
+        StyleSpan* const spans = (StyleSpan*)state_realloc(
+          h->state, h->spans, size * sizeof(StyleSpan));
+        if (!spans) {
+            h->failed = true;
+            return COMLIN_NO_MEMORY;
+        }
+
+        h->spans = spans;
+        h->spans_size = size;
+    }
+
+    StyleSpan const span = {start, end, escape};
+    h->spans[h->nspans++] = span;
+    return COMLIN_SUCCESS;
+}
+
+/* Refresh */
+
+// Append bytes to the row that all start at one column, like an escape
+static bool
+render_bytes(ComlinState* const l,
+             char const* const text,
+             size_t const len,
+             size_t const col)
+{
+    StringBuf* const row = &l->row;
+    size_t const r = row->length;
+    if (!columns_reserve(l, &l->row_columns, r + len)) {
+        return false;
+    }
+
+    buf_append(l, row, text, len);
+    for (size_t i = r; i < row->length; ++i) {
+        l->row_columns.data[i] = (Column)col;
+    }
+
+    return row->length == r + len;
+}
+
+// Append a span of line text to the row, where the span starts at `col`
+static bool
+render_text(ComlinState* const l,
+            size_t const start,
+            size_t const end,
+            size_t const col)
+{
+    LineBuf const* const line = &l->buf;
+    StringBuf* const row = &l->row;
+    size_t const r = row->length;
+    if (!columns_reserve(l, &l->row_columns, r + end - start)) {
+        return false;
+    }
+
+    line_copy(l, line, start, end, row);
+    if (row->length != r + end - start) {
+        return false;
+    }
+
+    Column* const row_columns = l->row_columns.data + r - start;
+    size_t const first = line_column(line, start);
+    for (size_t i = start; i < end; ++i) {
+        row_columns[i] = (Column)(col + line_column(line, i) - first);
+    }
+
+    return true;
+}
+
+// Append an escape sequence for a style to the row
+static bool
+render_escape(ComlinState* const l, size_t const escape, size_t const col)
+{
+    StringBuf const* const escapes = &l->highlights.escapes;
+    char const* const text = escapes->data + escape;
+    return render_bytes(
+      l, text, escape_length(text, escapes->length - escape), col);
+}
+
+// Return the index of the first highlighted span that ends after an offset
+static size_t
+span_lower_bound(ComlinHighlights const* const h, size_t const pos)
+{
+    size_t lo = 0U;
+    size_t hi = h->nspans;
+    while (lo < hi) {
+        size_t const mid = lo + ((hi - lo) / 2U);
+        if (h->spans[mid].end <= pos) {
+            lo = mid + 1U;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo;
+}
+
+// Append a span of line text to the row, starting at `col`, with its styles
+static bool
+render_styled_text(ComlinState* const l,
+                   size_t const start,
+                   size_t const end,
+                   size_t const col)
+{
+    ComlinHighlights const* const h = &l->highlights;
+    LineBuf const* const line = &l->buf;
+    size_t const first = line_column(line, start);
+    size_t pos = start;
+    bool ok = true;
+    for (size_t i = span_lower_bound(h, start);
+         ok && i < h->nspans && h->spans[i].start < end;
+         ++i) {
+        // Render the text before the span, then the span and a reset
+        StyleSpan const* const span = &h->spans[i];
+        size_t const s = span->start > start ? span->start : start;
+        size_t const e = span->end < end ? span->end : end;
+        size_t const s_col = col + line_column(line, s) - first;
+        size_t const e_col = col + line_column(line, e) - first;
+        ok = render_text(l, pos, s, col + line_column(line, pos) - first) &&
+             render_escape(l, span->escape, s_col) &&
+             render_text(l, s, e, s_col) &&
+             render_bytes(l, VTESC "0m", 4U, e_col);
+        pos = e;
+    }
+
+    return ok &&
+           render_text(l, pos, end, col + line_column(line, pos) - first);
+}
+
+// Append as much of the hint as fits in some columns to the row at `*col`
+static bool
+render_hint(ComlinState* const l, size_t* const col, size_t const limit)
+{
+    // Measure the hint up to the limit, or the first control character
+    ComlinHighlights const* const h = &l->highlights;
+    char const* const text = h->hint.data;
+    size_t const len = h->hint.length;
+    size_t width = 0U;
+    size_t n = 0U;
+    while (n < len && (uint8_t)text[n] >= 0x20U && text[n] != DEL) {
+        uint32_t code = 0U;
+        size_t const k = utf8_decode(text + n, len - n, &code);
+        size_t const w = char_width(code);
+        if (width + w > limit) {
+            break;
+        }
+
+        width += w;
+        n += k;
+    }
+
+    if (!n) {
+        return true;
+    }
+
+    // Render the hint text between its escape and a reset
+    StringBuf* const row = &l->row;
+    if (!render_escape(l, h->hint_escape, *col) ||
+        !columns_reserve(l, &l->row_columns, row->length + n)) {
+        return false;
+    }
+
+    size_t const r = row->length;
+    buf_append(l, row, text, n);
+    if (row->length != r + n) {
+        return false;
+    }
+
+    columns_scan(l->row_columns.data,
+                 row->data,
+                 row->length,
+                 r,
+                 col,
+                 r + n,
+                 false);
+    return render_bytes(l, VTESC "0m", 4U, *col);
+}
+
+/* Render the prompt and a span of line text to the row buffer.
+ *
+ * If highlights are given, the text is shown in their styles, and the hint is
+ * shown after it if the span is at the end of the line, in up to `hint_limit`
+ * columns.
+ */
+static ComlinStatus
+render_row(ComlinState* const l,
+           ComlinHighlights const* const h,
+           size_t const start,
+           size_t const end,
+           size_t const hint_limit)
+{
+    StringBuf* const row = &l->row;
+    LineBuf const* const line = &l->buf;
+
+    // Render the prompt, where any escape sequences take no columns
+    row->length = 0U;
+    buf_append(l, row, l->prompt, l->plen);
+    if (row->length != l->plen ||
+        !columns_reserve(l, &l->row_columns, row->length)) {
+        return COMLIN_NO_MEMORY;
+    }
+
+    size_t col = 0U;
+    columns_scan_rendered(l->row_columns.data, l->prompt, l->plen, &col);
+
+    // Render the text, with an asterisk for each character in mask mode
+    size_t const first = line_column(line, start);
+    bool ok = true;
+    if (l->maskmode) {
+        for (size_t i = start; ok && i < end; ++i) {
+            size_t const c = line_column(line, i);
+            if (i == start || c != line_column(line, i - 1U)) {
+                ok = render_bytes(l, "*", 1U, col + c - first);
+            }
+        }
+    } else if (h) {
+        ok = render_styled_text(l, start, end, col);
+    } else {
+        ok = render_text(l, start, end, col);
+    }
+
+    // Render the hint after the end of the line
+    col += line_column(line, end) - first;
+    if (ok && h && end == line->length && h->hint.length) {
+        ok = render_hint(l, &col, hint_limit);
+    }
+
+    if (!ok) {
+        return COMLIN_NO_MEMORY;
+    }
+
+    l->row_columns.data[row->length] = (Column)col;
+    return COMLIN_SUCCESS;
+}
+
+// Return the number of terminal rows used by the line on screen
+static size_t
+drawn_row_count(ComlinState const* const l)
+{
+    char const* const text = l->drawn.data;
+    Column const* const columns = l->drawn_columns.data;
+    size_t const len = l->drawn.length;
+    size_t rows = 0U;
+    for (size_t i = 0U; i < len; ++rows) {
+        i = row_end(text, columns, i, len, columns[i] + l->cols);
+    }
+
+    return rows;
+}
+
+// Append a cursor movement to a row and column of the line on screen
+static void
+append_cursor_move(ComlinState* const l, size_t const row, size_t const col)
+{
+    StringBuf* const output = &l->output;
+
+    if (row < l->drawn_row) {
+        buf_append_vtesc(l, output, l->drawn_row - row, 'A');
+    } else if (row > l->drawn_row) {
+        // Move down through the rows on screen, then feed lines to add more
+        size_t const last = l->oldrows ? l->oldrows - 1U : 0U;
+        size_t r = l->drawn_row;
+        if (last > r) {
+            size_t const down = (row < last ? row : last) - r;
+            buf_append_vtesc(l, output, down, 'B');
+            r += down;
+        }
+
+        for (; r < row; ++r) {
+            buf_append(l, output, "\n", 1U);
+        }
+
+        if (row >= l->oldrows) {
+            l->oldrows = row + 1U;
+        }
+    }
+
+    buf_append_column_move(l, output, l->drawn_col, col);
+    l->drawn_row = row;
+    l->drawn_col = col;
+}
+
+// Clear all the rows used by the line, leaving the cursor at the start
+static ComlinStatus
+clear_rows(ComlinState* const l)
+{
+    StringBuf* const output = &l->output;
+    size_t const rows = drawn_row_count(l);
+    for (size_t r = rows > l->drawn_row ? rows : l->drawn_row + 1U; r-- > 0U;) {
+        append_cursor_move(l, r, 0U);
+        buf_append(l, output, VTESC "0K", 4U);
+    }
+
+    l->drawn.length = 0U;
+    return COMLIN_SUCCESS;
+}
+
+/* Return the start of the escape sequences that set the style at `pos`.
+ *
+ * Each style escape adds to the current style until it's reset, so these are
+ * the style escapes after the last reset before `pos`, or `pos` if there are
+ * none (and the style there is the default).
+ */
+static size_t
+style_start(char const* const text, size_t const pos)
+{
+    size_t start = pos;
+    for (size_t i = 0U; i < pos;) {
+        char const* const esc = (char const*)memchr(text + i, ESC, pos - i);
+        if (!esc) {
+            break;
+        }
+
+        i = (size_t)(esc - text);
+        size_t const n = escape_length(esc, pos - i);
+        if (is_style_escape(esc, n)) {
+            start = is_reset_escape(esc, n) ? pos : start < pos ? start : i;
+        }
+
+        i += n;
+    }
+
+    return start;
+}
+
+// Append the style escapes in rendered text that set the style at `pos`
+static void
+append_style(ComlinState* const l,
+             char const* const text,
+             size_t const len,
+             size_t const pos)
+{
+    size_t const next = (pos < len && text[pos] == ESC)
+                          ? escape_length(text + pos, len - pos)
+                          : 0U;
+    if (is_reset_escape(text + pos, next)) {
+        return; // The text starts with a reset anyway
+    }
+
+    for (size_t i = style_start(text, pos); i < pos;) {
+        size_t const n = text[i] == ESC ? escape_length(text + i, pos - i) : 1U;
+        if (is_style_escape(text + i, n)) {
+            buf_append(l, &l->output, text + i, n);
+        }
+
+        i += n;
+    }
+}
+
+/* Update the rows on screen to show the rendered row buffer.
+ *
+ * The rendered text is split into rows of the terminal width, and each is
+ * compared with what was last drawn there.  Only the tails of rows that
+ * changed are written, with the cursor moved relatively between them, so
+ * moving the cursor alone only writes a cursor movement.  The cursor is
+ * given as a column in the rendered text, as if it were all on one row.
+ *
+ * If the text has escape sequences, then the style at the start of each
+ * rewritten tail is set first, and reset after it, so the tail is shown as
+ * if the whole text was written.
+ */
+static ComlinStatus
+refresh_rows(ComlinState* const l, size_t const cursor)
+{
+    size_t const cols = l->cols;
+    StringBuf* const output = &l->output;
+    char const* const old_text = l->drawn.data;
+    char const* const new_text = l->row.data;
+    Column const* const old_columns = l->drawn_columns.data;
+    Column const* const new_columns = l->row_columns.data;
+    size_t const old_length = l->drawn.length;
+    size_t const new_length = l->row.length;
+    bool const styled = memchr(new_text, ESC, new_length) != NULL;
+
+    // Rewrite every row that changed, through the last row and the cursor's
+    size_t cursor_row = SIZE_MAX;
+    size_t cursor_col = 0U;
+    size_t old_start = 0U;
+    size_t new_start = 0U;
+    for (size_t r = 0U; old_start < old_length || new_start < new_length ||
+                        cursor_row == SIZE_MAX;
+         ++r) {
+        bool const old_row = old_start < old_length;
+        size_t const old_end =
+          old_row ? row_end(old_text,
+                            old_columns,
+                            old_start,
+                            old_length,
+                            old_columns[old_start] + cols)
+                  : old_start;
+        size_t const new_end = row_end(new_text,
+                                       new_columns,
+                                       new_start,
+                                       new_length,
+                                       new_columns[new_start] + cols);
+
+        size_t const old_width =
+          old_row ? old_columns[old_end] - old_columns[old_start] : 0U;
+        size_t const new_offset = new_columns[new_start];
+        size_t const new_width = new_columns[new_end] - new_offset;
+        if (cursor_row == SIZE_MAX &&
+            (cursor < new_columns[new_end] ||
+             (new_end == new_length && cursor - new_offset < cols))) {
+            cursor_row = r;
+            cursor_col = cursor - new_offset;
+        }
+
+        // Find the first changed character
+        size_t const old_len = old_end - old_start;
+        size_t const new_len = new_end - new_start;
+        size_t start = 0U;
+        while (start < old_len && start < new_len &&
+               old_text[old_start + start] == new_text[new_start + start]) {
+            ++start;
+        }
+
+        while (start && start < new_len &&
+               is_continuation(new_text[new_start + start])) {
+            --start;
+        }
+
+        // Rewrite the previous character if a combining mark on it changed
+        while (start &&
+               ((start < old_len && is_zero_width(old_text,
+                                                   old_columns,
+                                                   old_start + start,
+                                                   old_end)) ||
+                (start < new_len && is_zero_width(new_text,
+                                                   new_columns,
+                                                   new_start + start,
+                                                   new_end)))) {
+            for (--start; start && is_continuation(new_text[new_start + start]);
+                 --start) {
+            }
+        }
+
+        if (start < old_len || start < new_len) {
+            size_t const col = new_columns[new_start + start] - new_offset;
+            append_cursor_move(l, r, col);
+            if (styled) {
+                append_style(l, new_text, new_length, new_start + start);
+            }
+
+            buf_append(
+              l, output, new_text + new_start + start, new_len - start);
+            if (styled && style_start(new_text, new_end) < new_end) {
+                buf_append(l, output, VTESC "0m", 4U);
+            }
+
+            if (old_width > new_width) {
+                buf_append(l, output, VTESC "0K", 4U); // Erase the old tail
+            }
+
+            l->drawn_col = new_width;
+            if (new_width == cols) {
+                buf_append(l, output, "\r", 1U); // Leave the right margin
+                l->drawn_col = 0U;
+            }
+        }
+
+        old_start = old_end;
+        new_start = new_end;
+    }
+
+    // Move the cursor to its position, and remember what is now on screen
+    append_cursor_move(l, cursor_row, cursor_col);
+    COMLIN_COUNT(l, n_full_refreshes, old_length ? 0U : 1U);
+    COMLIN_COUNT(l, n_partial_refreshes, old_length ? 1U : 0U);
+    StringBuf const drawn = l->drawn;
+    ColumnIndex const drawn_columns = l->drawn_columns;
+    l->drawn = l->row;
+    l->drawn_columns = l->row_columns;
+    l->row = drawn;
+    l->row_columns = drawn_columns;
+    return COMLIN_SUCCESS;
+}
+
+// Refresh the current line in single-line mode
+static ComlinStatus
+refresh_single_line(ComlinState* const l)
+{
+    LineBuf* const line = &l->buf;
+    ComlinHighlights const* const h = update_highlights(l);
+    if ((h && h->failed) || !line_update_columns(l, line, l->maskmode)) {
+        return COMLIN_NO_MEMORY;
+    }
+
+    // Chop the start if necessary so the cursor is on screen
+    size_t const pcols = text_width(l->prompt, l->plen);
+    size_t const width = l->cols > pcols ? l->cols - pcols : 1U;
+    size_t const cursor = line_column(line, l->pos);
+    size_t const start =
+      cursor >= width ? line_find_column(line, 0U, l->pos, cursor + 1U - width)
+                      : 0U;
+
+    // Truncate the end so the text fits on the row
+    size_t const first = line_column(line, start);
+    size_t const end = line_row_end(line, start, first + width);
+
+    ComlinStatus const st =
+      render_row(l, h, start, end, first + width - line_column(line, end));
+    return st ? st : refresh_rows(l, pcols + cursor - first);
+}
+
+// Refresh the current line in multi-line mode
+static ComlinStatus
+refresh_multi_line(ComlinState* const l)
+{
+    LineBuf* const line = &l->buf;
+    ComlinHighlights const* const h = update_highlights(l);
+    if ((h && h->failed) || !line_update_columns(l, line, l->maskmode)) {
+        return COMLIN_NO_MEMORY;
+    }
+
+    ComlinStatus const st = render_row(l, h, 0U, line->length, SIZE_MAX);
+    return st ? st
+              : refresh_rows(l,
+                             l->row_columns.data[l->plen] +
+                               line_column(line, l->pos));
+}
+
+// Optionally clear and/or refresh the current line
+static ComlinStatus
+refresh_line_with_flags(ComlinState* const l, ComlinRefreshFlags const flags)
+{
+    if (!(flags & REFRESH_WRITE)) {
+        return clear_rows(l);
+    }
+
+    l->refresh_pending = false;
+    return l->search.active ? refresh_search(l)
+           : l->mlmode      ? refresh_multi_line(l)
+                            : refresh_single_line(l);
+}
+
+ComlinStatus
+comlin_hide(ComlinState* const l)
+{
+    if (l->streaming) {
+        return COMLIN_SUCCESS; // Nothing is shown while streaming
+    }
+
+    ComlinStatus const st = refresh_line_with_flags(l, REFRESH_CLEAN);
+    return st ? st : flush_output(l);
+}
+
+ComlinStatus
+comlin_show(ComlinState* const l)
+{
+    if (l->streaming) {
+        return COMLIN_SUCCESS; // Streamed lines are never shown
+    }
+
+    ComlinStatus st = COMLIN_SUCCESS;
+    if (l->in_completion && l->buf.length) {
+        CompletionList const lc = get_completions(l);
+        st = refresh_line_with_completion(l, &lc, REFRESH_WRITE);
+    } else {
+        st = refresh_line_with_flags(l, REFRESH_WRITE);
+    }
+
+    return st ? st : flush_output(l);
+}
+
+ComlinStatus
+comlin_notify_resize(ComlinState* const l, size_t const cols)
+{
+    if (l->streaming) {
+        return COMLIN_SUCCESS; // Nothing is shown, and the width isn't needed
+    }
+
+    size_t const new_cols = cols ? cols : get_columns(l);
+    if (new_cols == l->cols) {
+        return COMLIN_SUCCESS;
+    }
+
+    l->cols = new_cols;
+    if (l->dumb || !l->drawn.length) {
+        return COMLIN_SUCCESS; // Nothing is shown, so just use the new width
+    }
+
+    // Clear everything from the start of the line, since the layout changed
+    append_cursor_move(l, 0U, 0U);
+    buf_append(l, &l->output, VTESC "0J", 4U);
+    l->drawn.length = 0U;
+    l->oldrows = 1U;
+    if (l->defer_refresh) {
+        l->refresh_pending = true; // Called while processing input
+        return COMLIN_SUCCESS;
+    }
+
+    return comlin_show(l);
+}
+
+/* History Entries */
+
+// Return the index in the history ring of an entry counted from the oldest
+static size_t
+history_slot(ComlinState const* const state, size_t const index)
+{
+    size_t const i = state->history_start + index;
+
+    return i < state->history_size ? i : i - state->history_size;
+}
+
+// Return the history entry at the given index from the oldest
+static HistoryEntry*
+history_entry(ComlinState const* const state, size_t const index)
+{
+    return &state->history[history_slot(state, index)];
+}
+
+// Return the text of a history entry, or null if it has been erased
+static char const*
+history_text(ComlinState const* const state, HistoryEntry const* const entry)
+{
+    return entry->offset == HISTORY_ERASED
+             ? NULL
+             : state->history_arena + entry->offset;
+}
+
+// Return the number of entries in the shared history used by a state
+static size_t
+history_nshared(ComlinState const* const state)
+{
+    return state->shared ? state->shared->len : 0U;
+}
+
+/* Return the text of an entry counted from the oldest, or null if erased.
+ *
+ * This indexes the entries that a state shows, which are the entries of the
+ * shared history, followed by those in the state's own history.
+ */
+static char const*
+history_view_text(ComlinState const* const state,
+                  size_t const index,
+                  size_t* const len)
+{
+    size_t const nshared = history_nshared(state);
+    if (index < nshared) {
+        HistoryEntry const* const entry = &state->shared->entries[index];
+        *len = entry->length;
+        return state->shared->arena + entry->offset;
+    }
+
+    HistoryEntry const* const entry = history_entry(state, index - nshared);
+    *len = entry->length;
+    return history_text(state, entry);
+}
+
+// Return a hash of a string (32-bit FNV-1a)
+static size_t
+hash_string(char const* const str, size_t const len)
+{
+    uint32_t hash = 2166136261U;
+    for (size_t i = 0U; i < len; ++i) {
+        hash = (hash ^ (uint8_t)str[i]) * 16777619U;
+    }
+
+    return hash;
+}
+
+// Return true if a history entry is equal to a line of the given length
+static bool
+entry_equals(ComlinState const* const state,
+             HistoryEntry const* const entry,
+             char const* const line,
+             size_t const len)
+{
+    return entry->offset != HISTORY_ERASED && entry->length == len &&
+           !memcmp(state->history_arena + entry->offset, line, len);
+}
+
+// Return a hash of the text of a history entry
+static size_t
+entry_hash(ComlinState const* const state, HistoryEntry const* const entry)
+{
+    return hash_string(state->history_arena + entry->offset, entry->length);
+}
+
+// Return the bucket that contains a line, or the empty bucket for it
+static HistoryBucket*
+history_find(ComlinState const* const state,
+             char const* const line,
+             size_t const len)
+{
+    size_t const mask = state->history_nbuckets - 1U;
+    size_t const hash = hash_string(line, len);
+    for (size_t i = hash & mask;; i = (i + 1U) & mask) {
+        HistoryBucket* const bucket = &state->history_buckets[i];
+        if (!bucket->slot ||
+            (bucket->hash == hash &&
+             entry_equals(
+               state, &state->history[bucket->slot - 1U], line, len))) {
+            return bucket;
+        }
+    }
+}
+
+// Add a history entry to the hash index
+static void
+history_index_slot(ComlinState const* const state, size_t const slot)
+{
+    if (state->history_buckets) {
+        size_t const mask = state->history_nbuckets - 1U;
+        size_t const hash = entry_hash(state, &state->history[slot]);
+        size_t i = hash & mask;
+        while (state->history_buckets[i].slot) {
+            i = (i + 1U) & mask; // Duplicates are allowed, find an empty bucket
+        }
+
+        state->history_buckets[i].slot = slot + 1U;
+        state->history_buckets[i].hash = hash;
+    }
+}
+
+// Remove a history entry from the hash index
+static void
+history_unindex_slot(ComlinState const* const state, size_t const slot)
+{
+    if (!state->history_buckets) {
+        return;
+    }
+
+    // Find the bucket for this entry
+    HistoryBucket* const buckets = state->history_buckets;
+    size_t const mask = state->history_nbuckets - 1U;
+    size_t i = entry_hash(state, &state->history[slot]) & mask;
+    while (buckets[i].slot != slot + 1U) {
+        i = (i + 1U) & mask;
+    }
+
+    // Shift any following entries that belong before the gap back into it
+    for (size_t j = (i + 1U) & mask; buckets[j].slot; j = (j + 1U) & mask) {
+        size_t const home = buckets[j].hash & mask;
+        if ((i <= j) ? (home <= i || home > j) : (home <= i && home > j)) {
+            buckets[i] = buckets[j];
+            i = j;
+        }
+    }
+
+    buckets[i].slot = 0U;
+}
+
+// Build the hash index of all history entries
+static ComlinStatus
+history_build_index(ComlinState* const state)
+{
+    // Use a power of two at least twice the number of entries that fit
+    size_t nbuckets = 2U;
+    while (nbuckets < 2U * state->history_size) {
+        nbuckets *= 2U;
+    }
+
+    state_free(state, state->history_buckets);
+    state->history_nbuckets = nbuckets;
+    state->history_buckets =
+      (HistoryBucket*)state_calloc(state, nbuckets, sizeof(HistoryBucket));
+    if (!state->history_buckets) {
+        return COMLIN_NO_MEMORY;
+    }
+
+    for (size_t i = 0U; i < state->history_len; ++i) {
+        if (history_entry(state, i)->offset != HISTORY_ERASED) {
+            history_index_slot(state, history_slot(state, i));
+        }
+    }
+
+    return COMLIN_SUCCESS;
+}
+
+/* Ensure there is space in the arena to store a string of the given length.
+ *
+ * When the arena is full, the text of all live entries is copied into a new
+ * one with room to grow, which drops text that is no longer used by any entry
+ * and keeps the arena at most a few times larger than the live text.
+ */
+static ComlinStatus
+history_reserve(ComlinState* const state, size_t const len)
+{
+    if (state->history_arena_size - state->history_arena_len > len) {
+        return COMLIN_SUCCESS;
+    }
+
+    size_t const needed =
+      state->history_arena_len - state->history_garbage + len + 1U;
+    size_t size = 256U;
+    while (size < 2U * needed) {
+        size *= 2U;
+    }
+
+    char* const arena = (char*)state_malloc(state, size);
+    if (!arena) {
+        return COMLIN_NO_MEMORY;
+    }
+
+    size_t arena_len = 0U;
+    for (size_t i = 0U; i < state->history_len; ++i) {
+        HistoryEntry* const entry = history_entry(state, i);
+        if (entry->offset != HISTORY_ERASED) {
+            memcpy(arena + arena_len,
+                   state->history_arena + entry->offset,
+                   entry->length + 1U);
+            entry->offset = arena_len;
+            arena_len += entry->length + 1U;
+        }
+    }
+
+    state_free(state, state->history_arena);
+    state->history_arena = arena;
+    state->history_arena_len = arena_len;
+    state->history_arena_size = size;
+    state->history_garbage = 0U;
+    return COMLIN_SUCCESS;
+}
+
+// Store the text of a history entry in reserved space at the end of the arena
+static void
+history_store(ComlinState* const state,
+              HistoryEntry* const entry,
+              char const* const line,
+              size_t const len)
+{
+    assert(state->history_arena_size - state->history_arena_len > len);
+
+    char* const text = state->history_arena + state->history_arena_len;
+    memcpy(text, line, len);
+    text[len] = '\0';
+    entry->offset = state->history_arena_len;
+    entry->length = len;
+    state->history_arena_len += len + 1U;
+}
+
+// Release the arena space used by the text of a live history entry
+static void
+history_release(ComlinState* const state, HistoryEntry const* const entry)
+{
+    size_t const size = entry->length + 1U;
+    if (entry->offset + size == state->history_arena_len) {
+        state->history_arena_len = entry->offset; // Reclaim the end directly
+    } else {
+        state->history_garbage += size;
+    }
+}
+
+// Replace the text of a history entry
+static ComlinStatus
+history_replace(ComlinState* const state,
+                size_t const index,
+                char const* const line,
+                size_t const len)
+{
+    size_t const slot = history_slot(state, index);
+    HistoryEntry* const entry = &state->history[slot];
+    if (entry_equals(state, entry, line, len)) {
+        return COMLIN_SUCCESS; // Unchanged, which is common when scrolling
+    }
+
+    // Text in the search index can't be removed, so rebuild it when needed
+    if (index + 1U < state->history_len) {
+        state->search.stale = true;
+    }
+
+    history_unindex_slot(state, slot);
+    order_remove(state, entry);
+    if (len <= entry->length) {
+        // Overwrite the old text in place, which leaves some garbage
+        char* const text = state->history_arena + entry->offset;
+        memcpy(text, line, len);
+        text[len] = '\0';
+        state->history_garbage += entry->length - len;
+        entry->length = len;
+    } else {
+        if (history_reserve(state, len)) {
+            history_index_slot(state, slot);
+            order_insert(state, entry);
+            return COMLIN_NO_MEMORY;
+        }
+
+        history_release(state, entry);
+        history_store(state, entry, line, len);
+    }
+
+    history_index_slot(state, slot);
+    order_insert(state, entry);
+    return COMLIN_SUCCESS;
+}
+
+// Erase a history entry, leaving an erased entry to be skipped or compacted
+static void
+history_erase(ComlinState* const state, size_t const slot)
+{
+    HistoryEntry* const entry = &state->history[slot];
+
+    history_unindex_slot(state, slot);
+    order_remove(state, entry);
+    history_release(state, entry);
+    entry->offset = HISTORY_ERASED;
+    ++state->history_erased;
+}
+
+// Remove erased entries from the history and rebuild the index
+static ComlinStatus
+history_compact(ComlinState* const state)
+{
+    size_t len = 0U;
+    for (size_t i = 0U; i < state->history_len; ++i) {
+        HistoryEntry const entry = *history_entry(state, i);
+        if (entry.offset != HISTORY_ERASED) {
+            *history_entry(state, len++) = entry;
+        }
+    }
+
+    state->history_len = len;
+    state->history_erased = 0U;
+    return state->history_buckets ? history_build_index(state)
+                                  : COMLIN_SUCCESS;
+}
+
+/* Grow the history ring to fit more entries, up to the maximum length.
+ *
+ * The ring only wraps around once it's full, so until then, the entries start
+ * at the beginning and simply stay in place.  This way, a state only uses
+ * memory for the entries it actually has, rather than the maximum number.
+ */
+static ComlinStatus
+history_grow(ComlinState* const state)
+{
+    assert(!state->history_start);
+
+    size_t const max_len = state->history_max_len;
+    size_t const size = state->history_size >= max_len / 2U ? max_len
+                        : state->history_size ? 2U * state->history_size
+                        : max_len < 16U       ? max_len
+                                              : 16U;
+
+    HistoryEntry* const history = (HistoryEntry*)state_realloc(
+      state, state->history, size * sizeof(HistoryEntry));
+    if (!history) {
+        return COMLIN_NO_MEMORY;
+    }
+
+    state->history = history;
+    state->history_size = size;
+    return state->history_buckets ? history_build_index(state)
+                                  : COMLIN_SUCCESS;
+}
+
+/* History Search */
+
+/* Reverse search uses an index of trigrams (every three byte substring) in
+ * history entries, each with a list of the sequence numbers of the entries
+ * that contain it.  Sequence numbers are never reused, so entries that are
+ * removed from the history are simply skipped, and the index is rebuilt when
+ * enough have accumulated.  A search with a query of at least three bytes
+ * only needs to check the entries that contain its rarest trigram.
+ *
+ * A shared history has its own index, which is built once when it's created.
+ * Searches number shared entries by their index, and the state's own entries
+ * by their sequence number after those, so all are ordered from the oldest.
+ */
+
+// Return the key of the trigram at the start of some text
+static uint32_t
+trigram_key(char const* const text)
+{
+    return ((uint32_t)(uint8_t)text[0] | ((uint32_t)(uint8_t)text[1] << 8U) |
+            ((uint32_t)(uint8_t)text[2] << 16U)) +
+           1U;
+}
+
+// Return the postings for a trigram, or the empty bucket for it
+static SearchPostings*
+search_postings(HistorySearch const* const search, uint32_t const key)
+{
+    size_t const mask = search->nbuckets - 1U;
+    for (size_t i = (key * 2654435761U) & mask;; i = (i + 1U) & mask) {
+        SearchPostings* const postings = &search->postings[i];
+        if (!postings->key || postings->key == key) {
+            return postings;
+        }
+    }
+}
+
+// Free the search index
+static void
+search_free_index(ComlinState* const state)
+{
+    HistorySearch* const search = &state->search;
+    for (size_t i = 0U; i < search->nbuckets; ++i) {
+        state_free(state, search->postings[i].seqs);
+    }
+
+    state_free(state, search->postings);
+    search->postings = NULL;
+    search->nbuckets = 0U;
+    search->nkeys = 0U;
+    search->nindexed = 0U;
+}
+
+// Double the number of buckets in the search index
+static ComlinStatus
+search_grow(ComlinState* const state)
+{
+    HistorySearch* const search = &state->search;
+    size_t const old_nbuckets = search->nbuckets;
+    SearchPostings* const old_postings = search->postings;
+    size_t const nbuckets = old_nbuckets ? 2U * old_nbuckets : 256U;
+    search->postings =
+      (SearchPostings*)state_calloc(state, nbuckets, sizeof(SearchPostings));
+    if (!search->postings) {
+        search->postings = old_postings;
+        return COMLIN_NO_MEMORY;
+    }
+
+    search->nbuckets = nbuckets;
+    for (size_t i = 0U; i < old_nbuckets; ++i) {
+        if (old_postings[i].key) {
+            *search_postings(search, old_postings[i].key) = old_postings[i];
+        }
+    }
+
+    state_free(state, old_postings);
+    return COMLIN_SUCCESS;
+}
+
+// Add the trigrams in a history entry to the search index
+static ComlinStatus
+search_index_entry(ComlinState* const state, HistoryEntry const* const entry)
+{
+    HistorySearch* const search = &state->search;
+    char const* const text = history_text(state, entry);
+    uint32_t const seq = (uint32_t)entry->seq;
+    if (entry->seq >= UINT32_MAX) {
+        return COMLIN_NO_MEMORY; // Out of sequence numbers, stop indexing
+    }
+
+    for (size_t i = 0U; i + 3U <= entry->length; ++i) {
+        if (2U * (search->nkeys + 1U) > search->nbuckets &&
+            search_grow(state)) {
+            return COMLIN_NO_MEMORY;
+        }
+
+        uint32_t const key = trigram_key(text + i);
+        SearchPostings* const postings = search_postings(search, key);
+        if (!postings->key) {
+            postings->key = key;
+            ++search->nkeys;
+        } else if (postings->count &&
+                   postings->seqs[postings->count - 1U] == seq) {
+            continue; // Trigram appears more than once in this entry
+        }
+
+        if (postings->count == postings->size) {
+            uint32_t const size = postings->size ? 2U * postings->size : 4U;
+            uint32_t* const seqs = (uint32_t*)state_realloc(
+              state, postings->seqs, size * sizeof(uint32_t));
+            if (!seqs) {
+                return COMLIN_NO_MEMORY;
+            }
+
+            postings->seqs = seqs;
+            postings->size = size;
+        }
+
+        postings->seqs[postings->count++] = seq;
+    }
+
+    ++search->nindexed;
+    return COMLIN_SUCCESS;
+}
+
+// Build the search index of all history entries
+static ComlinStatus
+search_build_index(ComlinState* const state)
+{
+    HistorySearch* const search = &state->search;
+
+    search_free_index(state);
+    search->stale = false;
+    if (search_grow(state)) {
+        return COMLIN_NO_MEMORY; // Fall back to scanning all entries
+    }
+
+    for (size_t i = 0U; i < state->history_len; ++i) {
+        HistoryEntry const* const entry = history_entry(state, i);
+        if (entry->offset != HISTORY_ERASED &&
+            search_index_entry(state, entry)) {
+            search_free_index(state); // Fall back to scanning all entries
+            return COMLIN_NO_MEMORY;
+        }
+    }
+
+    return COMLIN_SUCCESS;
+}
+
+// Return the first occurrence of a query in some text, or null
+static char const*
+find_text(char const* const text,
+          size_t const len,
+          char const* const query,
+          size_t const query_len)
+{
+    char const* const end = text + len;
+    for (char const* t = text; (size_t)(end - t) >= query_len; ++t) {
+        size_t const n = (size_t)(end - t) - query_len + 1U;
+        t = (char const*)memchr(t, query[0], n);
+        if (!t) {
+            break;
+        }
+
+        if (!memcmp(t, query, query_len)) {
+            return t;
+        }
+    }
+
+    return NULL;
+}
+
+// Return the index of the live history entry with a sequence number
+static size_t
+history_find_index(ComlinState const* const state, size_t const seq)
+{
+    // Sequence numbers increase from the oldest entry, so binary search
+    size_t lo = 0U;
+    size_t hi = state->history_len;
+    while (lo < hi) {
+        size_t const mid = lo + ((hi - lo) / 2U);
+        HistoryEntry const* const entry = history_entry(state, mid);
+        if (entry->seq < seq) {
+            lo = mid + 1U;
+        } else if (entry->seq > seq) {
+            hi = mid;
+        } else {
+            return entry->offset == HISTORY_ERASED ? SIZE_MAX : mid;
+        }
+    }
+
+    return SIZE_MAX;
+}
+
+// Return the live history entry with a sequence number, or null
+static HistoryEntry const*
+history_find_seq(ComlinState const* const state, size_t const seq)
+{
+    size_t const index = history_find_index(state, seq);
+
+    return index == SIZE_MAX ? NULL : history_entry(state, index);
+}
+
+// Return the index of the live entry with a search number, or SIZE_MAX
+static size_t
+search_find_index(ComlinState const* const state, size_t const seq)
+{
+    size_t const nshared = history_nshared(state);
+    if (seq < nshared) {
+        return seq;
+    }
+
+    size_t const index = history_find_index(state, seq - nshared);
+    return index == SIZE_MAX ? SIZE_MAX : nshared + index;
+}
+
+// Return the text of the live entry with a search number, or null
+static char const*
+search_find_text(ComlinState const* const state,
+                 size_t const seq,
+                 size_t* const len)
+{
+    size_t const index = search_find_index(state, seq);
+
+    *len = 0U;
+    return index == SIZE_MAX ? NULL : history_view_text(state, index, len);
+}
+
+// Return the search number of the entry at an index from the oldest
+static size_t
+search_seq(ComlinState const* const state, size_t const index)
+{
+    size_t const nshared = history_nshared(state);
+    if (index < nshared) {
+        return index;
+    }
+
+    return nshared + history_entry(state, index - nshared)->seq;
+}
+
+// Return the search number of the entry being edited, which isn't searched
+static size_t
+search_current_seq(ComlinState const* const state)
+{
+    return search_seq(state, history_nshared(state) + state->history_len - 1U);
+}
+
+// Return true if the entry with the given search number matches the query
+static bool
+search_matches(ComlinState const* const state, size_t const seq)
+{
+    StringBuf const* const query = &state->search.query;
+    size_t len = 0U;
+    char const* const text = search_find_text(state, seq, &len);
+
+    return text && seq != search_current_seq(state) &&
+           find_text(text, len, query->data, query->length);
+}
+
+// Move the matches and unchecked candidates together to narrow them down
+static void
+search_gather(HistorySearch* const search)
+{
+    if (search->next > search->nresults) {
+        memmove(search->results + search->nresults,
+                search->results + search->next,
+                (search->end - search->next) * sizeof(size_t));
+        search->end -= search->next - search->nresults;
+        search->next = search->nresults;
+    }
+}
+
+// Make room for at least a number of search results and candidates
+static ComlinStatus
+search_reserve(ComlinState* const state, size_t const size)
+{
+    HistorySearch* const search = &state->search;
+    if (search->results_size < size) {
+        size_t const new_size =
+          size > 2U * search->results_size ? size : 2U * search->results_size;
+        size_t* const results = (size_t*)state_realloc(
+          state, search->results, new_size * sizeof(size_t));
+        if (!results) {
+            return COMLIN_NO_MEMORY;
+        }
+
+        search->results = results;
+        search->results_size = new_size;
+    }
+
+    return COMLIN_SUCCESS;
+}
+
+/* Update the search candidates for the current query.
+ *
+ * Results are search numbers, newest first, and are only checked as needed
+ * to show them, so typing only checks entries up to the newest match.  If the
+ * query was just extended, the previous candidates are narrowed down, unless
+ * fewer entries contain its rarest trigram.  Otherwise, candidates come from
+ * the indices, or are every entry for queries too short to use them.  Shared
+ * entries are all older than our own, so their candidates aren't copied into
+ * the results, but are taken lazily from the shared index or history after
+ * our own candidates have been checked.
+ */
+static ComlinStatus
+search_update(ComlinState* const state, bool const extended)
+{
+    HistorySearch* const search = &state->search;
+    search_gather(search);
+
+    char const* const query = search->query.data;
+    size_t const query_len = search->query.length;
+    size_t const ncandidates = search->end;
+    uint32_t const* const lazy = search->lazy;
+    size_t const nlazy = search->nlazy;
+    search->nresults = search->next = search->end = 0U;
+    search->lazy = NULL;
+    search->nlazy = 0U;
+    if (!query_len) {
+        return COMLIN_SUCCESS;
+    }
+
+    // Find the postings of the rarest trigram in the query in both indices
+    ComlinHistory const* const shared = state->shared;
+    SearchPostings const* rarest = NULL;
+    SearchPostings const* rarest_shared = NULL;
+    size_t rarest_count = 0U;
+    if (query_len >= 3U && search->nbuckets) {
+        for (size_t i = 0U; i + 3U <= query_len; ++i) {
+            uint32_t const key = trigram_key(query + i);
+            SearchPostings const* const postings = search_postings(search, key);
+            SearchPostings const* const shared_postings =
+              shared ? search_postings(&shared->search, key) : NULL;
+            size_t const count =
+              postings->count + (shared ? shared_postings->count : 0U);
+            if (!count) {
+                return COMLIN_SUCCESS; // No entry contains this trigram
+            }
+
+            if (!rarest || count < rarest_count) {
+                rarest = postings;
+                rarest_shared = shared_postings;
+                rarest_count = count;
+            }
+        }
+    }
+
+    size_t const nshared = history_nshared(state);
+    if (extended && query_len > 1U &&
+        (!rarest || ncandidates + nlazy <= rarest_count)) {
+        search->end = ncandidates; // Narrow down the gathered candidates
+        search->lazy = lazy;
+        search->nlazy = nlazy;
+    } else if (rarest) {
+        // Postings may include removed entries, which are skipped when checked
+        if (search_reserve(state, rarest->count)) {
+            return COMLIN_NO_MEMORY;
+        }
+
+        for (size_t i = rarest->count; i-- > 0U;) {
+            search->results[search->end++] = nshared + rarest->seqs[i];
+        }
+
+        search->lazy = rarest_shared ? rarest_shared->seqs : NULL;
+        search->nlazy = rarest_shared ? rarest_shared->count : 0U;
+    } else {
+        if (search_reserve(state, state->history_len)) {
+            return COMLIN_NO_MEMORY;
+        }
+
+        for (size_t i = state->history_len; i-- > 0U;) {
+            search->results[search->end++] =
+              nshared + history_entry(state, i)->seq;
+        }
+
+        search->nlazy = nshared; // Every shared entry, newest first
+    }
+
+    return COMLIN_SUCCESS;
+}
+
+// Check candidates until there is a result at an index, or return false
+static bool
+search_check(ComlinState* const state, size_t const index)
+{
+    HistorySearch* const search = &state->search;
+    while (search->nresults <= index && search->next < search->end) {
+        size_t const seq = search->results[search->next++];
+        if (search_matches(state, seq)) {
+            search->results[search->nresults++] = seq;
+        }
+    }
+
+    // Then check the shared candidates, appending matches after the others
+    while (search->nresults <= index && search->nlazy) {
+        size_t const i = search->nlazy - 1U;
+        size_t const seq = search->lazy ? search->lazy[i] : i;
+        if (search_matches(state, seq)) {
+            if (search_reserve(state, search->nresults + 1U)) {
+                break; // Try this candidate again next time
+            }
+
+            search->results[search->nresults++] = seq;
+            search->next = search->end = search->nresults;
+        }
+
+        search->nlazy = i;
+    }
+
+    return index < search->nresults;
+}
+
+// Show a search result, whose text must contain the query
+static void
+search_show(ComlinState* const state, size_t const index)
+{
+    HistorySearch* const search = &state->search;
+    size_t len = 0U;
+    char const* const text =
+      search_find_text(state, search->results[index], &len);
+
+    search->current = index;
+    search->shown = search->results[index];
+    search->match = (size_t)(find_text(text,
+                                       len,
+                                       search->query.data,
+                                       search->query.length) -
+                             text);
+}
+
+// Refresh the line to show the search prompt and the shown entry
+static ComlinStatus
+refresh_search(ComlinState* const l)
+{
+    HistorySearch* const search = &l->search;
+    bool const failing = search->query.length && !search->nresults;
+
+    search->prompt.length = 0U;
+    buf_append(l, &search->prompt,
+               failing ? "(failing reverse-i-search)`" : "(reverse-i-search)`",
+               failing ? 27U : 19U);
+    if (search->query.length) {
+        buf_append(
+          l, &search->prompt, search->query.data, search->query.length);
+    }
+
+    buf_append(l, &search->prompt, "': ", 3U);
+
+    // Show the entry (or the original line) and search prompt temporarily
+    char const* const saved_prompt = l->prompt;
+    size_t const saved_plen = l->plen;
+    size_t const saved_pos = l->pos;
+    LineBuf const saved_buf = l->buf;
+    size_t len = 0U;
+    char const* const text =
+      search->shown == SIZE_MAX ? NULL
+                                : search_find_text(l, search->shown, &len);
+    if (text) {
+        if (!line_set(l, &l->shown, text, len, l->maskmode)) {
+            return COMLIN_NO_MEMORY;
+        }
+
+        l->buf = l->shown;
+        l->pos = search->match;
+    }
+
+    l->prompt = search->prompt.data;
+    l->plen = search->prompt.length;
+    ComlinStatus const st =
+      l->mlmode ? refresh_multi_line(l) : refresh_single_line(l);
+
+    // Without an entry the line itself was drawn, so keep any columns found
+    if (text) {
+        l->shown = l->buf;
+        l->buf = saved_buf;
+    }
+
+    l->prompt = saved_prompt;
+    l->plen = saved_plen;
+    l->pos = saved_pos;
+    return st;
+}
+
+/* History Prefix Navigation */
+
+/* In prefix mode, stepping through the history only shows entries that start
+ * with the text before the cursor.  To find them quickly, the sequence numbers
+ * of entries are kept sorted by text (then by number), so the entries with a
+ * prefix are a range that can be found by binary search.  The order is built
+ * when it's first needed, then kept up to date as entries are added and
+ * removed, unless many have changed (like when loading a file), in which case
+ * it's cheaper to rebuild it later.  When stepping, the matches for a prefix
+ * are gathered and sorted by age once, so each step is a binary search.
+ */
+
+typedef enum {
+    COMLIN_HISTORY_NEXT,
+    COMLIN_HISTORY_PREV,
+} ComlinHistoryDirection;
+
+// The text and sequence number of a history entry, for sorting entries
+typedef struct {
+    char const* text; ///< Text of entry
+    size_t length;    ///< Length of text
+    size_t seq;       ///< Sequence number of entry
+} OrderKey;
+
+// Compare two strings, where a string comes before any longer ones it starts
+static int
+compare_text(char const* const lhs,
+             size_t const lhs_len,
+             char const* const rhs,
+             size_t const rhs_len)
+{
+    int const cmp = memcmp(lhs, rhs, lhs_len < rhs_len ? lhs_len : rhs_len);
+
+    return cmp ? cmp : (lhs_len > rhs_len) - (lhs_len < rhs_len);
+}
+
+static int
+compare_order_keys(void const* const lhs, void const* const rhs)
+{
+    OrderKey const* const l = (OrderKey const*)lhs;
+    OrderKey const* const r = (OrderKey const*)rhs;
+    int const cmp = compare_text(l->text, l->length, r->text, r->length);
+
+    return cmp ? cmp : (l->seq > r->seq) - (l->seq < r->seq);
+}
+
+static int
+compare_sizes(void const* const lhs, void const* const rhs)
+{
+    size_t const l = *(size_t const*)lhs;
+    size_t const r = *(size_t const*)rhs;
+
+    return (l > r) - (l < r);
+}
+
+// Free the sorted order of history entries and the matches found with it
+static void
+order_free(ComlinState* const state)
+{
+    HistoryOrder* const order = &state->history_order;
+    size_t const pending = order->pending;
+
+    state_free(state, order->seqs);
+    state_free(state, order->matches);
+    state_free(state, order->prefix.data);
+    memset(order, 0, sizeof(HistoryOrder));
+    order->pending = pending;
+}
+
+// Build the sorted order of all history entries
+static ComlinStatus
+order_build(ComlinState* const state)
+{
+    HistoryOrder* const order = &state->history_order;
+    size_t const n = state->history_len - state->history_erased;
+    if (order->size < n) {
+        size_t* const seqs =
+          (size_t*)state_realloc(state, order->seqs, n * sizeof(size_t));
+        if (!seqs) {
+            return COMLIN_NO_MEMORY;
+        }
+
+        order->seqs = seqs;
+        order->size = n;
+    }
+
+    OrderKey* const keys =
+      (OrderKey*)state_malloc(state, (n ? n : 1U) * sizeof(OrderKey));
+    if (!keys) {
         return COMLIN_NO_MEMORY;
     }
 
-    lc->cvec[lc->len++] = copy;
-    return COMLIN_SUCCESS;
+    size_t count = 0U;
+    for (size_t i = 0U; i < state->history_len; ++i) {
+        HistoryEntry const* const entry = history_entry(state, i);
+        if (entry->offset != HISTORY_ERASED &&
+            entry->seq + 1U != order->pending) {
+            OrderKey const key = {
+              history_text(state, entry), entry->length, entry->seq};
+            keys[count++] = key;
+        }
+    }
+
+    qsort(keys, count, sizeof(OrderKey), compare_order_keys);
+    for (size_t i = 0U; i < count; ++i) {
+        order->seqs[i] = keys[i].seq;
+    }
+
+    state_free(state, keys);
+    order->count = count;
+    order->built = true;
+    order->matches_valid = false;
+    return COMLIN_SUCCESS;
+}
+
+// Return the position of the first entry in the order not before some text
+static size_t
+order_find(ComlinState const* const state,
+           char const* const text,
+           size_t const len,
+           size_t const seq)
+{
+    HistoryOrder const* const order = &state->history_order;
+    size_t lo = 0U;
+    size_t hi = order->count;
+    while (lo < hi) {
+        size_t const mid = lo + ((hi - lo) / 2U);
+        HistoryEntry const* const entry =
+          history_find_seq(state, order->seqs[mid]);
+        int const cmp =
+          compare_text(history_text(state, entry), entry->length, text, len);
+        if (cmp < 0 || (!cmp && entry->seq < seq)) {
+            lo = mid + 1U;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo;
 }
 
-/* String Buffer */
-
+/* Update the prefix matches for an entry being inserted or removed.
+ *
+ * Only entries that start with the prefix change the matches, and entries are
+ * usually added as the newest, so this normally doesn't move any of them.
+ */
 static void
-buf_append(StringBuf* const buf, char const* const s, size_t const len)
+order_update_matches(ComlinState* const state,
+                     HistoryEntry const* const entry,
+                     bool const insert)
 {
-    assert(s);
+    HistoryOrder* const order = &state->history_order;
+    StringBuf const* const prefix = &order->prefix;
+    if (!order->matches_valid || entry->length < prefix->length ||
+        memcmp(history_text(state, entry), prefix->data, prefix->length)) {
+        return;
+    }
 
-    size_t const new_length = buf->length + len;
-    size_t const needed_size = new_length + 1U;
-    if (needed_size > buf->size) {
-        char* const new_data = (char*)realloc(buf->data, needed_size);
-        if (!new_data) {
+    // Find where the entry is in the matches, which are sorted from the oldest
+    size_t const seq = history_nshared(state) + entry->seq;
+    size_t lo = 0U;
+    size_t hi = order->nmatches;
+    while (lo < hi) {
+        size_t const mid = lo + ((hi - lo) / 2U);
+        if (order->matches[mid] < seq) {
+            lo = mid + 1U;
+        } else {
+            hi = mid;
+        }
+    }
+
+    if (!insert) {
+        if (lo < order->nmatches && order->matches[lo] == seq) {
+            memmove(order->matches + lo,
+                    order->matches + lo + 1U,
+                    (order->nmatches - lo - 1U) * sizeof(size_t));
+            --order->nmatches;
+        }
+        return;
+    }
+
+    if (order->nmatches == order->matches_size) {
+        size_t const size =
+          order->matches_size ? 2U * order->matches_size : 16U;
+        size_t* const matches =
+          (size_t*)state_realloc(state, order->matches, size * sizeof(size_t));
+        if (!matches) {
+            order->matches_valid = false; // Gather them again when needed
             return;
         }
 
-        buf->data = new_data;
-        buf->size = needed_size;
+        order->matches = matches;
+        order->matches_size = size;
     }
 
-    assert(buf->data);
-    memcpy(buf->data + buf->length, s, len);
-    buf->data[new_length] = '\0';
-    buf->length = new_length;
+    memmove(order->matches + lo + 1U,
+            order->matches + lo,
+            (order->nmatches - lo) * sizeof(size_t));
+    order->matches[lo] = seq;
+    ++order->nmatches;
 }
 
-static size_t
-format_size(char* const buf, size_t x)
+/* Insert a live history entry into the order.
+ *
+ * This moves the entries after it along, which takes linear time, but is only
+ * a single memory move per line that is added or changed.  The line being
+ * edited isn't in the order until it's committed, so saving it before
+ * stepping through the history doesn't change the order at all.
+ */
+static void
+order_insert(ComlinState* const state, HistoryEntry const* const entry)
 {
-    size_t i = 0U;
-
-    // Write digits backwards
-    do {
-        buf[i++] = (char)('0' + (x % 10U));
-        x /= 10U;
-    } while (x);
+    HistoryOrder* const order = &state->history_order;
+    if (!order->built || entry->seq + 1U == order->pending) {
+        return;
+    }
 
-    // Terminate and reverse string
-    buf[i] = '\0';
-    if (i) {
-        for (size_t l = 0U, r = i - 1U; l < r; ++l, --r) {
-            char const t = buf[l];
-            buf[l] = buf[r];
-            buf[r] = t;
+    if (order->count == order->size) {
+        size_t const size = order->size ? 2U * order->size : 16U;
+        size_t* const seqs =
+          (size_t*)state_realloc(state, order->seqs, size * sizeof(size_t));
+        if (!seqs) {
+            order->built = false; // Try again when it's next needed
+            order->matches_valid = false;
+            return;
         }
+
+        order->seqs = seqs;
+        order->size = size;
     }
 
-    return i;
+    size_t const i =
+      order_find(state, history_text(state, entry), entry->length, entry->seq);
+    memmove(order->seqs + i + 1U,
+            order->seqs + i,
+            (order->count - i) * sizeof(size_t));
+    order->seqs[i] = entry->seq;
+    ++order->count;
+    order_update_matches(state, entry, true);
 }
 
-// Append an escape like `ESC [ n s` with a number and a suffix letter
+// Remove a live history entry from the order
 static void
-buf_append_vtesc(StringBuf* const buf, size_t const num, char const suffix)
+order_remove(ComlinState* const state, HistoryEntry const* const entry)
 {
-    size_t end = 2U;
-    char seq[64] = {'\x1B', '[', 0};
-
-    end += format_size(seq + 2U, num);
-    seq[end++] = suffix;
-
-    buf_append(buf, seq, end);
+    HistoryOrder* const order = &state->history_order;
+    if (order->built && entry->seq + 1U != order->pending) {
+        size_t const i = order_find(
+          state, history_text(state, entry), entry->length, entry->seq);
+        assert(i < order->count && order->seqs[i] == entry->seq);
+        memmove(order->seqs + i,
+                order->seqs + i + 1U,
+                (order->count - i - 1U) * sizeof(size_t));
+        --order->count;
+        order_update_matches(state, entry, false);
+    }
 }
 
+// Insert the entry of a line that is no longer being edited into the order
 static void
-buf_free(StringBuf* const buf)
+order_commit(ComlinState* const state)
 {
-    free(buf->data);
+    HistoryOrder* const order = &state->history_order;
+    if (order->pending) {
+        HistoryEntry const* const entry =
+          history_find_seq(state, order->pending - 1U);
+        order->pending = 0U;
+        if (entry) {
+            order_insert(state, entry);
+        }
+    }
 }
 
-static void
-append_line_text(StringBuf* const buf,
-                 char const* const text,
-                 size_t const length,
-                 bool const masked)
+// Return the bound of the entries that start with a prefix in a sorted order
+static size_t
+prefix_bound(ComlinState const* const state,
+             size_t const* const seqs,
+             size_t const count,
+             size_t const first_seq,
+             char const* const prefix,
+             size_t const prefix_len,
+             bool const upper)
 {
-    if (masked) {
-        for (size_t i = 0U; i < length; ++i) {
-            buf_append(buf, "*", 1);
+    size_t lo = 0U;
+    size_t hi = count;
+    while (lo < hi) {
+        size_t const mid = lo + ((hi - lo) / 2U);
+        size_t len = 0U;
+        char const* const text =
+          search_find_text(state, first_seq + seqs[mid], &len);
+        int const cmp = compare_text(
+          text, len < prefix_len ? len : prefix_len, prefix, prefix_len);
+        if (cmp < 0 || (upper && !cmp)) {
+            lo = mid + 1U;
+        } else {
+            hi = mid;
         }
-    } else {
-        buf_append(buf, text, length);
     }
-}
 
-/* Refresh */
+    return lo;
+}
 
-// Clear and refresh the current line in single-line mode
+// Gather the search numbers of all entries that start with a prefix
 static ComlinStatus
-refresh_single_line(ComlinState const* const l, ComlinRefreshFlags const flags)
+prefix_gather(ComlinState* const state,
+              char const* const prefix,
+              size_t const len)
 {
-    // Chop the start if necessary so the cursor is on screen
-    char* buf = l->buf.data;
-    size_t len = l->buf.length;
-    size_t pos = l->pos;
-    if (l->plen + l->pos >= l->cols) {
-        size_t const offset = l->plen + l->pos + 1U - l->cols;
-        buf += offset;
-        len -= offset;
-        pos -= offset;
+    HistoryOrder* const order = &state->history_order;
+    if (!order->built && order_build(state)) {
+        return COMLIN_NO_MEMORY;
     }
 
-    // Truncate display length to fit on the row
-    if (l->plen + len > l->cols) {
-        len = l->cols - l->plen;
-    }
+    // Find the range of matches in the shared and private orders
+    ComlinHistory const* const shared = state->shared;
+    size_t const nshared = history_nshared(state);
+    size_t const shared_lo =
+      shared ? prefix_bound(
+                 state, shared->sorted, nshared, 0U, prefix, len, false)
+             : 0U;
+    size_t const shared_hi =
+      shared
+        ? prefix_bound(state, shared->sorted, nshared, 0U, prefix, len, true)
+        : 0U;
+    size_t const lo = prefix_bound(
+      state, order->seqs, order->count, nshared, prefix, len, false);
+    size_t const hi = prefix_bound(
+      state, order->seqs, order->count, nshared, prefix, len, true);
+
+    size_t const n = (shared_hi - shared_lo) + (hi - lo);
+    if (order->matches_size < n) {
+        size_t* const matches =
+          (size_t*)state_realloc(state, order->matches, n * sizeof(size_t));
+        if (!matches) {
+            return COMLIN_NO_MEMORY;
+        }
 
-    // Start building an update for the whole row (to be sent in one write)
-    StringBuf update = {NULL, 0U, 0U};
-    buf_append(&update, "\r", 1);
+        order->matches = matches;
+        order->matches_size = n;
+    }
 
-    if (flags & REFRESH_WRITE) {
-        // Write the prompt and the current buffer content
-        buf_append(&update, l->prompt, l->plen);
-        append_line_text(&update, buf, len, l->maskmode);
+    // Collect the matches and sort them from the oldest
+    order->nmatches = 0U;
+    for (size_t i = shared_lo; i < shared_hi; ++i) {
+        order->matches[order->nmatches++] = shared->sorted[i];
     }
 
-    // Erase to right
-    buf_append(&update, VTESC "0K", 4);
+    for (size_t i = lo; i < hi; ++i) {
+        order->matches[order->nmatches++] = nshared + order->seqs[i];
+    }
 
-    if (flags & REFRESH_WRITE) {
-        // Move cursor to original position
-        buf_append(&update, "\r", 1);
-        buf_append_vtesc(&update, pos + l->plen, 'C');
+    if (order->nmatches > 1U) {
+        qsort(order->matches, order->nmatches, sizeof(size_t), compare_sizes);
     }
 
-    ComlinStatus const st = write_string(l->ofd, update.data, update.length);
-    buf_free(&update);
-    return st;
+    order->prefix.length = 0U;
+    buf_append(state, &order->prefix, prefix, len);
+    order->matches_valid = true;
+    return COMLIN_SUCCESS;
 }
 
-// Refresh the current line in multi-line mode
-static ComlinStatus
-refresh_multi_line(ComlinState* const l, ComlinRefreshFlags const flags)
+// Return the index of the entry with a search number if it can be stepped to
+static size_t
+prefix_candidate(ComlinState const* const state,
+                 size_t const seq,
+                 char const* const line,
+                 size_t const line_len,
+                 size_t const prefix_len)
 {
-    size_t const rpos = (l->plen + l->oldpos + l->cols) / l->cols;
-    size_t const old_rows = l->oldrows;
-    int const fd = l->ofd;
+    size_t const index = search_find_index(state, seq);
+    size_t len = 0U;
+    char const* const text =
+      index == SIZE_MAX ? NULL : history_view_text(state, index, &len);
+
+    // The entry may have been edited since, and one like the line is skipped
+    return (text && len >= prefix_len && !memcmp(text, line, prefix_len) &&
+            (len != line_len || memcmp(text, line, len)))
+             ? index
+             : SIZE_MAX;
+}
 
-    // Calculate the total number of rows in the line
-    size_t rows = (l->plen + l->buf.length + l->cols - 1U) / l->cols;
-    l->oldrows = rows;
+/* Find the next entry to step to in prefix mode.
+ *
+ * Sets `*index` to the history index of the closest older or newer entry that
+ * starts with the text before the cursor, and isn't the same as the line.
+ * Stepping forwards past the newest match returns to the line being edited.
+ * Returns #COMLIN_EDITING if there's nothing to step to.
+ */
+static ComlinStatus
+history_prefix_step(ComlinState* const l,
+                    ComlinHistoryDirection const dir,
+                    size_t* const index)
+{
+    HistoryOrder* const order = &l->history_order;
+    char const* const line = line_text(l, &l->buf);
+    size_t const line_len = l->buf.length;
+    size_t const len = l->pos;
+    if ((!order->matches_valid || order->prefix.length != len ||
+         memcmp(order->prefix.data, line, len)) &&
+        prefix_gather(l, line, len)) {
+        return COMLIN_NO_MEMORY;
+    }
 
-    // We'll build the update here, then send it all in a single write
-    StringBuf update = {NULL, 0U, 0U};
+    // Find the first match that is newer than the current entry
+    size_t const nentries = history_nshared(l) + l->history_len;
+    size_t const current = search_seq(l, nentries - 1U - *index);
+    size_t lo = 0U;
+    size_t hi = order->nmatches;
+    while (lo < hi) {
+        size_t const mid = lo + ((hi - lo) / 2U);
+        if (order->matches[mid] <= current) {
+            lo = mid + 1U;
+        } else {
+            hi = mid;
+        }
+    }
 
-    // First clear all the old used rows
-    if (flags & REFRESH_CLEAN) {
-        // Go to the last row
-        if (old_rows > rpos) {
-            buf_append_vtesc(&update, old_rows - rpos, 'B');
+    if (dir == COMLIN_HISTORY_PREV) {
+        for (size_t i = lo; i-- > 0U;) {
+            size_t const seq = order->matches[i];
+            size_t const found =
+              seq < current ? prefix_candidate(l, seq, line, line_len, len)
+                            : SIZE_MAX;
+            if (found != SIZE_MAX) {
+                *index = nentries - 1U - found;
+                return COMLIN_SUCCESS;
+            }
         }
 
-        // For each row, clear it, then move up
-        for (size_t j = 1U; j < old_rows; ++j) {
-            buf_append(&update, "\r" VTESC "0K" VTESC "1A", 9U);
+        return COMLIN_EDITING;
+    }
+
+    size_t const edited = search_seq(l, nentries - 1U);
+    for (size_t i = lo; i < order->nmatches && order->matches[i] < edited;
+         ++i) {
+        size_t const found =
+          prefix_candidate(l, order->matches[i], line, line_len, len);
+        if (found != SIZE_MAX) {
+            *index = nentries - 1U - found;
+            return COMLIN_SUCCESS;
         }
     }
 
-    if (flags & REFRESH_WRITE) {
-        // Write the current prompt and line over the current row
-        buf_append(&update, "\r", 1);
-        buf_append(&update, l->prompt, l->plen);
-        append_line_text(&update, l->buf.data, l->buf.length, l->maskmode);
-        buf_append(&update, VTESC "0K", 4U);
+    if (*index) {
+        *index = 0U; // Return to the line being edited
+        return COMLIN_SUCCESS;
+    }
+
+    return COMLIN_EDITING;
+}
 
-        // If we're at the end of the row, move to the start of the next
-        if (l->pos && l->pos == l->buf.length &&
-            (l->pos + l->plen) % l->cols == 0) {
-            buf_append(&update, "\n\r", 2);
-            if (++rows > l->oldrows) {
-                l->oldrows = rows;
-            }
+/* Undo */
+
+/* Every change that the user makes to the line is recorded in the undo log as
+ * one or more edits, each with only the text it inserted or deleted.  Typing
+ * or deleting characters one at a time extends the last edit, so a word is
+ * undone all at once, as long as nothing else changed the line in between.
+ *
+ * Killed text is also kept in a small ring that outlives the line, with each
+ * kill stored one after another in a single buffer, like the undo log. */
+
+// Reverse the bytes in a range
+static void
+reverse_bytes(char* first, char* last)
+{
+    while (first < last && first < --last) {
+        char const c = *first;
+        *first++ = *last;
+        *last = c;
+    }
+}
+
+// Rotate the bytes in a range in place, so those from `mid` come first
+static void
+rotate_bytes(char* const first, char* const mid, char* const last)
+{
+    reverse_bytes(first, mid);
+    reverse_bytes(mid, last);
+    reverse_bytes(first, last);
+}
+
+// Return the offset of the start of an edit's text in the undo log
+static inline size_t
+undo_start(UndoLog const* const log, size_t const i)
+{
+    return i ? log->edits[i - 1U].end : 0U;
+}
+
+// Forget every edit in the undo log
+static void
+undo_reset(UndoLog* const log)
+{
+    log->text.length = log->nedits = log->count = 0U;
+    log->typing = false;
+}
+
+/* Try to extend the last edit in the undo log with another like it.
+ *
+ * Characters typed after the last inserted ones are appended, up to the start
+ * of the next word, and characters deleted on either side of the last deleted
+ * ones are added to that end.
+ */
+static bool
+undo_extend(ComlinState* const l,
+            size_t const pos,
+            char const* const text,
+            size_t const len)
+{
+    UndoLog* const log = &l->undo;
+    UndoEdit* const last = &log->edits[log->nedits - 1U];
+    size_t const start = undo_start(log, log->nedits - 1U);
+    StringBuf* const buf = &log->text;
+    if (!last->deleted) {
+        bool const joins = pos == last->pos + (last->end - start) &&
+                           (text[0] != ' ' || buf->data[last->end - 1U] == ' ');
+        if (joins) {
+            buf_append(l, buf, text, len);
         }
 
-        // Move the cursor up to the correct row if necessary
-        size_t const rpos2 = (l->plen + l->pos + l->cols) / l->cols;
-        if (rows > rpos2) {
-            buf_append_vtesc(&update, rows - rpos2, 'A');
+        return joins;
+    }
+
+    if (pos != last->pos && pos + len != last->pos) {
+        return false;
+    }
+
+    // Add the text to the end, then rotate it to the start if it was before
+    line_copy(l, &l->buf, pos, pos + len, buf);
+    if (pos < last->pos && buf->length == last->end + len) {
+        char* const data = buf->data;
+        rotate_bytes(data + start, data + last->end, data + buf->length);
+        last->pos = pos;
+    }
+
+    return true;
+}
+
+/* Add an edit to the undo log, just before it's made to the line.
+ *
+ * The text is given for an insertion, or null for a deletion, which copies it
+ * from the line.  Any undone edits are dropped, since they can no longer be
+ * redone.  If memory allocation fails, then the whole log is dropped, so the
+ * edit can still be made, but nothing before it can be undone.
+ */
+static void
+undo_record(ComlinState* const l,
+            size_t const pos,
+            char const* const text,
+            size_t const len,
+            UndoGroup const group)
+{
+    UndoLog* const log = &l->undo;
+    bool const deleted = !text;
+    log->count = log->nedits;
+    log->text.length = undo_start(log, log->nedits);
+
+    // Extend the last edit if this continues typing or deleting characters
+    size_t const old_length = log->text.length;
+    if (group == UNDO_TYPING && log->typing &&
+        log->generation == l->buf.generation &&
+        log->edits[log->nedits - 1U].deleted == deleted &&
+        undo_extend(l, pos, text, len)) {
+        if (log->text.length == old_length + len) {
+            log->edits[log->nedits - 1U].end = log->text.length;
+        } else {
+            undo_reset(log);
         }
 
-        // Move the cursor to the correct column
-        buf_append(&update, "\r", 1);
-        size_t const col = (l->plen + l->pos) % l->cols;
-        if (col) {
-            buf_append_vtesc(&update, col, 'C');
+        return;
+    }
+
+    // Grow the log if necessary
+    if (log->count == log->size) {
+        size_t const size = log->size ? 2U * log->size : 16U;
+        UndoEdit* const edits =
+          (UndoEdit*)state_realloc(l, log->edits, size * sizeof(UndoEdit));
+        if (!edits) {
+            undo_reset(log);
+            return;
         }
+
+        log->edits = edits;
+        log->size = size;
     }
 
-    l->oldpos = l->pos;
+    // Add the text and a new edit to the end
+    if (deleted) {
+        line_copy(l, &l->buf, pos, pos + len, &log->text);
+    } else {
+        buf_append(l, &log->text, text, len);
+    }
 
-    ComlinStatus const st = write_string(fd, update.data, update.length);
-    buf_free(&update);
-    return st;
+    if (log->text.length != old_length + len) {
+        undo_reset(log);
+        return;
+    }
+
+    bool const joined = group == UNDO_JOINED && log->nedits;
+    UndoEdit const edit = {pos, l->pos, log->text.length, deleted, joined};
+    log->edits[log->nedits++] = edit;
+    log->count = log->nedits;
+    log->typing = group == UNDO_TYPING;
 }
 
-// Optionally clear and/or refresh the current line
-static ComlinStatus
-refresh_line_with_flags(ComlinState* const l, ComlinRefreshFlags const flags)
+// Insert text into the line as an edit that can be undone
+static bool
+edit_insert(ComlinState* const l,
+            size_t const pos,
+            char const* const text,
+            size_t const len,
+            UndoGroup const group)
 {
-    return l->mlmode ? refresh_multi_line(l, flags)
-                     : refresh_single_line(l, flags);
+    if (!len) {
+        return true;
+    }
+
+    if (!line_reserve(l, &l->buf, len)) {
+        return false;
+    }
+
+    undo_record(l, pos, text, len, group);
+    line_insert(l, &l->buf, pos, text, len, l->maskmode);
+    l->undo.generation = l->buf.generation;
+    return true;
 }
 
-ComlinStatus
-comlin_hide(ComlinState* const l)
+// Erase a range of text from the line as an edit that can be undone
+static void
+edit_erase(ComlinState* const l,
+           size_t const start,
+           size_t const end,
+           UndoGroup const group)
 {
-    return refresh_line_with_flags(l, REFRESH_CLEAN);
+    if (start < end) {
+        undo_record(l, start, NULL, end - start, group);
+        line_erase(l, &l->buf, start, end);
+        l->undo.generation = l->buf.generation;
+    }
 }
 
-ComlinStatus
-comlin_show(ComlinState* const l)
+// Replace the text in the line as one change, which only edits what differs
+static bool
+edit_replace(ComlinState* const l, char const* const text, size_t const len)
 {
-    if (l->in_completion && l->buf.length) {
-        ComlinCompletions completions = {0U, NULL};
-        l->completion_callback(l->buf.data, &completions);
-        return refresh_line_with_completion(l, &completions, REFRESH_WRITE);
+    // Find the end of the common prefix, at the start of a character
+    LineBuf* const line = &l->buf;
+    size_t start = 0U;
+    while (start < len && start < line->length &&
+           line_byte(line, start) == text[start]) {
+        ++start;
+    }
+
+    while (start && ((start < len && is_continuation(text[start])) ||
+                     (start < line->length &&
+                      is_continuation(line_byte(line, start))))) {
+        --start;
+    }
+
+    bool const erased = start < line->length;
+    edit_erase(l, start, line->length, UNDO_NEW);
+    return edit_insert(
+      l, start, text + start, len - start, erased ? UNDO_JOINED : UNDO_NEW);
+}
+
+// Return the offset of the start of a kill's text in the kill ring
+static inline size_t
+kill_start(KillRing const* const kills, size_t const i)
+{
+    return i ? kills->ends[i - 1U] : 0U;
+}
+
+/* Add text that's about to be killed from the line to the kill ring.
+ *
+ * Text that's killed right where the last kill was, without any other change
+ * in between, is added to that kill, so several kills in a row are yanked
+ * back together.  Nothing is kept in mask mode, so a password can't be yanked
+ * into another line.
+ */
+static void
+kill_save(ComlinState* const l, size_t const start, size_t const end)
+{
+    KillRing* const kills = &l->kills;
+    StringBuf* const text = &kills->text;
+    bool const yanking = kills->yanking;
+    kills->yanking = false; // Even if nothing is kept, this isn't a yank
+    if (l->maskmode) {
+        return;
+    }
+
+    if (!kills->count || yanking || kills->pos != l->pos ||
+        kills->generation != l->buf.generation) {
+        if (kills->count == COMLIN_KILL_RING_SIZE) {
+            // Drop the oldest kill to make room
+            size_t const n = kills->ends[0];
+            if (n) {
+                memmove(text->data, text->data + n, text->length - n);
+                text->length -= n;
+            }
+
+            for (size_t i = 1U; i < kills->count; ++i) {
+                kills->ends[i - 1U] = kills->ends[i] - n;
+            }
+
+            --kills->count;
+        }
+
+        kills->ends[kills->count++] = text->length;
     }
 
-    return refresh_line_with_flags(l, REFRESH_WRITE);
+    // Add the text to the end, then rotate it to the start if it was before
+    size_t const first = kill_start(kills, kills->count - 1U);
+    size_t const old_length = text->length;
+    line_copy(l, &l->buf, start, end, text);
+    if (text->length != old_length + (end - start)) {
+        text->length = old_length;
+    } else if (start < l->pos) {
+        char* const data = text->data;
+        rotate_bytes(data + first, data + old_length, data + text->length);
+    }
+
+    kills->ends[kills->count - 1U] = text->length;
+}
+
+// Kill a range of text in the line, which moves the cursor to its start
+static void
+edit_kill(ComlinState* const l, size_t const start, size_t const end)
+{
+    if (start < end) {
+        kill_save(l, start, end);
+        edit_erase(l, start, end, UNDO_NEW);
+        l->pos = l->kills.pos = start;
+        l->kills.generation = l->buf.generation;
+    }
 }
 
 /* Editing Operations */
@@ -670,54 +4577,74 @@ edit_status(ComlinStatus const st)
 static ComlinStatus
 comlin_edit_refresh(ComlinState* const l)
 {
+    if (l->defer_refresh) {
+        l->refresh_pending = true;
+        return COMLIN_EDITING;
+    }
+
     return edit_status(refresh_line_with_flags(l, REFRESH_ALL));
 }
 
-// Insert a character at the current cursor position
+// Insert a string at the current cursor position
+static ComlinStatus
+comlin_edit_insert_text(ComlinState* const l,
+                        char const* const text,
+                        size_t const len,
+                        UndoGroup const group)
+{
+    if (!edit_insert(l, l->pos, text, len, group)) {
+        return COMLIN_NO_MEMORY;
+    }
+
+    l->pos += len;
+    return comlin_edit_refresh(l);
+}
+
+/* Insert a typed byte at the current cursor position.
+ *
+ * The bytes of a UTF-8 character are buffered until it's complete, so a
+ * partial character is never shown, and it's inserted all at once.
+ */
 static ComlinStatus
 comlin_edit_insert(ComlinState* const l, char const c)
 {
-    if (l->buf.length == l->pos) {
-        // Insert at end of line
-        buf_append(&l->buf, &c, 1U);
-        ++l->pos;
-        if ((!l->mlmode || l->oldrows <= 1U) &&
-            l->plen + l->buf.length < l->cols) {
-            // Avoid a full update of the line in the trivial case
-            char const d = (char)(l->maskmode ? '*' : c);
-            return write(l->ofd, &d, 1) == 1 ? COMLIN_EDITING
-                                             : COMLIN_BAD_WRITE;
+    if (l->partial_len && is_continuation(c)) {
+        l->partial[l->partial_len++] = c;
+        if (l->partial_len < utf8_sequence_length(l->partial[0])) {
+            return COMLIN_EDITING;
         }
-    } else {
-        // Insert in middle of line
-        buf_append(&l->buf, " ", 1U); // Allocate space for one extra character
-        memmove(l->buf.data + l->pos + 1,
-                l->buf.data + l->pos,
-                l->buf.length - l->pos);
-        l->buf.data[l->pos] = c;
-        ++l->pos;
+
+        size_t const len = l->partial_len;
+        l->partial_len = 0U;
+        return comlin_edit_insert_text(l, l->partial, len, UNDO_TYPING);
     }
 
-    return comlin_edit_refresh(l);
+    if (utf8_sequence_length(c) > 1U) {
+        l->partial[0] = c;
+        l->partial_len = 1U;
+        return COMLIN_EDITING;
+    }
+
+    return comlin_edit_insert_text(l, &c, 1U, UNDO_TYPING);
 }
 
-// Move cursor one column to the left if possible
+// Move cursor one character to the left if possible
 static ComlinStatus
 comlin_edit_move_left(ComlinState* const l)
 {
     if (l->pos > 0) {
-        --l->pos;
+        l->pos = prev_char(&l->buf, l->pos);
         return comlin_edit_refresh(l);
     }
     return COMLIN_EDITING;
 }
 
-// Move cursor one column to the right if possible
+// Move cursor one character to the right if possible
 static ComlinStatus
 comlin_edit_move_right(ComlinState* const l)
 {
     if (l->pos != l->buf.length) {
-        ++l->pos;
+        l->pos = next_char(&l->buf, l->pos);
         return comlin_edit_refresh(l);
     }
     return COMLIN_EDITING;
@@ -749,54 +4676,87 @@ comlin_edit_move_end(ComlinState* const l)
 static ComlinStatus
 comlin_edit_transpose(ComlinState* const state)
 {
-    if (state->pos > 0U && state->pos < state->buf.length) {
-        char const aux = state->buf.data[state->pos - 1];
-        state->buf.data[state->pos - 1] = state->buf.data[state->pos];
-        state->buf.data[state->pos] = aux;
-        if (state->pos != state->buf.length - 1U) {
-            ++state->pos;
+    LineBuf* const line = &state->buf;
+    if (state->pos > 0U && state->pos < line->length) {
+        size_t const start = prev_char(line, state->pos);
+        size_t const end = next_char(line, state->pos);
+        size_t const next_len = end - state->pos;
+
+        // Swap the characters before the gap in place, then their columns
+        undo_record(state, start, NULL, end - start, UNDO_NEW);
+        line_move_gap(line, end);
+        char* const text = line->data;
+        rotate_bytes(text + start, text + state->pos, text + end);
+        undo_record(state, start, text + start, end - start, UNDO_JOINED);
+        if (is_continuation(text[start]) ||
+            (end < line->length && is_continuation(line_byte(line, end)))) {
+            line->valid = false;
+        } else if (line->valid) {
+            size_t col = line->columns[start];
+            columns_scan(
+              line->columns, text, end, start, &col, end, state->maskmode);
         }
+
+        line->generation = ++state->generation;
+        state->pos = (end != line->length) ? end : start + next_len;
         return edit_status(comlin_edit_refresh(state));
     }
     return COMLIN_EDITING;
 }
 
-typedef enum {
-    COMLIN_HISTORY_NEXT,
-    COMLIN_HISTORY_PREV,
-} ComlinHistoryDirection;
-
 // Substitute the currently edited line with the next or previous history entry
 static ComlinStatus
 comlin_edit_history_step(ComlinState* const l, ComlinHistoryDirection const dir)
 {
-    if (l->history_len > 1U) {
+    size_t const nshared = history_nshared(l);
+    size_t const nentries = nshared + l->history_len;
+    if (l->history_len && nentries > 1U) {
         // Update the current history entry before overwriting it with the next
-        size_t const current_index = l->history_len - 1U - l->history_index;
-        free(l->history[current_index]);
-        l->history[current_index] = comlin_copy_string(l->buf.data);
-        if (!l->history[current_index]) {
+        size_t const current = nentries - 1U - l->history_index;
+        if (current >= nshared &&
+            history_replace(
+              l, current - nshared, line_text(l, &l->buf), l->buf.length)) {
             return COMLIN_NO_MEMORY;
         }
 
-        // Update the history index
-        if (dir == COMLIN_HISTORY_NEXT) {
-            if (l->history_index == 0) {
-                return COMLIN_EDITING;
+        // Update the history index, skipping any erased entries
+        size_t index = l->history_index;
+        size_t len = 0U;
+        char const* text = NULL;
+        if (l->prefixmode && l->pos) {
+            ComlinStatus const st = history_prefix_step(l, dir, &index);
+            if (st) {
+                return st;
             }
-            --l->history_index;
+
+            text = history_view_text(l, nentries - 1U - index, &len);
         } else {
-            if (l->history_index == l->history_len - 1U) {
-                return COMLIN_EDITING;
-            }
-            ++l->history_index;
+            do {
+                if (dir == COMLIN_HISTORY_NEXT) {
+                    if (index == 0) {
+                        return COMLIN_EDITING;
+                    }
+                    --index;
+                } else {
+                    if (index == nentries - 1U) {
+                        return COMLIN_EDITING;
+                    }
+                    ++index;
+                }
+            } while (
+              !(text = history_view_text(l, nentries - 1U - index, &len)));
+        }
+        l->history_index = index;
+
+        // Show the new entry, where the cursor stays in place in prefix mode
+        size_t const pos = (l->prefixmode && l->pos < len) ? l->pos : len;
+        l->pos = 0U;
+        undo_reset(&l->undo); // Edits are only undone in the line they made
+        if (!line_set(l, &l->buf, text, len, l->maskmode)) {
+            return COMLIN_NO_MEMORY;
         }
 
-        // Show the new entry
-        size_t const new_index = l->history_len - 1U - l->history_index;
-        l->pos = strlen(l->history[new_index]);
-        l->buf.length = 0U;
-        buf_append(&l->buf, l->history[new_index], l->pos);
+        l->pos = pos;
         return comlin_edit_refresh(l);
     }
     return COMLIN_EDITING;
@@ -808,18 +4768,124 @@ comlin_edit_history_prev(ComlinState* const l)
     return comlin_edit_history_step(l, COMLIN_HISTORY_PREV);
 }
 
-static ComlinStatus
-comlin_edit_history_next(ComlinState* const l)
-{
-    return comlin_edit_history_step(l, COMLIN_HISTORY_NEXT);
-}
+static ComlinStatus
+comlin_edit_history_next(ComlinState* const l)
+{
+    return comlin_edit_history_step(l, COMLIN_HISTORY_NEXT);
+}
+
+static void
+comlin_edit_history_pop(ComlinState* const state)
+{
+    if (state->history_len) {
+        order_remove(state, history_entry(state, state->history_len - 1U));
+        state->history_order.pending = 0U;
+        size_t const slot = history_slot(state, --state->history_len);
+        history_unindex_slot(state, slot);
+        history_release(state, &state->history[slot]);
+
+        // Drop any erased entries that are now at the end
+        while (state->history_len &&
+               history_entry(state, state->history_len - 1U)->offset ==
+                 HISTORY_ERASED) {
+            --state->history_len;
+            --state->history_erased;
+        }
+    }
+
+    state->history_index = 0U;
+}
+
+// Start an incremental reverse search through the history
+static ComlinStatus
+comlin_edit_search(ComlinState* const l)
+{
+    HistorySearch* const search = &l->search;
+    if (l->maskmode || !l->history_len) {
+        return COMLIN_EDITING; // Don't reveal history when entering a password
+    }
+
+    // Build the index if necessary, or after many entries have been removed
+    if (!search->nbuckets || search->stale ||
+        search->nindexed > 2U * l->history_max_len) {
+        search_build_index(l); // Failure falls back to scanning all entries
+    }
+
+    search->active = true;
+    search->query.length = 0U;
+    search->nresults = search->next = search->end = 0U;
+    search->nlazy = 0U;
+    search->shown = SIZE_MAX;
+    return comlin_edit_refresh(l);
+}
+
+/* Handle a key while searching the history.
+ *
+ * Sets `*c` to zero if the key was consumed by the search, otherwise, the
+ * shown entry is accepted and the key should be processed as usual.
+ */
+static ComlinStatus
+comlin_edit_search_key(ComlinState* const l, char* const c)
+{
+    HistorySearch* const search = &l->search;
+    bool const extended = (uint8_t)*c >= 0x20U && *c != DEL;
+    if (*c == CTRL_R) {
+        // Show the next older match
+        if (search_check(l, search->current + 1U)) {
+            search_show(l, search->current + 1U);
+        } else {
+            comlin_beep(l);
+        }
+    } else if (*c == CTRL_G) {
+        search->active = false; // Cancel and show the original line
+    } else if (*c == CTRL_H || *c == DEL || extended) {
+        // Extend or shorten the query and update the results
+        if (extended) {
+            buf_append(l, &search->query, c, 1U);
+        } else if (search->query.length) {
+            --search->query.length;
+        }
+
+        size_t const shown = search->shown;
+        if (search_update(l, extended)) {
+            return COMLIN_NO_MEMORY;
+        }
+
+        // Show the newest result that isn't newer than the one shown before
+        size_t i = 0U;
+        while (extended && search_check(l, i) && search->results[i] > shown) {
+            ++i;
+        }
+
+        if (search_check(l, i)) {
+            search_show(l, i);
+        } else if (search_check(l, 0U)) {
+            search_show(l, 0U);
+        } else if (extended) {
+            comlin_beep(l);
+        } else if (!search->query.length) {
+            search->shown = SIZE_MAX; // Show the original line again
+        }
+    } else {
+        // Accept the shown entry and process the key as usual
+        size_t len = 0U;
+        char const* const text =
+          search->shown == SIZE_MAX ? NULL
+                                    : search_find_text(l, search->shown, &len);
+        if (text) {
+            undo_reset(&l->undo);
+            l->pos = line_set(l, &l->buf, text, len, l->maskmode)
+                       ? search->match
+                       : 0U;
+        }
+
+        search->active = false;
+        ComlinStatus const st = comlin_edit_refresh(l);
+        return st == COMLIN_EDITING ? COMLIN_SUCCESS : st;
+    }
 
-static void
-comlin_edit_history_pop(ComlinState* const state)
-{
-    --state->history_len;
-    free(state->history[state->history_len]);
-    state->history_index = 0U;
+    *c = '\0';
+    return comlin_edit_refresh(l);
 }
 
 // Delete the character to the right of the cursor
@@ -827,11 +4893,7 @@ static ComlinStatus
 comlin_edit_delete(ComlinState* const l)
 {
     if (l->pos < l->buf.length) {
-        memmove(l->buf.data + l->pos,
-                l->buf.data + l->pos + 1U,
-                l->buf.length - l->pos - 1U);
-        --l->buf.length;
-        l->buf.data[l->buf.length] = '\0';
+        edit_erase(l, l->pos, next_char(&l->buf, l->pos), UNDO_TYPING);
         return comlin_edit_refresh(l);
     }
     return COMLIN_EDITING;
@@ -860,34 +4922,29 @@ static ComlinStatus
 comlin_edit_backspace(ComlinState* const l)
 {
     if (l->pos) {
-        memmove(l->buf.data + l->pos - 1U,
-                l->buf.data + l->pos,
-                l->buf.length - l->pos);
-        --l->pos;
-        --l->buf.length;
-        l->buf.data[l->buf.length] = '\0';
+        size_t const start = prev_char(&l->buf, l->pos);
+        edit_erase(l, start, l->pos, UNDO_TYPING);
+        l->pos = start;
         return comlin_edit_refresh(l);
     }
     return COMLIN_EDITING;
 }
 
-// Delete the word before the cursor
+// Kill the word before the cursor
 static ComlinStatus
 comlin_edit_delete_prev_word(ComlinState* const l)
 {
-    size_t const old_pos = l->pos;
+    size_t start = l->pos;
+    char const* const text = l->buf.data;
 
-    while (l->pos > 0 && l->buf.data[l->pos - 1U] == ' ') {
-        --l->pos;
+    line_move_gap(&l->buf, l->pos);
+    while (start > 0 && text[start - 1U] == ' ') {
+        --start;
     }
-    while (l->pos > 0 && l->buf.data[l->pos - 1U] != ' ') {
-        --l->pos;
+    while (start > 0 && text[start - 1U] != ' ') {
+        --start;
     }
-    size_t const diff = old_pos - l->pos;
-    memmove(l->buf.data + l->pos,
-            l->buf.data + old_pos,
-            l->buf.length + 1U - old_pos);
-    l->buf.length -= diff;
+    edit_kill(l, start, l->pos);
     return comlin_edit_refresh(l);
 }
 
@@ -903,10 +4960,7 @@ static ComlinStatus
 comlin_edit_clear_line_backwards(ComlinState* const l)
 {
     if (l->pos > 0) {
-        size_t const new_length = l->buf.length - l->pos;
-        memmove(l->buf.data, l->buf.data + l->pos, new_length + 1);
-        l->buf.length = new_length;
-        l->pos = 0;
+        edit_kill(l, 0U, l->pos);
         return comlin_edit_refresh(l);
     }
     return COMLIN_EDITING;
@@ -916,13 +4970,130 @@ static ComlinStatus
 comlin_edit_clear_line_forwards(ComlinState* const l)
 {
     if (l->pos < l->buf.length) {
-        l->buf.data[l->pos] = '\0';
-        l->buf.length = l->pos;
+        edit_kill(l, l->pos, l->buf.length);
         return comlin_edit_refresh(l);
     }
     return COMLIN_EDITING;
 }
 
+// Insert a kill at the cursor, and remember where it is to replace it later
+static ComlinStatus
+yank(ComlinState* const l, size_t const index, UndoGroup const group)
+{
+    KillRing* const kills = &l->kills;
+    size_t const start = kill_start(kills, index);
+    size_t const len = kills->ends[index] - start;
+    if (!edit_insert(l, l->pos, kills->text.data + start, len, group)) {
+        return COMLIN_NO_MEMORY;
+    }
+
+    kills->yanked = index;
+    kills->start = l->pos;
+    kills->pos = l->pos += len;
+    kills->generation = l->buf.generation;
+    kills->yanking = true;
+    return comlin_edit_refresh(l);
+}
+
+// Insert the last killed text at the cursor
+static ComlinStatus
+comlin_edit_yank(ComlinState* const l)
+{
+    if (!l->kills.count) {
+        comlin_beep(l);
+        return COMLIN_EDITING;
+    }
+
+    return yank(l, l->kills.count - 1U, UNDO_NEW);
+}
+
+// Replace the text that was just yanked with the kill before it in the ring
+static ComlinStatus
+comlin_edit_yank_pop(ComlinState* const l)
+{
+    KillRing* const kills = &l->kills;
+    if (!kills->yanking || kills->pos != l->pos ||
+        kills->generation != l->buf.generation || kills->start > l->pos ||
+        l->pos > l->buf.length) {
+        comlin_beep(l);
+        return COMLIN_EDITING;
+    }
+
+    size_t const start = kills->start;
+    edit_erase(l, start, l->pos, UNDO_NEW);
+    l->pos = start;
+    return yank(l,
+                (kills->yanked ? kills->yanked : kills->count) - 1U,
+                start < kills->pos ? UNDO_JOINED : UNDO_NEW);
+}
+
+// Undo the last change to the line
+static ComlinStatus
+comlin_edit_undo(ComlinState* const l)
+{
+    UndoLog* const log = &l->undo;
+    if (!log->nedits) {
+        comlin_beep(l);
+        return COMLIN_EDITING;
+    }
+
+    // Undo edits in reverse order back to the start of the change
+    do {
+        UndoEdit const* const edit = &log->edits[log->nedits - 1U];
+        size_t const start = undo_start(log, log->nedits - 1U);
+        size_t const len = edit->end - start;
+        if (!edit->deleted) {
+            line_erase(l, &l->buf, edit->pos, edit->pos + len);
+        } else if (!line_insert(l,
+                                &l->buf,
+                                edit->pos,
+                                log->text.data + start,
+                                len,
+                                l->maskmode)) {
+            return COMLIN_NO_MEMORY;
+        }
+
+        l->pos = edit->cursor;
+    } while (log->edits[--log->nedits].joined);
+
+    log->typing = false;
+    return comlin_edit_refresh(l);
+}
+
+// Redo the last change to the line that was undone
+static ComlinStatus
+comlin_edit_redo(ComlinState* const l)
+{
+    UndoLog* const log = &l->undo;
+    if (log->nedits == log->count) {
+        comlin_beep(l);
+        return COMLIN_EDITING;
+    }
+
+    // Redo edits in order up to the start of the next change
+    do {
+        UndoEdit const* const edit = &log->edits[log->nedits];
+        size_t const start = undo_start(log, log->nedits);
+        size_t const len = edit->end - start;
+        if (edit->deleted) {
+            line_erase(l, &l->buf, edit->pos, edit->pos + len);
+            l->pos = edit->pos;
+        } else if (line_insert(l,
+                               &l->buf,
+                               edit->pos,
+                               log->text.data + start,
+                               len,
+                               l->maskmode)) {
+            l->pos = edit->pos + len;
+        } else {
+            return COMLIN_NO_MEMORY;
+        }
+    } while (++log->nedits < log->count && log->edits[log->nedits].joined);
+
+    log->typing = false;
+    return comlin_edit_refresh(l);
+}
+
 static ComlinStatus
 comlin_edit_submit(ComlinState* const l)
 {
@@ -930,7 +5101,12 @@ comlin_edit_submit(ComlinState* const l)
     if (l->mlmode) {
         comlin_edit_move_end(l);
     }
-    l->buf.data[l->buf.length] = '\0';
+
+    if (l->highlights.hint.length) {
+        l->highlights.hint.length = 0U; // Don't leave the hint on screen
+        comlin_edit_refresh(l);
+    }
+    line_text(l, &l->buf);
     return COMLIN_SUCCESS;
 }
 
@@ -942,8 +5118,25 @@ comlin_new_state(int const in_fd,
                  char const* const term,
                  size_t const max_history_len)
 {
-    ComlinState* const l = (ComlinState*)calloc(1, sizeof(ComlinState));
+    return comlin_new_state_with_allocator(
+      in_fd, out_fd, term, max_history_len, &default_allocator);
+}
+
+ComlinState*
+comlin_new_state_with_allocator(int const in_fd,
+                                int const out_fd,
+                                char const* const term,
+                                size_t const max_history_len,
+                                ComlinAllocator const* const allocator)
+{
+    ComlinState* const l =
+      (ComlinState*)allocator->alloc(allocator->handle, sizeof(ComlinState));
     if (l) {
+        memset(l, 0, sizeof(ComlinState));
+        l->allocator = *allocator;
+        l->completions.allocator = &l->allocator;
+        COMLIN_COUNT(l, n_allocations, 1U);
+        COMLIN_COUNT(l, n_bytes_allocated, sizeof(ComlinState));
         l->ifd = in_fd;
         l->ofd = out_fd;
         l->dumb = is_unsupported_term(term);
@@ -956,16 +5149,160 @@ void
 comlin_free_state(ComlinState* const state)
 {
     // Free history
-    for (size_t j = 0U; j < state->history_len; ++j) {
-        free(state->history[j]);
-    }
-    free(state->history);
+    state_free(state, state->history);
+    state_free(state, state->history_arena);
+    state_free(state, state->history_buckets);
+    order_free(state);
+    search_free_index(state);
+    state_free(state, state->search.query.data);
+    state_free(state, state->search.prompt.data);
+    state_free(state, state->search.results);
+    free_completions(&state->completions);
+    state_free(state, state->fuzzy_matches);
+    state_free(state, (void*)state->fuzzy_words);
+    state_free(state, state->completion_line.data);
+    state_free(state, state->highlights.spans);
+    state_free(state, state->highlights.escapes.data);
+    state_free(state, state->highlights.hint.data);
 
     // Disable raw mode if it was enabled by comlin_new_state
     disable_raw_mode(state);
 
-    free(state->buf.data);
-    free(state);
+    state_free(state, state->buf.data);
+    state_free(state, state->buf.columns);
+    state_free(state, state->shown.data);
+    state_free(state, state->shown.columns);
+    state_free(state, state->undo.text.data);
+    state_free(state, state->undo.edits);
+    state_free(state, state->kills.text.data);
+    state_free(state, state->paste.data);
+    state_free(state, state->drawn.data);
+    state_free(state, state->drawn_columns.data);
+    state_free(state, state->row.data);
+    state_free(state, state->row_columns.data);
+    state_free(state, state->output.data);
+    state_free(state, state->input.data);
+    state_free(state, state);
+}
+
+// Free a string buffer if it's larger than a size
+static void
+buf_trim(ComlinState* const state, StringBuf* const buf, size_t const size)
+{
+    if (buf->size > size) {
+        state_free(state, buf->data);
+        buf->data = NULL;
+        buf->length = buf->size = 0U;
+    }
+}
+
+// Free a column index if it's larger than a size
+static void
+columns_trim(ComlinState* const state,
+             ColumnIndex* const index,
+             size_t const size)
+{
+    if (index->size > size) {
+        state_free(state, index->data);
+        index->data = NULL;
+        index->size = 0U;
+        index->valid = false;
+    }
+}
+
+// Free a line buffer if it's larger than a size, which clears the line
+static void
+line_trim(ComlinState* const state, LineBuf* const line, size_t const size)
+{
+    if (line->size > size) {
+        state_free(state, line->data);
+        state_free(state, line->columns);
+        line->data = NULL;
+        line->columns = NULL;
+        line->length = line->size = line->gap = line->width = 0U;
+        line->generation = ++state->generation;
+        line->valid = false;
+    }
+}
+
+/* Free the buffers used for editing and drawing a line that are too large.
+ *
+ * These are only needed while editing, and grow to fit the longest line, so
+ * this is called before starting a new line to free any that grew unusually
+ * large.  Output that hasn't been written yet is kept.
+ */
+static void
+trim_line_buffers(ComlinState* const state, size_t const size)
+{
+    line_trim(state, &state->buf, size);
+    line_trim(state, &state->shown, size);
+    buf_trim(state, &state->paste, size);
+
+    // The undo log is only for the line being edited, so it's always cleared
+    UndoLog* const undo = &state->undo;
+    undo_reset(undo);
+    buf_trim(state, &undo->text, size);
+    if (undo->size * sizeof(UndoEdit) > size) {
+        state_free(state, undo->edits);
+        undo->edits = NULL;
+        undo->size = 0U;
+    }
+
+    buf_trim(state, &state->drawn, size);
+    buf_trim(state, &state->row, size);
+    columns_trim(state, &state->drawn_columns, size);
+    columns_trim(state, &state->row_columns, size);
+    if (!state->output.length) {
+        buf_trim(state, &state->output, size);
+    }
+}
+
+void
+comlin_trim_state(ComlinState* const state)
+{
+    // Free every line buffer, the kill ring, and the cached completions
+    trim_line_buffers(state, 0U);
+    buf_trim(state, &state->kills.text, 0U);
+    state->kills.count = 0U;
+    state->kills.yanking = false;
+    reset_completions(state);
+    buf_trim(state, &state->completion_line, 0U);
+    state_free(state, state->fuzzy_matches);
+    state_free(state, (void*)state->fuzzy_words);
+    state->fuzzy_matches = NULL;
+    state->fuzzy_words = NULL;
+    state->fuzzy_size = 0U;
+    state->index_matches.cvec = NULL;
+    state->index_matches.len = 0U;
+
+    // Free the highlights, which are made again when the line is next shown
+    ComlinHighlights* const h = &state->highlights;
+    state_free(state, h->spans);
+    h->spans = NULL;
+    h->nspans = h->spans_size = 0U;
+    buf_trim(state, &h->escapes, 0U);
+    buf_trim(state, &h->hint, 0U);
+    h->generation = 0U;
+
+    // Free the history indices, which are rebuilt when they're next needed
+    state_free(state, state->history_buckets);
+    state->history_buckets = NULL;
+    state->history_nbuckets = 0U;
+    order_free(state);
+    search_free_index(state);
+    buf_trim(state, &state->search.query, 0U);
+    buf_trim(state, &state->search.prompt, 0U);
+    state_free(state, state->search.results);
+    state->search.results = NULL;
+    state->search.results_size = 0U;
+    state->search.nresults = state->search.next = state->search.end = 0U;
+    state->search.nlazy = 0U;
+
+    // Free the input buffer if there's no unprocessed input in it
+    if (!state->input.count) {
+        state_free(state, state->input.data);
+        state->input.data = NULL;
+    }
 }
 
 ComlinStatus
@@ -973,12 +5310,41 @@ comlin_set_mode(ComlinState* const state, ComlinModeFlags const flags)
 {
     state->mlmode = flags & (ComlinModeFlags)COMLIN_MODE_MULTI_LINE;
     state->maskmode = flags & (ComlinModeFlags)COMLIN_MODE_MASKED;
+    state->bpmode = flags & (ComlinModeFlags)COMLIN_MODE_BRACKETED_PASTE;
+    state->uniqmode = flags & (ComlinModeFlags)COMLIN_MODE_UNIQUE_HISTORY;
+    state->fuzzymode = flags & (ComlinModeFlags)COMLIN_MODE_FUZZY_COMPLETE;
+    state->streammode = flags & (ComlinModeFlags)COMLIN_MODE_STREAM;
+    state->prefixmode = flags & (ComlinModeFlags)COMLIN_MODE_PREFIX_HISTORY;
+    state->buf.valid = false; // Masked characters have different widths
+    reset_completions(state);
+    if (!state->uniqmode) {
+        // The index is only maintained in unique mode
+        state_free(state, state->history_buckets);
+        state->history_buckets = NULL;
+    }
+
+    if (!state->prefixmode) {
+        order_free(state); // The order is only maintained in prefix mode
+    }
+
     return COMLIN_SUCCESS;
 }
 
 ComlinStatus
 comlin_edit_start(ComlinState* const l, char const* const prompt)
 {
+    // Free any buffers that grew for a long line, they're allocated as needed
+    trim_line_buffers(l, COMLIN_KEEP_SIZE);
+
+    // Read lines from a pipe or file directly if requested
+    l->streaming = l->streammode && !isatty(l->ifd);
+    if (l->streaming) {
+        l->buf.length = l->buf.gap = 0U;
+        l->buf.generation = ++l->generation;
+        l->buf.valid = false; // Columns are only needed for display
+        return COMLIN_SUCCESS;
+    }
+
     // Enter raw mode
     ComlinStatus const st = enable_raw_mode(l);
     if (st) {
@@ -987,185 +5353,489 @@ comlin_edit_start(ComlinState* const l, char const* const prompt)
 
     // Reset line state
     l->pos = 0U;
-    l->oldpos = 0U;
-    l->buf.length = 0U;
-    l->oldrows = 0U;
+    l->history_index = 0U;
+    l->kills.yanking = false; // Yanks in the last line can't be replaced
+    l->partial_len = 0U;
+    l->escape.state = ESCAPE_NONE;
+    l->pasting = false;
+    l->search.active = false;
+    reset_completions(l);
     if (!l->cols) {
-        l->cols = (size_t)get_columns(l);
-        if (l->buf.size < l->cols) {
-            free(l->buf.data);
-            l->buf.data = (char*)calloc(1, l->cols);
-            l->buf.size = l->cols;
-        }
+        l->cols = get_columns(l);
+    }
+
+    if (!line_set(l, &l->buf, "", 0U, false)) {
+        return COMLIN_NO_MEMORY;
     }
 
     // Set edit state
     l->prompt = prompt;
     l->plen = strlen(prompt);
-    l->buf.data[0] = '\0';
-    comlin_history_add(l, ""); // Latest history entry is the current line
+    // Latest history entry is the current line, which is sorted once committed
+    order_commit(l);
+    l->history_order.pending = l->history_next_seq + 1U;
+    if (history_append(l, "", 0U) ||
+        l->history_next_seq + 1U == l->history_order.pending) {
+        l->history_order.pending = 0U; // The line wasn't added
+    }
+
+    // Enable bracketed paste if requested
+    if (l->bpmode && !l->dumb) {
+        buf_append(l, &l->output, VTESC "?2004h", 8U);
+    }
 
     // Write prompt
-    return write_string(l->ofd, l->prompt, l->plen);
+    l->drawn.length = 0U;
+    buf_append(l, &l->drawn, l->prompt, l->plen);
+    if (!columns_build(l, &l->drawn_columns, l->prompt, l->plen)) {
+        return COMLIN_NO_MEMORY;
+    }
+
+    l->drawn_row = 0U;
+    l->drawn_col = l->drawn_columns.data[l->plen];
+    l->oldrows = 1U;
+    buf_append(l, &l->output, l->prompt, l->plen);
+    return flush_output(l);
+}
+
+static ComlinStatus
+comlin_edit_read_dumb(ComlinState* const l, char const c)
+{
+    switch (c) {
+    case CTRL_C:
+        return COMLIN_INTERRUPTED;
+    case CTRL_D:
+        return COMLIN_END;
+    case LFEED:
+    case CRETURN:
+        return COMLIN_SUCCESS;
+    default:
+        break;
+    }
+
+    buf_append(l, &l->output, &c, 1U);
+    return line_insert(l, &l->buf, l->buf.length, &c, 1U, false)
+             ? COMLIN_EDITING
+             : COMLIN_NO_MEMORY;
+}
+
+static ComlinStatus
+comlin_edit_escape(ComlinState* l);
+
+static ComlinStatus
+comlin_edit_escape_key(ComlinState* l, char c);
+
+static ComlinStatus
+comlin_edit_paste_key(ComlinState* l, char c);
+
+static ComlinStatus
+comlin_edit_control(ComlinState* const state, char const c)
+{
+    typedef ComlinStatus (*ControlHandler)(ComlinState*);
+
+    static ControlHandler const control_handlers[0x20U] = {
+      NULL,                             // ^@
+      comlin_edit_move_home,            // ^A
+      comlin_edit_move_left,            // ^B
+      comlin_edit_interrupt,            // ^C
+      comlin_edit_eof,                  // ^D
+      comlin_edit_move_end,             // ^E
+      comlin_edit_move_right,           // ^F
+      NULL,                             // ^G
+      comlin_edit_backspace,            // ^H
+      NULL,                             // ^I
+      comlin_edit_submit,               // ^J
+      comlin_edit_clear_line_forwards,  // ^K
+      comlin_edit_clear_screen,         // ^L
+      comlin_edit_submit,               // ^M
+      comlin_edit_history_next,         // ^N
+      NULL,                             // ^O
+      comlin_edit_history_prev,         // ^P
+      NULL,                             // ^Q
+      comlin_edit_search,               // ^R
+      NULL,                             // ^S
+      comlin_edit_transpose,            // ^T
+      comlin_edit_clear_line_backwards, // ^U
+      NULL,                             // ^V
+      comlin_edit_delete_prev_word,     // ^W
+      NULL,                             // ^X
+      comlin_edit_yank,                 // ^Y
+      NULL,                             // ^Z
+      comlin_edit_escape,               // ^[
+      NULL,                             // ^Backslash
+      NULL,                             // ^]
+      comlin_edit_redo,                 // ^^
+      comlin_edit_undo,                 // ^_
+    };
+
+    ControlHandler const handler = control_handlers[(uint8_t)c];
+    return handler ? handler(state) : COMLIN_EDITING;
+}
+
+// Process a single input character
+static ComlinStatus
+comlin_edit_key(ComlinState* const l, char c)
+{
+    if (l->dumb) {
+        return comlin_edit_read_dumb(l, c); // Fallback for dumb terminals
+    }
+
+    if (l->pasting) {
+        return comlin_edit_paste_key(l, c);
+    }
+
+    if (l->escape.state) {
+        return comlin_edit_escape_key(l, c);
+    }
+
+    if (l->partial_len && !is_continuation(c)) {
+        // Insert an incomplete character as is before handling the next key
+        size_t const len = l->partial_len;
+        l->partial_len = 0U;
+        ComlinStatus const st =
+          comlin_edit_insert_text(l, l->partial, len, UNDO_TYPING);
+        if (st != COMLIN_EDITING) {
+            return st;
+        }
+    }
+
+    if (l->search.active) {
+        ComlinStatus const st = comlin_edit_search_key(l, &c);
+        if (st || !c) {
+            return st;
+        }
+    }
+
+    if (c == TAB && !l->in_completion && l->async_completion &&
+        !l->completion_index && !have_completions(l)) {
+        return request_completions(l); // Show completions when they arrive
+    }
+
+    if ((l->in_completion || c == TAB) &&
+        (l->completion_callback || l->async_completion ||
+         l->completion_index)) {
+        // Try to autocomplete
+        c = complete_line(l, c);
+        if (c == 0) {
+            return COMLIN_EDITING;
+        }
+    }
+
+    return ((uint8_t)c < 0x20U) ? comlin_edit_control(l, c)
+           : (c == DEL)         ? comlin_edit_backspace(l)
+                                : comlin_edit_insert(l, c);
+}
+
+// Finish a batch of input by refreshing and writing once to show the result
+static ComlinStatus
+end_batch(ComlinState* const l, ComlinStatus const st)
+{
+    l->defer_refresh = false;
+    ComlinStatus rst = COMLIN_SUCCESS;
+    if (l->refresh_pending) {
+        rst = refresh_line_with_flags(l, REFRESH_ALL);
+    }
+
+    ComlinStatus const fst = flush_output(l);
+    rst = rst ? rst : fst;
+    return (rst && st == COMLIN_EDITING) ? rst : st;
+}
+
+// Finish reading a line from a stream, without any trailing carriage return
+static ComlinStatus
+end_stream_line(ComlinState* const l)
+{
+    LineBuf* const line = &l->buf;
+    if (line->length && line_byte(line, line->length - 1U) == '\r') {
+        line_erase(l, line, line->length - 1U, line->length);
+    }
+
+    line_text(l, line);
+    return COMLIN_SUCCESS;
+}
+
+// Append stream text up to a newline to the line, and return its length
+static size_t
+feed_stream(ComlinState* const l,
+            char const* const text,
+            size_t const len,
+            bool* const finished)
+{
+    char const* const newline = (char const*)memchr(text, '\n', len);
+    size_t const n = newline ? (size_t)(newline - text) : len;
+    if (!line_insert(l, &l->buf, l->buf.length, text, n, false)) {
+        return SIZE_MAX;
+    }
+
+    *finished = newline;
+    return newline ? n + 1U : n;
+}
+
+// Read a line from a stream of input that isn't a terminal
+static ComlinStatus
+comlin_edit_feed_stream(ComlinState* const l)
+{
+    InputBuf* const in = &l->input;
+    bool finished = false;
+    while (!finished) {
+        if (!in->count) {
+            ComlinStatus const st = fill_input(l);
+            if (st) {
+                return (st == COMLIN_END && l->buf.length) ? end_stream_line(l)
+                                                           : st;
+            }
+        }
+
+        // Process the contiguous input up to the end of the ring or a newline
+        size_t const end = in->head + in->count;
+        size_t const run =
+          (end < COMLIN_INPUT_SIZE ? end : COMLIN_INPUT_SIZE) - in->head;
+        size_t const n = feed_stream(l, in->data + in->head, run, &finished);
+        if (n == SIZE_MAX) {
+            return COMLIN_NO_MEMORY;
+        }
+
+        in->head = (in->head + n) & (COMLIN_INPUT_SIZE - 1U);
+        in->count -= n;
+    }
+
+    return end_stream_line(l);
+}
+
+ComlinStatus
+comlin_edit_feed(ComlinState* const l)
+{
+    if (l->streaming) {
+        return comlin_edit_feed_stream(l);
+    }
+
+    // Process all buffered input, reading more only if there is none
+    ComlinStatus st = COMLIN_EDITING;
+    l->defer_refresh = true;
+    do {
+        char c = '\0';
+        st = read_char(l, &c);
+        if (!st) {
+            st = comlin_edit_key(l, c);
+        }
+    } while (st == COMLIN_EDITING && l->input.count);
+
+    return end_batch(l, st);
+}
+
+ComlinStatus
+comlin_edit_feed_bytes(ComlinState* const l,
+                       char const* const data,
+                       size_t const len,
+                       size_t* const n_used)
+{
+    if (l->streaming && !len) {
+        *n_used = 0U;
+        return l->buf.length ? end_stream_line(l) : COMLIN_END;
+    }
+
+    if (l->streaming) {
+        bool finished = false;
+        size_t const n = feed_stream(l, data, len, &finished);
+        *n_used = (n == SIZE_MAX) ? 0U : n;
+        return (n == SIZE_MAX) ? COMLIN_NO_MEMORY
+               : finished      ? end_stream_line(l)
+                               : COMLIN_EDITING;
+    }
+
+    // Process bytes until the end of the data or the line
+    ComlinStatus st = COMLIN_EDITING;
+    size_t i = 0U;
+    l->defer_refresh = true;
+    while (st == COMLIN_EDITING && i < len) {
+        st = comlin_edit_key(l, data[i++]);
+    }
+
+    *n_used = i;
+    return end_batch(l, st);
+}
+
+// Start reading pasted text up to the closing `ESC [ 201 ~`
+static ComlinStatus
+comlin_edit_paste(ComlinState* const l)
+{
+    l->paste.length = 0U;
+    l->paste_matched = 0U;
+    l->pasting = true;
+    return COMLIN_EDITING;
 }
 
+// Process a byte of pasted text, and insert it all at once at the end
 static ComlinStatus
-comlin_edit_read_dumb(ComlinState* const l, char const c)
+comlin_edit_paste_key(ComlinState* const l, char const c)
 {
-    switch (c) {
-    case CTRL_C:
-        return COMLIN_INTERRUPTED;
-    case CTRL_D:
-        return COMLIN_END;
-    case LFEED:
-    case CRETURN:
-        return COMLIN_SUCCESS;
-    default:
-        break;
+    static char const end[] = VTESC "201~";
+    static size_t const end_len = sizeof(end) - 1U;
+
+    size_t const matched = l->paste_matched;
+    if (c == end[matched]) {
+        l->paste_matched = matched + 1U;
+        if (l->paste_matched < end_len) {
+            return COMLIN_EDITING;
+        }
+
+        l->pasting = false;
+        return l->paste.length ? comlin_edit_insert_text(
+                                   l, l->paste.data, l->paste.length, UNDO_NEW)
+                               : COMLIN_EDITING;
+    }
+
+    // Not the end after all, so the partial match is pasted text
+    buf_append(l, &l->paste, " ", matched ? 1U : 0U);
+    buf_append(l, &l->paste, end + 1U, matched ? matched - 1U : 0U);
+    l->paste_matched = c == ESC ? 1U : 0U;
+    if (!l->paste_matched) {
+        // Insert control characters as spaces rather than running them
+        char const t = (char)(((uint8_t)c < 0x20U || c == DEL) ? ' ' : c);
+        buf_append(l, &l->paste, &t, 1U);
     }
 
-    write(l->ofd, &c, 1U);
-    buf_append(&l->buf, &c, 1U);
     return COMLIN_EDITING;
 }
 
-static ComlinStatus
-comlin_edit_read_escape(ComlinState* l);
+/* Escape sequences are parsed a byte at a time, so they can be split across
+ * reads, and the complete sequence is looked up in a table of bindings.  The
+ * parser follows the ECMA-48 syntax of a control sequence, so a sequence with
+ * parameters or a final byte that isn't bound, like a modified key, is
+ * consumed entirely rather than inserted into the line. */
 
-static ComlinStatus
-comlin_edit_control(ComlinState* const state, char const c)
-{
-    typedef ComlinStatus (*ControlHandler)(ComlinState*);
+// A handler for an escape sequence with a final byte and first parameter
+typedef struct {
+    char final;                            ///< Final byte
+    unsigned param;                        ///< First parameter, or zero for any
+    ComlinStatus (*handler)(ComlinState*); ///< Function to handle sequence
+} EscapeBinding;
+
+static EscapeBinding const csi_bindings[] = {
+  {'A', 0U, comlin_edit_history_prev}, // Up
+  {'B', 0U, comlin_edit_history_next}, // Down
+  {'C', 0U, comlin_edit_move_right},   // Right
+  {'D', 0U, comlin_edit_move_left},    // Left
+  {'F', 0U, comlin_edit_move_end},     // End
+  {'H', 0U, comlin_edit_move_home},    // Home
+  {'~', 1U, comlin_edit_move_home},    // Home (VT220)
+  {'~', 3U, comlin_edit_delete},       // Delete
+  {'~', 4U, comlin_edit_move_end},     // End (VT220)
+  {'~', 7U, comlin_edit_move_home},    // Home (rxvt)
+  {'~', 8U, comlin_edit_move_end},     // End (rxvt)
+  {'~', 200U, comlin_edit_paste},      // Start of bracketed paste
+};
 
-    static ControlHandler const control_handlers[0x20U] = {
-      NULL,                             // ^@
-      comlin_edit_move_home,            // ^A
-      comlin_edit_move_left,            // ^B
-      comlin_edit_interrupt,            // ^C
-      comlin_edit_eof,                  // ^D
-      comlin_edit_move_end,             // ^E
-      comlin_edit_move_right,           // ^F
-      NULL,                             // ^G
-      comlin_edit_backspace,            // ^H
-      NULL,                             // ^I
-      comlin_edit_submit,               // ^J
-      comlin_edit_clear_line_forwards,  // ^K
-      comlin_edit_clear_screen,         // ^L
-      comlin_edit_submit,               // ^M
-      comlin_edit_history_next,         // ^N
-      NULL,                             // ^O
-      comlin_edit_history_prev,         // ^P
-      NULL,                             // ^Q
-      NULL,                             // ^R
-      NULL,                             // ^S
-      comlin_edit_transpose,            // ^T
-      comlin_edit_clear_line_backwards, // ^U
-      NULL,                             // ^V
-      comlin_edit_delete_prev_word,     // ^W
-      NULL,                             // ^X
-      NULL,                             // ^Y
-      NULL,                             // ^Z
-      comlin_edit_read_escape,          // ^[
-      NULL,                             // ^Backslash
-      NULL,                             // ^]
-      NULL,                             // ^^
-      NULL,                             // ^_
-    };
+static EscapeBinding const ss3_bindings[] = {
+  {'A', 0U, comlin_edit_history_prev}, // Up
+  {'B', 0U, comlin_edit_history_next}, // Down
+  {'C', 0U, comlin_edit_move_right},   // Right
+  {'D', 0U, comlin_edit_move_left},    // Left
+  {'F', 0U, comlin_edit_move_end},     // End
+  {'H', 0U, comlin_edit_move_home},    // Home
+};
 
-    ControlHandler const handler = control_handlers[(unsigned)c];
-    return handler ? handler(state) : COMLIN_EDITING;
+// Start reading an escape sequence, which is handled when it's complete
+static ComlinStatus
+comlin_edit_escape(ComlinState* const l)
+{
+    EscapeReader const reader = {ESCAPE_START, {0U, 0U}, 0U, false};
+    l->escape = reader;
+    return COMLIN_EDITING;
 }
 
-ComlinStatus
-comlin_edit_feed(ComlinState* const l)
+// Call the handler bound to a complete escape sequence, if any
+static ComlinStatus
+comlin_edit_escape_dispatch(ComlinState* const l,
+                            EscapeBinding const* const bindings,
+                            size_t const n_bindings,
+                            char const final)
 {
-    // Read the next character
-    char c = '\0';
-    ComlinStatus const st = read_char(l->ifd, &c);
-    if (st) {
-        return st;
-    }
-
-    if (l->dumb) {
-        return comlin_edit_read_dumb(l, c); // Fallback for dumb terminals
-    }
-
-    if ((l->in_completion || c == TAB) && l->completion_callback) {
-        // Try to autocomplete
-        c = complete_line(l, c);
-        if (c < 0) {
-            return COMLIN_BAD_READ;
-        }
-        if (c == 0) {
-            return COMLIN_EDITING;
+    EscapeReader* const esc = &l->escape;
+    esc->state = ESCAPE_NONE;
+    if (!esc->ignored) {
+        for (size_t i = 0U; i < n_bindings; ++i) {
+            EscapeBinding const* const b = &bindings[i];
+            bool const match = !b->param || b->param == esc->params[0];
+            if (b->final == final && match) {
+                return b->handler(l);
+            }
         }
     }
 
-    return (c < 0x20)   ? comlin_edit_control(l, c)
-           : (c == DEL) ? comlin_edit_backspace(l)
-                        : comlin_edit_insert(l, c);
+    return COMLIN_EDITING;
 }
 
+// Process a byte of an escape sequence
 static ComlinStatus
-comlin_edit_read_escape(ComlinState* const l)
+comlin_edit_escape_key(ComlinState* const l, char const c)
 {
-    // Read the next two bytes representing the escape sequence
-    char seq[4] = {'\0', '\0', '\0', '\0'};
-    if (read_char(l->ifd, &seq[0]) || read_char(l->ifd, &seq[1])) {
-        return COMLIN_BAD_READ;
+    EscapeReader* const esc = &l->escape;
+    uint8_t const b = (uint8_t)c;
+    if (b < 0x20U || b >= 0x7FU) {
+        // Control character, so abandon the sequence and handle it as usual
+        esc->state = ESCAPE_NONE;
+        return comlin_edit_key(l, c);
     }
 
-    if (seq[0] == '[') { // ESC [ sequences
-        if (seq[1] >= '0' && seq[1] <= '9') {
-            // Extended escape, read additional byte
-            return read_char(l->ifd, &seq[2])         ? COMLIN_BAD_READ
-                   : (seq[1] == '3' && seq[2] == '~') ? comlin_edit_delete(l)
-                                                      : COMLIN_SUCCESS;
-        }
+    if (esc->state == ESCAPE_START) {
+        esc->state = (c == '[') ? ESCAPE_CSI
+                     : (c == 'O') ? ESCAPE_SS3
+                                  : ESCAPE_NONE; // Meta key
+        return (c == 'y') ? comlin_edit_yank_pop(l) : COMLIN_EDITING;
+    }
 
-        switch (seq[1]) {
-        case 'A': // Up
-            return comlin_edit_history_prev(l);
-        case 'B': // Down
-            return comlin_edit_history_next(l);
-        case 'C': // Right
-            return comlin_edit_move_right(l);
-        case 'D': // Left
-            return comlin_edit_move_left(l);
-        case 'H': // Home
-            return comlin_edit_move_home(l);
-        case 'F': // End
-            return comlin_edit_move_end(l);
-        default:
-            break;
-        }
+    if (esc->state == ESCAPE_SS3) {
+        return comlin_edit_escape_dispatch(
+          l, ss3_bindings, sizeof(ss3_bindings) / sizeof(EscapeBinding), c);
+    }
 
-    } else if (seq[0] == 'O') { // ESC O sequence
-        switch (seq[1]) {
-        case 'H': // Home
-            return comlin_edit_move_home(l);
-        case 'F': // End
-            return comlin_edit_move_end(l);
-        default:
-            break;
+    if (c >= '0' && c <= '9') { // Parameter digit
+        if (esc->n_params < COMLIN_MAX_PARAMS) {
+            unsigned* const param = &esc->params[esc->n_params];
+            *param = (*param < 0x10000U)
+                       ? (*param * 10U) + (unsigned)(c - '0')
+                       : *param;
         }
+    } else if (c == ';') { // Parameter separator
+        ++esc->n_params;
+    } else if (b < 0x40U) { // Private parameter or intermediate byte
+        esc->ignored = true;
+    } else { // Final byte
+        return comlin_edit_escape_dispatch(
+          l, csi_bindings, sizeof(csi_bindings) / sizeof(EscapeBinding), c);
     }
 
-    return COMLIN_SUCCESS;
+    return COMLIN_EDITING;
 }
 
 ComlinStatus
 comlin_edit_stop(ComlinState* const l)
 {
+    l->completion_pending = false; // Drop any completions that arrive later
+    l->drawn.length = 0U;          // The line is no longer managed on screen
+    if (l->streaming) {
+        return COMLIN_SUCCESS; // Nothing was shown or configured
+    }
+
     ComlinStatus const st = disable_raw_mode(l);
+    if (st) {
+        return st;
+    }
 
-    return st ? st : write_string(l->ofd, "\n", 1);
+    // Disable bracketed paste if it was enabled by comlin_edit_start
+    if (l->bpmode && !l->dumb) {
+        buf_append(l, &l->output, VTESC "?2004l", 8U);
+    }
+
+    buf_append(l, &l->output, "\n", 1U);
+    return flush_output(l);
 }
 
 char const*
-comlin_text(ComlinState const* const l)
+comlin_text(ComlinState* const l)
 {
-    return l->buf.data;
+    return line_text(l, &l->buf);
 }
 
 ComlinStatus
@@ -1185,105 +5855,505 @@ comlin_read_line(ComlinState* const state, char const* const prompt)
 
 /* History */
 
-/* Uses a fixed array of char pointers that are shifted (memmoved)
- * when the history max length is reached in order to remove the older
- * entry and make room for the new one, so it is not exactly suitable for huge
- * histories, but will work well for a few hundred of entries.
+/* Uses a circular buffer of entries that grows up to the history max length,
+ * so when that's reached, the oldest entry is replaced by the new one in
+ * constant time, regardless of the size of the history.  The text of all
+ * entries is stored in a single arena, which is compacted when it fills up,
+ * rather than allocated separately for each entry.
  *
- * Using a circular buffer is smarter, but a bit more complex to handle. */
-ComlinStatus
-comlin_history_add(ComlinState* const state, char const* const line)
+ * In unique mode, entries are also indexed by a hash table, so an older copy
+ * of the line can be found and erased in constant expected time.  Erased
+ * entries are left as nulls, which are skipped when stepping through the
+ * history, and removed in bulk when the history is full and enough of them
+ * have accumulated. */
+static ComlinStatus
+history_append(ComlinState* const state,
+               char const* const line,
+               size_t const len)
 {
     if (state->history_max_len == 0) {
         return COMLIN_SUCCESS;
     }
 
-    // Initialization on first call
-    if (!state->history) {
-        state->history = (char**)malloc(sizeof(char*) * state->history_max_len);
-        if (!state->history) {
-            return COMLIN_NO_MEMORY;
-        }
-        memset(state->history, 0, (sizeof(char*) * state->history_max_len));
+    // Build the hash index on the first call in unique mode
+    if (state->uniqmode && !state->history_buckets &&
+        history_build_index(state)) {
+        return COMLIN_NO_MEMORY;
     }
 
     // Don't add duplicated lines
     if (state->history_len &&
-        !strcmp(state->history[state->history_len - 1U], line)) {
+        entry_equals(
+          state, history_entry(state, state->history_len - 1U), line, len)) {
         return COMLIN_SUCCESS;
     }
 
-    // Add an heap allocated copy of the line in the history
-    char* const linecopy = comlin_copy_string(line);
-    if (!linecopy) {
+    // In unique mode, erase any older copy of the line
+    if (state->history_buckets) {
+        HistoryBucket const* const bucket = history_find(state, line, len);
+        if (bucket->slot) {
+            history_erase(state, bucket->slot - 1U);
+        }
+    }
+
+    // Reserve space for the line first so failure leaves the history unchanged
+    if (history_reserve(state, len)) {
+        return COMLIN_NO_MEMORY;
+    }
+
+    // Grow the ring if it's full but not yet the maximum length
+    if (state->history_len == state->history_size &&
+        state->history_size < state->history_max_len && history_grow(state)) {
+        return COMLIN_NO_MEMORY;
+    }
+
+    // If we reached the max length, compact erased entries if there are many
+    size_t const max_len = state->history_max_len;
+    if (state->history_len == max_len && state->history_erased &&
+        state->history_erased >= max_len / 4U && history_compact(state)) {
         return COMLIN_NO_MEMORY;
     }
 
-    // If we reached the max length, remove the older line
-    if (state->history_len == state->history_max_len) {
-        free(state->history[0]);
-        memmove(state->history,
-                state->history + 1,
-                sizeof(char*) * (state->history_max_len - 1U));
+    // If we still reached the max length, remove the oldest line
+    while (state->history_len == max_len) {
+        size_t const oldest = state->history_start;
+        if (state->history[oldest].offset != HISTORY_ERASED) {
+            history_unindex_slot(state, oldest);
+            order_remove(state, &state->history[oldest]);
+            history_release(state, &state->history[oldest]);
+            COMLIN_COUNT(state, n_history_evictions, 1U);
+        } else {
+            --state->history_erased;
+        }
+
+        state->history_start = oldest + 1U < max_len ? oldest + 1U : 0U;
         --state->history_len;
     }
 
-    state->history[state->history_len] = linecopy;
-    ++state->history_len;
+    size_t const slot = history_slot(state, state->history_len++);
+    history_store(state, &state->history[slot], line, len);
+    state->history[slot].seq = state->history_next_seq++;
+    history_index_slot(state, slot);
+    order_insert(state, &state->history[slot]);
+    if (state->search.nbuckets &&
+        search_index_entry(state, &state->history[slot])) {
+        state->search.stale = true;
+    }
     return COMLIN_SUCCESS;
 }
 
 ComlinStatus
-comlin_history_save(ComlinState const* const state, char const* const filename)
+comlin_history_add(ComlinState* const state, char const* const line)
 {
-    ComlinStatus st = COMLIN_SUCCESS;
-    mode_t const mode = S_IRUSR | S_IWUSR;
-    int const flags = O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC;
-    int const fd = open(filename, flags, mode);
+    size_t const seq = state->history_next_seq;
+    order_commit(state);
+    ComlinStatus const st = history_append(state, line, strlen(line));
+    COMLIN_COUNT(state, n_history_adds, state->history_next_seq - seq);
+    return st;
+}
+
+/* Return the text of history entries from the given index to the end.
+ *
+ * The index counts from the oldest shared entry, if there are any, so all of
+ * the entries that a state shows are included from zero.  The text is
+ * allocated all at once so it can be written in one call, and contains each
+ * entry on a line, skipping any that are erased or empty.
+ */
+static char*
+history_format(ComlinState* const state,
+               size_t const first,
+               size_t* const size,
+               size_t* const lines)
+{
+    size_t const nentries = history_nshared(state) + state->history_len;
+    size_t len = 0U;
+
+    *size = 0U;
+    *lines = 0U;
+    for (size_t i = first; i < nentries; ++i) {
+        if (history_view_text(state, i, &len) && len) {
+            *size += len + 1U;
+            ++*lines;
+        }
+    }
+
+    char* const text = (char*)state_malloc(state, *size ? *size : 1U);
+    if (text) {
+        size_t offset = 0U;
+        for (size_t i = first; i < nentries; ++i) {
+            char const* const line = history_view_text(state, i, &len);
+            if (line && len) {
+                memcpy(text + offset, line, len);
+                offset += len;
+                text[offset++] = '\n';
+            }
+        }
+    }
+
+    return text;
+}
+
+ComlinStatus
+comlin_history_save(ComlinState* const state, char const* const filename)
+{
+    // Write to a temporary file in the same directory to rename over the file
+    size_t const filename_len = strlen(filename);
+    char* const path = (char*)state_malloc(state, filename_len + 8U);
+    if (!path) {
+        return COMLIN_NO_MEMORY;
+    }
+
+    memcpy(path, filename, filename_len);
+    memcpy(path + filename_len, ".XXXXXX", 8U);
+    int const fd = mkstemp(path);
     if (fd < 0) {
+        state_free(state, path);
         return COMLIN_NO_FILE;
     }
 
-    for (size_t j = 0U; !st && j < state->history_len; ++j) {
-        size_t const len = strlen(state->history[j]);
+    // Keep the permissions of any existing file
+    struct stat info;
+    if (!stat(filename, &info)) {
+        fchmod(fd, info.st_mode & (S_IRWXU | S_IRWXG | S_IRWXO));
+    }
+
+    size_t size = 0U;
+    size_t lines = 0U;
+    char* const text = history_format(state, 0U, &size, &lines);
+    ComlinStatus st =
+      text ? write_string(state, fd, text, size) : COMLIN_NO_MEMORY;
+    state_free(state, text);
+
+    if (!st && fsync(fd)) {
+        st = COMLIN_BAD_WRITE;
+    }
+
+    if (close(fd) < 0 && !st) {
+        st = COMLIN_BAD_WRITE;
+    }
+
+    if (!st && rename(path, filename)) {
+        st = COMLIN_BAD_WRITE;
+    }
+
+    if (st) {
+        unlink(path);
+    } else {
+        state->history_saved_seq = state->history_next_seq;
+        state->history_file_lines = lines;
+    }
+
+    state_free(state, path);
+    return st;
+}
+
+ComlinStatus
+comlin_history_append(ComlinState* const state, char const* const filename)
+{
+    // Rewrite the file instead if appending would make it too long
+    size_t first = state->history_len;
+    while (first &&
+           history_entry(state, first - 1U)->seq >= state->history_saved_seq) {
+        --first;
+    }
+
+    size_t const max_lines = 2U * state->history_max_len;
+    if (state->history_file_lines + (state->history_len - first) > max_lines) {
+        return comlin_history_save(state, filename);
+    }
+
+    size_t size = 0U;
+    size_t lines = 0U;
+    char* const text =
+      history_format(state, history_nshared(state) + first, &size, &lines);
+    if (!text) {
+        return COMLIN_NO_MEMORY;
+    }
+
+    ComlinStatus st = COMLIN_SUCCESS;
+    if (size) {
+        int const flags = O_APPEND | O_CREAT | O_WRONLY | O_CLOEXEC;
+        int const fd = open(filename, flags, S_IRUSR | S_IWUSR);
+        if (fd < 0) {
+            state_free(state, text);
+            return COMLIN_NO_FILE;
+        }
+
+        st = write_string(state, fd, text, size);
+        if (close(fd) < 0 && !st) {
+            st = COMLIN_BAD_WRITE;
+        }
+    }
+
+    state_free(state, text);
+    if (!st) {
+        state->history_saved_seq = state->history_next_seq;
+        state->history_file_lines += lines;
+    }
+
+    return st;
+}
+
+/* Return the offset of the first line in history file text to load.
+ *
+ * This scans backwards from the end, so only the newest lines that will fit in
+ * the history need to be parsed.  Like when loading, runs of identical lines
+ * only count as one entry.
+ */
+static size_t
+history_tail_start(char const* const text,
+                   size_t const size,
+                   size_t const max_len)
+{
+    // Skip any trailing unterminated line, which isn't loaded
+    size_t end = size;
+    while (end && text[end - 1U] != '\n') {
+        --end;
+    }
+
+    size_t count = 0U;
+    char const* newer = NULL;
+    size_t newer_len = 0U;
+    while (end) {
+        size_t start = end - 1U;
+        while (start && text[start - 1U] != '\n') {
+            --start;
+        }
+
+        size_t const len = end - 1U - start;
+        if (len && (len != newer_len || memcmp(text + start, newer, len))) {
+            if (++count == max_len) {
+                return start;
+            }
+
+            newer = text + start;
+            newer_len = len;
+        }
+
+        end = start;
+    }
+
+    return 0U;
+}
+
+/* Load the complete lines in history file text.
+ *
+ * Returns the offset just past the last complete line in `*end`.  Lines are
+ * counted in the history file lines, and any skipped lines make the file long
+ * enough to be rewritten by the next append.
+ */
+static ComlinStatus
+history_load_text(ComlinState* const state,
+                  StringBuf* const scratch,
+                  char const* const text,
+                  size_t const size,
+                  size_t* const end)
+{
+    // In unique mode, any line may erase an older one, so all must be parsed
+    size_t offset =
+      state->uniqmode ? 0U
+                      : history_tail_start(text, size, state->history_max_len);
+    if (offset) {
+        state->history_file_lines += 2U * state->history_max_len;
+    }
+
+    ComlinStatus st = COMLIN_SUCCESS;
+    char const* newline = NULL;
+    while (!st && (newline = (char const*)memchr(
+                     text + offset, '\n', size - offset))) {
+        char const* line = text + offset;
+        size_t len = (size_t)(newline - line);
+        offset += len + 1U;
+        ++state->history_file_lines;
+
+        // Skip any control characters (rare, so check before copying)
+        size_t i = 0U;
+        while (i < len && (uint8_t)line[i] >= 0x20U && line[i] != DEL) {
+            ++i;
+        }
+
+        if (i < len) {
+            scratch->length = 0U;
+            buf_append(state, scratch, line, i);
+            for (; i < len; ++i) {
+                if ((uint8_t)line[i] >= 0x20U && line[i] != DEL) {
+                    buf_append(state, scratch, line + i, 1U);
+                }
+            }
+
+            line = scratch->data;
+            len = scratch->length;
+        }
+
         if (len) {
-            st = write_string(fd, state->history[j], len);
-            if (!st) {
-                st = write_string(fd, "\n", 1U);
+            size_t const seq = state->history_next_seq;
+            st = history_append(state, line, len);
+            COMLIN_COUNT(state, n_history_adds, state->history_next_seq - seq);
+        }
+    }
+
+    *end = offset;
+    return st;
+}
+
+// Load history text from a file that can't be mapped, block by block
+static ComlinStatus
+history_load_stream(ComlinState* const state, int const fd)
+{
+    static size_t const block_size = 65536U;
+
+    ComlinStatus st = COMLIN_SUCCESS;
+    StringBuf scratch = {NULL, 0U, 0U};
+    size_t size = block_size;
+    size_t length = 0U;
+    char* text = (char*)state_malloc(state, size);
+    while (!st && text) {
+        ssize_t const r = read(fd, text + length, size - length);
+        COMLIN_COUNT(state, n_reads, 1U);
+        COMLIN_COUNT(state, n_bytes_read, r > 0 ? (size_t)r : 0U);
+        if (r <= 0) {
+            st = r < 0 ? COMLIN_BAD_READ : COMLIN_SUCCESS;
+            break;
+        }
+
+        // Load complete lines, and move the remaining text to the start
+        size_t end = 0U;
+        length += (size_t)r;
+        st = history_load_text(state, &scratch, text, length, &end);
+        memmove(text, text + end, length - end);
+        length -= end;
+
+        // Grow the buffer if a line is longer than it
+        if (length == size) {
+            char* const new_text = (char*)state_realloc(state, text, size * 2U);
+            if (!new_text) {
+                st = COMLIN_NO_MEMORY;
+                break;
             }
+
+            text = new_text;
+            size *= 2U;
         }
     }
 
-    return close(fd) < 0 ? COMLIN_BAD_WRITE : st;
+    st = text ? st : COMLIN_NO_MEMORY;
+    state_free(state, text);
+    buf_free(state, &scratch);
+    return st;
 }
 
 ComlinStatus
 comlin_history_load(ComlinState* const state, char const* const filename)
 {
-    ComlinStatus st = COMLIN_SUCCESS;
-    StringBuf buf = {NULL, 0U, 0U};
     int const fd = open(filename, O_CLOEXEC | O_RDONLY);
     if (fd < 0) {
         return COMLIN_NO_FILE;
     }
 
-    while (!st) {
-        char c = '\0';
-        st = read_char(fd, &c);
-
-        if (st == COMLIN_SUCCESS) {
-            if (c == '\n' && buf.length) {
-                comlin_history_add(state, buf.data);
-                buf.length = 0U;
-            } else if (c >= 0x20 && c != DEL) {
-                buf_append(&buf, &c, 1U);
-            }
-        } else if (st == COMLIN_END) {
-            st = COMLIN_SUCCESS;
-            break;
-        }
+    // Map regular files to load them directly, otherwise read in blocks
+    ComlinStatus st = COMLIN_SUCCESS;
+    state->history_file_lines = 0U;
+    state->history_order.pending = 0U; // The rebuilt order has every line
+    state->history_order.built = false; // Rebuild after instead of updating
+    state->history_order.matches_valid = false;
+    struct stat info;
+    void* map = MAP_FAILED;
+    size_t size = 0U;
+    if (!fstat(fd, &info) && S_ISREG(info.st_mode) && info.st_size > 0) {
+        size = (size_t)info.st_size;
+        map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+
+    if (map != MAP_FAILED) {
+        StringBuf scratch = {NULL, 0U, 0U};
+        size_t end = 0U;
+        st = history_load_text(state, &scratch, (char const*)map, size, &end);
+        buf_free(state, &scratch);
+        munmap(map, size);
+    } else {
+        st = history_load_stream(state, fd);
+    }
+
+    // Loaded entries are already in the file, so don't append them again
+    if (!st) {
+        state->history_saved_seq = state->history_next_seq;
     }
 
-    buf_free(&buf);
     return close(fd) < 0 ? COMLIN_BAD_READ : st;
 }
+
+ComlinHistory*
+comlin_new_shared_history(ComlinState const* const state)
+{
+    // Append every entry to a private state, then take its history and index
+    size_t const nentries = history_nshared(state) + state->history_len;
+    ComlinState* const copy = comlin_new_state(-1, -1, "dumb", nentries);
+    if (!copy) {
+        return NULL;
+    }
+
+    ComlinStatus st = COMLIN_SUCCESS;
+    for (size_t i = 0U; !st && i < nentries; ++i) {
+        size_t len = 0U;
+        char const* const text = history_view_text(state, i, &len);
+        if (text && len) {
+            st = history_append(copy, text, len);
+        }
+    }
+
+    if (!st) {
+        st = search_build_index(copy);
+    }
+
+    if (!st) {
+        st = order_build(copy);
+    }
+
+    ComlinHistory* const history =
+      st ? NULL : (ComlinHistory*)calloc(1U, sizeof(ComlinHistory));
+    if (!history) {
+        comlin_free_state(copy);
+        return NULL;
+    }
+
+    history->len = copy->history_len;
+    history->entries = copy->history;
+    history->arena = copy->history_arena;
+    history->search.postings = copy->search.postings;
+    history->search.nbuckets = copy->search.nbuckets;
+    history->search.nkeys = copy->search.nkeys;
+    history->sorted = copy->history_order.seqs;
+    copy->history_order.seqs = NULL;
+    copy->history = NULL;
+    copy->history_arena = NULL;
+    copy->search.postings = NULL;
+    copy->search.nbuckets = 0U;
+    comlin_free_state(copy);
+    return history;
+}
+
+void
+comlin_free_shared_history(ComlinHistory* const history)
+{
+    if (history) {
+        for (size_t i = 0U; i < history->search.nbuckets; ++i) {
+            free(history->search.postings[i].seqs);
+        }
+
+        free(history->search.postings);
+        free(history->sorted);
+        free(history->arena);
+        free(history->entries);
+        free(history);
+    }
+}
+
+void
+comlin_set_shared_history(ComlinState* const state,
+                          ComlinHistory const* const history)
+{
+    state->shared = history;
+    state->history_index = 0U;
+    state->search.nlazy = 0U;
+    state->history_order.matches_valid = false;
+}
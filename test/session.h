@@ -0,0 +1,77 @@
+// Copyright 2024 David Robillard <d@drobilla.net>
+// SPDX-License-Identifier: BSD-2-Clause
+
+// Common helpers for unit tests that edit lines fed through a pipe
+
+#ifndef COMLIN_TEST_SESSION_H
+#define COMLIN_TEST_SESSION_H
+
+#undef NDEBUG
+
+#include "comlin/comlin.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+typedef struct {
+    int input[2];  // Pipe to feed input through
+    int output[2]; // Pipe to read output from, or -1 and a null output
+    ComlinState* state;
+} Session;
+
+// Make a state that reads from a pipe, and writes to a pipe if capturing
+static inline Session
+session_open(bool const capture, size_t const history_len)
+{
+    Session session = {{-1, -1}, {-1, -1}, NULL};
+    assert(!pipe(session.input));
+    if (capture) {
+        assert(!pipe(session.output));
+        assert(!fcntl(session.output[0], F_SETFL, O_NONBLOCK));
+    } else {
+        session.output[1] = open("/dev/null", O_WRONLY);
+        assert(session.output[1] >= 0);
+    }
+
+    session.state = comlin_new_state(
+      session.input[0], session.output[1], "vt100", history_len);
+    assert(session.state);
+    return session;
+}
+
+// Write some input to the pipe, then process it
+static inline ComlinStatus
+session_feed(Session const* const session, char const* const text)
+{
+    size_t const len = strlen(text);
+    assert(write(session->input[1], text, len) == (ssize_t)len);
+    return comlin_edit_feed(session->state);
+}
+
+// Read all the output written since the last call into a buffer
+static inline char const*
+session_output(Session const* const session)
+{
+    static char buf[256] = {0};
+    ssize_t const n = read(session->output[0], buf, sizeof(buf) - 1U);
+    buf[n > 0 ? n : 0] = '\0';
+    return buf;
+}
+
+// Free the state and close everything that was opened for it
+static inline void
+session_close(Session* const session)
+{
+    comlin_free_state(session->state);
+    assert(!close(session->output[1]));
+    assert(session->output[0] < 0 || !close(session->output[0]));
+    assert(!close(session->input[1]));
+    assert(!close(session->input[0]));
+}
+
+#endif // COMLIN_TEST_SESSION_H
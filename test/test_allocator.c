@@ -0,0 +1,253 @@
+// Copyright 2024 David Robillard <d@drobilla.net>
+// SPDX-License-Identifier: BSD-2-Clause
+
+#undef NDEBUG
+
+#include "comlin/comlin.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAGIC 0xC0317119U
+
+// The header of an allocated block, which is checked when it's freed
+typedef struct {
+    size_t magic; ///< Set to MAGIC while the block is allocated
+    size_t size;  ///< Size of the block after the header
+} Header;
+
+// Counts of allocations made by the test allocator
+typedef struct {
+    size_t n_allocations; ///< Number of calls to alloc or realloc
+    size_t n_live;        ///< Number of blocks allocated and not yet freed
+    size_t n_bytes_live;  ///< Total size of blocks not yet freed
+} Counts;
+
+static Header*
+header(void* const ptr)
+{
+    Header* const h = (Header*)ptr - 1U;
+    assert(h->magic == MAGIC);
+    return h;
+}
+
+static void*
+test_alloc(void* const handle, size_t const size)
+{
+    Counts* const counts = (Counts*)handle;
+    Header* const h = (Header*)malloc(sizeof(Header) + size);
+    if (h) {
+        h->magic = MAGIC;
+        h->size = size;
+        ++counts->n_allocations;
+        ++counts->n_live;
+        counts->n_bytes_live += size;
+    }
+
+    return h ? h + 1U : NULL;
+}
+
+static void*
+test_realloc(void* const handle, void* const ptr, size_t const size)
+{
+    if (!ptr) {
+        return test_alloc(handle, size);
+    }
+
+    Counts* const counts = (Counts*)handle;
+    Header* const old = header(ptr);
+    size_t const old_size = old->size;
+    old->magic = 0U;
+
+    Header* const h = (Header*)realloc(old, sizeof(Header) + size);
+    if (!h) {
+        old->magic = MAGIC;
+        return NULL;
+    }
+
+    h->magic = MAGIC;
+    h->size = size;
+    counts->n_bytes_live += size - old_size;
+    ++counts->n_allocations;
+    return h + 1U;
+}
+
+static void
+test_free(void* const handle, void* const ptr)
+{
+    Counts* const counts = (Counts*)handle;
+    if (ptr) {
+        Header* const h = header(ptr);
+        h->magic = 0U;
+        counts->n_bytes_live -= h->size;
+        free(h);
+        --counts->n_live;
+    }
+}
+
+static void
+completion(char const* const line, ComlinCompletions* const lc)
+{
+    (void)line;
+    assert(lc->allocator);
+    assert(!comlin_add_completion(lc, "first"));
+    assert(!comlin_add_completion(lc, "firstish"));
+}
+
+static ComlinStatus
+feed(int const fd, ComlinState* const state, char const* const text)
+{
+    size_t const len = strlen(text);
+    assert(write(fd, text, len) == (ssize_t)len);
+    return comlin_edit_feed(state);
+}
+
+static void
+test_session(void)
+{
+    static char const* const path = "test_allocator.hist.txt";
+
+    Counts counts = {0U, 0U, 0U};
+    ComlinAllocator const allocator = {
+      &counts, test_alloc, test_realloc, test_free};
+
+    int input[2] = {-1, -1};
+    assert(!pipe(input));
+    int const output = open("/dev/null", O_WRONLY);
+    assert(output >= 0);
+
+    ComlinState* const state = comlin_new_state_with_allocator(
+      input[0], output, "vt100", 4U, &allocator);
+    assert(state);
+    assert(counts.n_live == 1U);
+
+    // Edit a line with completion, history, and search
+    comlin_set_completion_callback(state, completion);
+    assert(!comlin_set_mode(state, COMLIN_MODE_UNIQUE_HISTORY));
+    assert(!comlin_history_add(state, "one"));
+    assert(!comlin_history_add(state, "two"));
+    assert(!comlin_edit_start(state, "> "));
+    assert(feed(input[1], state, "fi\t\t") == COMLIN_EDITING);
+    assert(feed(input[1], state, "\x12o") == COMLIN_EDITING); // Ctrl-R
+    assert(feed(input[1], state, "\x07") == COMLIN_EDITING);  // Ctrl-G
+    assert(feed(input[1], state, "\r") == COMLIN_SUCCESS);
+    assert(!strcmp(comlin_text(state), "firstish"));
+    assert(!comlin_edit_stop(state));
+
+    // Save and load the history
+    assert(!comlin_history_add(state, comlin_text(state)));
+    assert(!comlin_history_save(state, path));
+    assert(!comlin_history_load(state, path));
+    assert(!remove(path));
+
+    // Every block was allocated with the allocator, and is freed with it
+    assert(counts.n_allocations > 10U);
+    comlin_free_state(state);
+    assert(!counts.n_live);
+
+    assert(!close(output));
+    assert(!close(input[1]));
+    assert(!close(input[0]));
+}
+
+static void
+test_push(void)
+{
+    // Completions built by the application can use another allocator
+    Counts counts = {0U, 0U, 0U};
+    ComlinAllocator const allocator = {
+      &counts, test_alloc, test_realloc, test_free};
+
+    ComlinCompletions lc = {0U, NULL, 0U, NULL, &allocator};
+    assert(!comlin_add_completion(&lc, "word"));
+    assert(counts.n_live == 2U);
+
+    int input[2] = {-1, -1};
+    assert(!pipe(input));
+    ComlinState* const state = comlin_new_state(input[0], -1, "dumb", 0U);
+    assert(state);
+    assert(!comlin_push_completions(state, 0U, &lc));
+    assert(!lc.len);
+    assert(lc.allocator == &allocator);
+    assert(!counts.n_live);
+
+    comlin_free_state(state);
+    assert(!close(input[1]));
+    assert(!close(input[0]));
+}
+
+static void
+test_trim(void)
+{
+    Counts counts = {0U, 0U, 0U};
+    ComlinAllocator const allocator = {
+      &counts, test_alloc, test_realloc, test_free};
+
+    int input[2] = {-1, -1};
+    assert(!pipe(input));
+    int const output = open("/dev/null", O_WRONLY);
+    assert(output >= 0);
+
+    ComlinState* const state = comlin_new_state_with_allocator(
+      input[0], output, "vt100", 1000U, &allocator);
+    assert(state);
+    assert(counts.n_live == 1U);
+    comlin_set_completion_callback(state, completion);
+    assert(!comlin_set_mode(state, COMLIN_MODE_UNIQUE_HISTORY));
+
+    // Edit a very long line, which grows the line buffers to fit it
+    static char line[16384];
+    memset(line, 'x', sizeof(line) - 2U);
+    line[sizeof(line) - 2U] = '\r';
+    assert(!comlin_edit_start(state, "> "));
+    assert(feed(input[1], state, "fi\t\x12o\x07\x15") == COMLIN_EDITING);
+    ComlinStatus st = feed(input[1], state, line);
+    while (st == COMLIN_EDITING) {
+        st = comlin_edit_feed(state);
+    }
+
+    assert(st == COMLIN_SUCCESS);
+    assert(strlen(comlin_text(state)) == sizeof(line) - 2U);
+    assert(!comlin_edit_stop(state));
+    assert(!comlin_history_add(state, "short"));
+    size_t const long_size = counts.n_bytes_live;
+    assert(long_size > 4U * sizeof(line));
+
+    // Starting the next line frees the buffers that grew past the usual size
+    assert(!comlin_edit_start(state, "> "));
+    assert(feed(input[1], state, "\r") == COMLIN_SUCCESS);
+    assert(!comlin_edit_stop(state));
+    assert(counts.n_bytes_live < long_size / 4U);
+
+    // Trimming leaves only the state, the history, and its text
+    comlin_trim_state(state);
+    assert(counts.n_live == 3U);
+    assert(!strcmp(comlin_text(state), ""));
+
+    // Everything still works and is allocated again as needed
+    assert(!comlin_edit_start(state, "> "));
+    assert(feed(input[1], state, "\x12sh\r") == COMLIN_SUCCESS);
+    assert(!strcmp(comlin_text(state), "short"));
+    assert(!comlin_edit_stop(state));
+    assert(counts.n_live > 3U);
+
+    comlin_free_state(state);
+    assert(!counts.n_live);
+    assert(!close(output));
+    assert(!close(input[1]));
+    assert(!close(input[0]));
+}
+
+int
+main(void)
+{
+    test_session();
+    test_push();
+    test_trim();
+    return 0;
+}
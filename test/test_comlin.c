@@ -3,6 +3,8 @@
 
 #include "comlin/comlin.h"
 
+#include <unistd.h>
+
 #include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
@@ -10,9 +12,13 @@
 typedef struct {
     char const* restore_path;
     char const* save_path;
+    bool bytes;
     bool dumb;
     bool mask;
     bool multiline;
+    bool paste;
+    bool stream;
+    bool unique;
 } Options;
 
 static bool
@@ -25,10 +31,10 @@ static void
 completion(char const* const line, ComlinCompletions* const lc)
 {
     if (starts_with(line, "first")) {
-        comlin_add_completion(lc, "first");
+        comlin_add_static_completion(lc, "first");
         comlin_add_completion(lc, "firstish");
     } else if (starts_with(line, "second")) {
-        comlin_add_completion(lc, "second");
+        comlin_add_completion_n(lc, "secondish", 6U);
         comlin_add_completion(lc, "secondish");
     }
 }
@@ -40,12 +46,16 @@ print_usage(char const* const name, bool const error)
       "Run an input/output test.\n"
       "INPUT is read directly and may contain terminal escapes.\n"
       "Output is written to stdout.\n\n"
+      "  --bytes         Feed input with comlin_edit_feed_bytes().\n"
       "  --dumb          Force dumb terminal mode.\n"
       "  --help          Display this help and exit.\n"
       "  --mask          Use mask mode.\n"
       "  --multi         Use multi-line mode.\n"
+      "  --paste         Use bracketed paste mode.\n"
       "  --restore FILE  Load history from FILE before run.\n"
-      "  --save FILE     Save history to FILE after run.\n";
+      "  --save FILE     Save history to FILE after run.\n"
+      "  --stream        Use stream mode.\n"
+      "  --unique        Erase older duplicates from history.\n";
 
     FILE* const os = error ? stderr : stdout;
     fprintf(os, "%s", error ? "\n" : "");
@@ -61,11 +71,61 @@ missing_arg(char const* const name, char const* const opt)
     return print_usage(name, true);
 }
 
+// Input read by the test itself, for feeding to comlin_edit_feed_bytes()
+typedef struct {
+    char data[4096];
+    size_t offset;
+    size_t length;
+} Input;
+
+// Read a line like comlin_read_line(), but feed it input read here
+static ComlinStatus
+read_line_bytes(ComlinState* const state, int const ifd, Input* const input)
+{
+    ComlinStatus st = comlin_edit_start(state, "> ");
+    if (st) {
+        return st;
+    }
+
+    do {
+        if (input->offset == input->length) {
+            ssize_t const r = read(ifd, input->data, sizeof(input->data));
+            if (r < 0) {
+                st = COMLIN_BAD_READ;
+                break;
+            }
+
+            if (!r) {
+                size_t n_used = 0U;
+                st = comlin_edit_feed_bytes(state, input->data, 0U, &n_used);
+                st = (st == COMLIN_EDITING) ? COMLIN_END : st;
+                break;
+            }
+
+            input->offset = 0U;
+            input->length = (size_t)r;
+        }
+
+        size_t n_used = 0U;
+        st = comlin_edit_feed_bytes(state,
+                                    input->data + input->offset,
+                                    input->length - input->offset,
+                                    &n_used);
+        input->offset += n_used;
+    } while (st == COMLIN_EDITING);
+
+    ComlinStatus const stop_st = comlin_edit_stop(state);
+    return st ? st : stop_st;
+}
+
 static int
 run(int const ifd, int const ofd, Options const opts)
 {
     bool const mask = opts.mask;
     bool const multiline = opts.multiline;
+    bool const paste = opts.paste;
+    bool const stream = opts.stream;
+    bool const unique = opts.unique;
     char const* const restore_path = opts.restore_path;
     char const* const save_path = opts.save_path;
 
@@ -75,7 +135,10 @@ run(int const ifd, int const ofd, Options const opts)
     comlin_set_completion_callback(state, completion);
     comlin_set_mode(state,
                     (mask ? COMLIN_MODE_MASKED : 0U) |
-                      (multiline ? COMLIN_MODE_MULTI_LINE : 0U));
+                      (multiline ? COMLIN_MODE_MULTI_LINE : 0U) |
+                      (paste ? COMLIN_MODE_BRACKETED_PASTE : 0U) |
+                      (stream ? COMLIN_MODE_STREAM : 0U) |
+                      (unique ? COMLIN_MODE_UNIQUE_HISTORY : 0U));
 
     // Load initial history
     if (restore_path) {
@@ -86,9 +149,11 @@ run(int const ifd, int const ofd, Options const opts)
     }
 
     // Process input lines until end of input or an error
+    static Input input = {{0}, 0U, 0U};
     ComlinStatus st = COMLIN_SUCCESS;
     while (!st) {
-        st = comlin_read_line(state, "> ");
+        st = opts.bytes ? read_line_bytes(state, ifd, &input)
+                        : comlin_read_line(state, "> ");
         if (!st) {
             char const* const line = comlin_text(state);
             printf("echo: %s\n", line);
@@ -113,19 +178,24 @@ int
 main(int const argc, char const* const* const argv)
 {
     // Parse command line options
-    Options opts = {NULL, NULL, false, false, false};
+    Options opts = {
+      NULL, NULL, false, false, false, false, false, false, false};
     int a = 1;
     for (; a < argc && argv[a][0] == '-'; ++a) {
         if (!strcmp(argv[a], "--help")) {
             return print_usage(argv[0], false);
         }
 
-        if (!strcmp(argv[a], "--dumb")) {
+        if (!strcmp(argv[a], "--bytes")) {
+            opts.bytes = true;
+        } else if (!strcmp(argv[a], "--dumb")) {
             opts.dumb = true;
         } else if (!strcmp(argv[a], "--mask")) {
             opts.mask = true;
         } else if (!strcmp(argv[a], "--multi")) {
             opts.multiline = true;
+        } else if (!strcmp(argv[a], "--paste")) {
+            opts.paste = true;
         } else if (!strcmp(argv[a], "--restore")) {
             if (++a == argc) {
                 return missing_arg(argv[0], "--restore");
@@ -138,6 +208,10 @@ main(int const argc, char const* const* const argv)
             }
 
             opts.save_path = argv[a];
+        } else if (!strcmp(argv[a], "--stream")) {
+            opts.stream = true;
+        } else if (!strcmp(argv[a], "--unique")) {
+            opts.unique = true;
         } else {
             return print_usage(argv[0], true);
         }
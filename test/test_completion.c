@@ -0,0 +1,194 @@
+// Copyright 2024 David Robillard <d@drobilla.net>
+// SPDX-License-Identifier: BSD-2-Clause
+
+#undef NDEBUG
+
+#include "session.h"
+
+#include "comlin/comlin.h"
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+static size_t n_requests = 0U;
+static size_t last_request = 0U;
+static char last_line[64] = {0};
+
+static void
+request_completions(ComlinState* const state,
+                    size_t const request,
+                    char const* const line)
+{
+    (void)state;
+    ++n_requests;
+    last_request = request;
+    snprintf(last_line, sizeof(last_line), "%s", line);
+}
+
+static void
+push_completions(Session const* const session, size_t const request)
+{
+    ComlinCompletions lc = {0U, NULL, 0U, NULL, NULL};
+    assert(!comlin_add_completion(&lc, "first"));
+    assert(!comlin_add_completion(&lc, "firstish"));
+    assert(!comlin_push_completions(session->state, request, &lc));
+    assert(!lc.len);
+    assert(!lc.cvec);
+}
+
+static Session
+start(void)
+{
+    Session session = session_open(false, 8U);
+    comlin_set_async_completion_callback(session.state, request_completions);
+    assert(!comlin_edit_start(session.state, "> "));
+    n_requests = 0U;
+    return session;
+}
+
+static void
+finish(Session* const session, char const* const expected)
+{
+    assert(session_feed(session, "\r") == COMLIN_SUCCESS);
+    assert(!strcmp(comlin_text(session->state), expected));
+    assert(!comlin_edit_stop(session->state));
+    session_close(session);
+}
+
+static void
+test_request(void)
+{
+    // Tab starts a request and returns straight away
+    Session session = start();
+    assert(session_feed(&session, "fi\t") == COMLIN_EDITING);
+    assert(n_requests == 1U);
+    assert(!strcmp(last_line, "fi"));
+
+    // Pushed completions are shown, and cycled through without a new request
+    push_completions(&session, last_request);
+    assert(session_feed(&session, "\t") == COMLIN_EDITING);
+    assert(n_requests == 1U);
+    finish(&session, "firstish");
+}
+
+static void
+test_narrowed(void)
+{
+    // Completions that don't match text typed after the request are dropped
+    Session session = start();
+    assert(session_feed(&session, "fi\t") == COMLIN_EDITING);
+    assert(session_feed(&session, "rsti") == COMLIN_EDITING);
+    push_completions(&session, last_request);
+    finish(&session, "firstish");
+}
+
+static void
+test_stale(void)
+{
+    // Completions for an old request are dropped
+    Session session = start();
+    assert(session_feed(&session, "fi\t") == COMLIN_EDITING);
+    size_t const old_request = last_request;
+    assert(session_feed(&session, "\t") == COMLIN_EDITING);
+    assert(n_requests == 2U);
+    push_completions(&session, old_request);
+
+    // As are completions for a line that no longer starts with the request's
+    push_completions(&session, last_request); // Completion is now active
+    assert(session_feed(&session, "\x1B") == COMLIN_EDITING);
+    assert(session_feed(&session, "\x7F\x7Fse\t") == COMLIN_EDITING);
+    assert(session_feed(&session, "\x7F\x7F") == COMLIN_EDITING);
+    push_completions(&session, last_request);
+    finish(&session, "");
+}
+
+static void
+test_index(void)
+{
+    static char const* const words[] = {
+      "second", "first", "firstish", "second", "fi", "secondish", "third"};
+
+    ComlinCompletionIndex* const index =
+      comlin_new_completion_index(words, sizeof(words) / sizeof(words[0]));
+    assert(index);
+
+    // The index is used instead of the callback, and only has matching words
+    Session session = start();
+    comlin_set_completion_index(session.state, index);
+    assert(session_feed(&session, "fi\t") == COMLIN_EDITING);
+    assert(session_feed(&session, "\t\t") == COMLIN_EDITING);
+    assert(!n_requests);
+    finish(&session, "firstish");
+
+    // Duplicates are only proposed once, and non-matching lines beep
+    session = start();
+    comlin_set_completion_index(session.state, index);
+    assert(session_feed(&session, "x\t\x7Fsec\t\t\t") == COMLIN_EDITING);
+    finish(&session, "sec");
+
+    comlin_free_completion_index(index);
+}
+
+static void
+test_fuzzy(void)
+{
+    static char const* const words[] = {"server_config",
+                                        "config_server",
+                                        "configServer",
+                                        "cfg",
+                                        "CONFIG_SAVE",
+                                        "other"};
+
+    ComlinCompletionIndex* const index =
+      comlin_new_completion_index(words, sizeof(words) / sizeof(words[0]));
+    assert(index);
+
+    // Subsequences match, ranked by how well the characters line up
+    Session session = start();
+    comlin_set_completion_index(session.state, index);
+    assert(!comlin_set_mode(session.state, COMLIN_MODE_FUZZY_COMPLETE));
+    assert(session_feed(&session, "cfgsrv\t") == COMLIN_EDITING);
+    finish(&session, "configServer");
+
+    // Words with equal scores are ranked by length
+    session = start();
+    comlin_set_completion_index(session.state, index);
+    assert(!comlin_set_mode(session.state, COMLIN_MODE_FUZZY_COMPLETE));
+    assert(session_feed(&session, "cfgsrv\t\t") == COMLIN_EDITING);
+    finish(&session, "config_server");
+
+    // Exact matches come first, case is ignored, and the original is last
+    session = start();
+    comlin_set_completion_index(session.state, index);
+    assert(!comlin_set_mode(session.state, COMLIN_MODE_FUZZY_COMPLETE));
+    assert(session_feed(&session, "cfg\t") == COMLIN_EDITING);
+    assert(session_feed(&session, "\t\t\t\t\t") == COMLIN_EDITING);
+    finish(&session, "cfg");
+
+    session = start();
+    comlin_set_completion_index(session.state, index);
+    assert(!comlin_set_mode(session.state, COMLIN_MODE_FUZZY_COMPLETE));
+    assert(session_feed(&session, "cfg\t\t\t") == COMLIN_EDITING);
+    finish(&session, "configServer");
+
+    session = start();
+    comlin_set_completion_index(session.state, index);
+    assert(!comlin_set_mode(session.state, COMLIN_MODE_FUZZY_COMPLETE));
+    assert(session_feed(&session, "sc\t\t") == COMLIN_EDITING);
+    finish(&session, "sc");
+
+    comlin_free_completion_index(index);
+}
+
+int
+main(void)
+{
+    test_request();
+    test_narrowed();
+    test_stale();
+    test_index();
+    test_fuzzy();
+    return 0;
+}
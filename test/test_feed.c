@@ -0,0 +1,186 @@
+// Copyright 2024 David Robillard <d@drobilla.net>
+// SPDX-License-Identifier: BSD-2-Clause
+
+#undef NDEBUG
+
+#include "session.h"
+
+#include "comlin/comlin.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <assert.h>
+#include <stddef.h>
+#include <string.h>
+
+static Session
+start(ComlinModeFlags const flags)
+{
+    // Input is only read from the pipe by comlin_edit_feed()
+    Session session = session_open(false, 8U);
+    assert(!fcntl(session.input[0], F_SETFL, O_NONBLOCK));
+    assert(!comlin_set_mode(session.state, flags));
+    assert(!comlin_edit_start(session.state, "> "));
+    return session;
+}
+
+// Feed some bytes and check that they were all used
+static ComlinStatus
+feed(Session const* const session, char const* const text)
+{
+    size_t const len = strlen(text);
+    size_t n_used = 0U;
+    ComlinStatus const st =
+      comlin_edit_feed_bytes(session->state, text, len, &n_used);
+
+    assert(n_used == len);
+    return st;
+}
+
+static void
+finish(Session* const session, char const* const expected)
+{
+    assert(!strcmp(comlin_text(session->state), expected));
+    assert(!comlin_edit_stop(session->state));
+    session_close(session);
+}
+
+static void
+test_split_escapes(void)
+{
+    // Sequences are handled when they're complete, however they're split
+    Session session = start(0U);
+    assert(feed(&session, "abc\x1B") == COMLIN_EDITING);
+    assert(feed(&session, "[") == COMLIN_EDITING);
+    assert(feed(&session, "D") == COMLIN_EDITING);
+    assert(feed(&session, "\x1B[D\x1B[") == COMLIN_EDITING);
+    assert(feed(&session, "3") == COMLIN_EDITING);
+    assert(feed(&session, "~") == COMLIN_EDITING);
+
+    // Unknown sequences are ignored
+    assert(feed(&session, "\x1B[Z\x1BOZ\x1B[9~") == COMLIN_EDITING);
+    assert(feed(&session, "\r") == COMLIN_SUCCESS);
+    finish(&session, "ac");
+}
+
+static void
+test_sequences(void)
+{
+    // Modified keys and variants are handled like the plain keys
+    Session session = start(0U);
+    assert(feed(&session, "abc\x1B[1;5D\x1B[1;3Dx") == COMLIN_EDITING);
+    assert(feed(&session, "\x1B[1~y\x1B[4~z\x1BOH\x1B[3;5~") == COMLIN_EDITING);
+    assert(feed(&session, "\x1BOF\x1BOD\x1B[7~w\x1B[8~v") == COMLIN_EDITING);
+
+    // Sequences that aren't bound are consumed entirely
+    assert(feed(&session, "\x1B[?25h\x1B[1;2Q\x1B[ q\x1Bx") == COMLIN_EDITING);
+
+    // A control character ends a sequence and is handled as usual
+    assert(feed(&session, "\x1B[1;\x02u\x1B\r") == COMLIN_SUCCESS);
+    finish(&session, "waxbczuv");
+}
+
+static void
+test_split_paste(void)
+{
+    Session session = start(COMLIN_MODE_BRACKETED_PASTE);
+    assert(feed(&session, "\x1B[20") == COMLIN_EDITING);
+    assert(feed(&session, "0~he\r") == COMLIN_EDITING);
+    assert(feed(&session, "llo\x1B[2") == COMLIN_EDITING);
+    assert(feed(&session, "01") == COMLIN_EDITING);
+    assert(feed(&session, "~\r") == COMLIN_SUCCESS);
+    finish(&session, "he llo");
+}
+
+static void
+test_remaining(void)
+{
+    // Bytes after the end of the line aren't used
+    Session session = start(0U);
+    size_t n_used = 0U;
+    assert(comlin_edit_feed_bytes(session.state, "one\rtwo", 7U, &n_used) ==
+           COMLIN_SUCCESS);
+    assert(n_used == 4U);
+    assert(!strcmp(comlin_text(session.state), "one"));
+    assert(!comlin_edit_stop(session.state));
+
+    // So they can be fed to the next edit
+    assert(!comlin_edit_start(session.state, "> "));
+    assert(comlin_edit_feed_bytes(session.state, "two", 3U, &n_used) ==
+           COMLIN_EDITING);
+    assert(n_used == 3U);
+    finish(&session, "two");
+}
+
+static void
+test_would_block(void)
+{
+    // Reading with nothing available doesn't block
+    Session session = start(0U);
+    assert(comlin_edit_feed(session.state) == COMLIN_WOULD_BLOCK);
+
+    // Nor does reading an incomplete escape sequence
+    assert(write(session.input[1], "x\x1B[", 3U) == 3);
+    assert(comlin_edit_feed(session.state) == COMLIN_EDITING);
+    assert(comlin_edit_feed(session.state) == COMLIN_WOULD_BLOCK);
+    assert(write(session.input[1], "Dy\r", 3U) == 3);
+    assert(comlin_edit_feed(session.state) == COMLIN_SUCCESS);
+    finish(&session, "yx");
+}
+
+static void
+test_masked_yank_pop(void)
+{
+    // Yank some text in a plain line
+    Session session = start(0U);
+    assert(feed(&session, "x abc\x17\x19\r") == COMLIN_SUCCESS);
+    assert(!strcmp(comlin_text(session.state), "x abc"));
+    assert(!comlin_edit_stop(session.state));
+
+    // A yank in an earlier line can't be replaced after a kill
+    assert(!comlin_set_mode(session.state, COMLIN_MODE_MASKED));
+    assert(!comlin_edit_start(session.state, "> "));
+    assert(feed(&session, "f\x17\x1By") == COMLIN_EDITING);
+
+    // Nor can one in this line, even though kills aren't kept in mask mode
+    assert(feed(&session, "d\x19\x17\x1By\r") == COMLIN_SUCCESS);
+    finish(&session, "");
+}
+
+static void
+test_stream_show(void)
+{
+    // Hiding and showing a partial streamed line does nothing
+    Session session = start(COMLIN_MODE_STREAM);
+    assert(feed(&session, "ab") == COMLIN_EDITING);
+    assert(!comlin_hide(session.state));
+    assert(!comlin_notify_resize(session.state, 40U));
+    assert(!comlin_show(session.state));
+    assert(feed(&session, "c\n") == COMLIN_SUCCESS);
+    finish(&session, "abc");
+}
+
+static void
+test_search_invalid(void)
+{
+    // Searching shows a line with invalid UTF-8 without losing its columns
+    Session session = start(0U);
+    assert(feed(&session, "x\x80\x80\xE4\xB8\xAD\x12\x12") == COMLIN_EDITING);
+    assert(feed(&session, "\x07\r") == COMLIN_SUCCESS);
+    finish(&session, "x\x80\x80\xE4\xB8\xAD");
+}
+
+int
+main(void)
+{
+    test_split_escapes();
+    test_sequences();
+    test_split_paste();
+    test_remaining();
+    test_would_block();
+    test_masked_yank_pop();
+    test_stream_show();
+    test_search_invalid();
+    return 0;
+}
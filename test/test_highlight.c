@@ -0,0 +1,216 @@
+// Copyright 2024 David Robillard <d@drobilla.net>
+// SPDX-License-Identifier: BSD-2-Clause
+
+#undef NDEBUG
+
+#include "session.h"
+
+#include "comlin/comlin.h"
+
+#include <assert.h>
+#include <stddef.h>
+#include <string.h>
+
+static unsigned n_highlights = 0U;
+static unsigned n_hints = 0U;
+
+// Highlight "if" in bold red, and numbers in green
+static void
+highlight(char const* const line, ComlinHighlights* const highlights)
+{
+    ++n_highlights;
+    for (size_t i = 0U; line[i];) {
+        size_t const end = i + strcspn(line + i, " ");
+        if (end - i == 2U && !strncmp(line + i, "if", 2U)) {
+            assert(!comlin_add_highlight(highlights, i, end, "1;31"));
+        } else if (line[i] >= '0' && line[i] <= '9') {
+            assert(!comlin_add_highlight(highlights, i, end, "32"));
+        }
+
+        i = line[end] ? end + 1U : end;
+    }
+}
+
+// Add spans that are split, overlapping, or have an invalid style
+static void
+odd_highlight(char const* const line, ComlinHighlights* const highlights)
+{
+    (void)line;
+    assert(!comlin_add_highlight(highlights, 0U, 1U, "32"));
+    assert(!comlin_add_highlight(highlights, 1U, 2U, "32"));
+    assert(!comlin_add_highlight(highlights, 0U, 3U, "31"));
+    assert(!comlin_add_highlight(highlights, 3U, 4U, "red"));
+    assert(!comlin_add_highlight(highlights, 4U, 8U, "1"));
+}
+
+// Suggest the rest of "if then"
+static char const*
+hint(char const* const line, char const** const style)
+{
+    (void)style;
+    ++n_hints;
+    return !strcmp(line, "if") ? " then" : NULL;
+}
+
+static Session
+start(ComlinModeFlags const flags, char const* const prompt)
+{
+    Session session = session_open(true, 8U);
+    assert(!comlin_set_mode(session.state, flags));
+    assert(!comlin_notify_resize(session.state, 12U));
+    assert(!comlin_edit_start(session.state, prompt));
+    return session;
+}
+
+static void
+finish(Session* const session)
+{
+    assert(!comlin_edit_stop(session->state));
+    session_close(session);
+}
+
+static void
+test_prompt(void)
+{
+    // Escapes in the prompt take no columns, so it's two columns wide
+    Session session = start(0U, "\x1B[1m>\x1B[0m ");
+    session_output(&session);
+    assert(session_feed(&session, "abcdefghi") == COMLIN_EDITING);
+    assert(!strcmp(session_output(&session), "abcdefghi"));
+
+    // The line starts scrolling when the cursor reaches the last column
+    assert(session_feed(&session, "j") == COMLIN_EDITING);
+    assert(!strcmp(session_output(&session), "\x1B[9Dbcdefghij"));
+    finish(&session);
+}
+
+static void
+test_highlight(void)
+{
+    Session session = start(0U, "> ");
+    comlin_set_highlight_callback(session.state, highlight);
+    session_output(&session);
+    n_highlights = 0U;
+
+    // Changes to the text are shown in their styles
+    assert(session_feed(&session, "if 12") == COMLIN_EDITING);
+    assert(n_highlights == 1U);
+    assert(!strcmp(session_output(&session),
+                   "\x1B[1;31mif\x1B[0m \x1B[32m12\x1B[0m"));
+
+    // Moving the cursor only moves it, without highlighting again
+    assert(session_feed(&session, "\x01") == COMLIN_EDITING); // Ctrl-A
+    assert(!strcmp(session_output(&session), "\x1B[5D"));
+    assert(session_feed(&session, "\x05") == COMLIN_EDITING); // Ctrl-E
+    assert(!strcmp(session_output(&session), "\x1B[5C"));
+    assert(n_highlights == 1U);
+    assert(!comlin_hide(session.state));
+    assert(!comlin_show(session.state));
+    assert(n_highlights == 1U);
+    session_output(&session);
+
+    // Rewriting the middle of a span sets its style first
+    assert(session_feed(&session, "\x1B[D3") == COMLIN_EDITING);
+    assert(n_highlights == 2U);
+    assert(
+      !strcmp(session_output(&session), "\x1B[1D\x1B[32m32\x1B[0m\x1B[1D"));
+
+    // Splitting a span ends the first part with a reset
+    assert(session_feed(&session, " ") == COMLIN_EDITING);
+    assert(n_highlights == 3U);
+    assert(
+      !strcmp(session_output(&session), "\x1B[0m \x1B[32m2\x1B[0m\x1B[1D"));
+    finish(&session);
+}
+
+static void
+test_hint(void)
+{
+    Session session = start(0U, "> ");
+    comlin_set_hint_callback(session.state, hint);
+    session_output(&session);
+    n_hints = 0U;
+
+    // The hint is shown after the line, in grey
+    assert(session_feed(&session, "if") == COMLIN_EDITING);
+    assert(n_hints == 1U);
+    assert(!strcmp(session_output(&session), "if\x1B[90m then\x1B[0m\x1B[5D"));
+    assert(session_feed(&session, "\x01") == COMLIN_EDITING);
+    assert(n_hints == 1U);
+    assert(!strcmp(session_output(&session), "\x1B[2D"));
+
+    // Only the part that fits is shown in single-line mode
+    assert(!comlin_notify_resize(session.state, 6U));
+    assert(!strcmp(session_output(&session),
+                   "\r\x1B[0J> if\x1B[90m t\x1B[0m\r\x1B[2C"));
+
+    // The hint is removed when the line is entered
+    assert(session_feed(&session, "\r") == COMLIN_SUCCESS);
+    assert(!strcmp(session_output(&session), "\x1B[2C\x1B[0K\x1B[2D"));
+    assert(n_hints == 1U);
+    finish(&session);
+}
+
+static void
+test_multi_line(void)
+{
+    Session session = start(COMLIN_MODE_MULTI_LINE, "> ");
+    comlin_set_highlight_callback(session.state, highlight);
+    comlin_set_hint_callback(session.state, hint);
+    session_output(&session);
+
+    // The style of a span that wraps is set again on the next row
+    assert(session_feed(&session, "1234567890x") == COMLIN_EDITING);
+    assert(!strcmp(session_output(&session),
+                   "\x1B[32m1234567890\x1B[0m\r\n\x1B[32mx\x1B[0m"));
+
+    // The hint wraps onto the next row with the line
+    assert(session_feed(&session, "\x15if") == COMLIN_EDITING); // Ctrl-U
+    session_output(&session);
+    assert(!comlin_notify_resize(session.state, 6U));
+    assert(!strcmp(session_output(&session),
+                   "\r\x1B[0J> \x1B[1;31mif\x1B[0m\x1B[90m t\x1B[0m\r\n"
+                   "\x1B[90mhen\x1B[0m\x1B[1A\x1B[1C"));
+    finish(&session);
+}
+
+static void
+test_spans(void)
+{
+    Session session = start(0U, "> ");
+    ComlinState* const state = session.state;
+    comlin_set_highlight_callback(state, odd_highlight);
+    session_output(&session);
+
+    // Spans are kept whole, merged, and checked
+    assert(session_feed(&session, "7\xC3\xA9x") == COMLIN_EDITING);
+    assert(!strcmp(session_output(&session), "\x1B[32m7\xC3\xA9\x1B[0mx"));
+
+    // Trimming drops the cached highlights, which are made again
+    assert(session_feed(&session, "\r") == COMLIN_SUCCESS);
+    assert(!comlin_edit_stop(state));
+    comlin_trim_state(state);
+    comlin_set_highlight_callback(state, highlight);
+    n_highlights = 0U;
+    assert(!comlin_edit_start(state, "> "));
+    assert(session_feed(&session, "8") == COMLIN_EDITING);
+    assert(n_highlights == 1U);
+    assert(!strcmp(session_output(&session), "\n> \x1B[32m8\x1B[0m"));
+
+    // Unsetting the callback shows the line without styles
+    comlin_set_highlight_callback(state, NULL);
+    assert(session_feed(&session, "9") == COMLIN_EDITING);
+    assert(!strcmp(session_output(&session), "\x1B[1D89"));
+    finish(&session);
+}
+
+int
+main(void)
+{
+    test_prompt();
+    test_highlight();
+    test_hint();
+    test_multi_line();
+    test_spans();
+    return 0;
+}
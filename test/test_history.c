@@ -5,7 +5,12 @@
 
 #include "comlin/comlin.h"
 
+#include <fcntl.h>
+#include <unistd.h>
+
 #include <assert.h>
+#include <stdio.h>
+#include <string.h>
 
 static int const ifd = 0; // stdin
 static int const ofd = 1; // stdout
@@ -39,11 +44,393 @@ test_bad_save(void)
     comlin_free_state(state);
 }
 
+static void
+check_file(char const* const path, char const* const expected)
+{
+    char buf[256] = {0};
+    FILE* const file = fopen(path, "r");
+    assert(file);
+    size_t const len = fread(buf, 1U, sizeof(buf) - 1U, file);
+    assert(!fclose(file));
+    assert(len == strlen(expected));
+    assert(!strcmp(buf, expected));
+}
+
+static void
+test_wrap(void)
+{
+    static char const* const path = "test_history_wrap.txt";
+    static char const* const lines[] = {"1", "2", "3", "4", "5", "6", "7"};
+
+    ComlinState* const state = comlin_new_state(ifd, ofd, "> ", 3U);
+    assert(state);
+    for (size_t i = 0U; i < sizeof(lines) / sizeof(lines[0]); ++i) {
+        assert(!comlin_history_add(state, lines[i]));
+    }
+
+    assert(!comlin_history_save(state, path));
+    check_file(path, "5\n6\n7\n");
+
+    // Load into a smaller history, which keeps only the newest entries
+    ComlinState* const small = comlin_new_state(ifd, ofd, "> ", 2U);
+    assert(small);
+    assert(!comlin_history_load(small, path));
+    assert(!comlin_history_save(small, path));
+    check_file(path, "6\n7\n");
+
+    assert(!remove(path));
+    comlin_free_state(small);
+    comlin_free_state(state);
+}
+
+static void
+test_arena(void)
+{
+    static char const* const path = "test_history_arena.txt";
+
+    // Add many lines of varying lengths so the text arena is compacted
+    ComlinState* const state = comlin_new_state(ifd, ofd, "> ", 4U);
+    assert(state);
+    char line[64] = {0};
+    for (size_t i = 0U; i < 1000U; ++i) {
+        size_t const len = 1U + ((i * 7U) % (sizeof(line) - 1U));
+        memset(line, 'a' + (int)(i % 26U), len);
+        line[len] = '\0';
+        assert(!comlin_history_add(state, line));
+    }
+
+    assert(!comlin_history_save(state, path));
+    check_file(path,
+               "iiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiii\n"
+               "jjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjj\n"
+               "kkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkk\n"
+               "l\n");
+
+    assert(!remove(path));
+    comlin_free_state(state);
+}
+
+static void
+test_append(void)
+{
+    static char const* const path = "test_history_append.txt";
+
+    ComlinState* const state = comlin_new_state(ifd, ofd, "> ", 2U);
+    assert(state);
+    assert(!comlin_history_add(state, "a"));
+    assert(!comlin_history_add(state, "b"));
+    assert(!comlin_history_save(state, path));
+    check_file(path, "a\nb\n");
+
+    // New entries are appended until the file is twice the history length
+    assert(!comlin_history_add(state, "c"));
+    assert(!comlin_history_append(state, path));
+    check_file(path, "a\nb\nc\n");
+    assert(!comlin_history_append(state, path));
+    check_file(path, "a\nb\nc\n");
+    assert(!comlin_history_add(state, "d"));
+    assert(!comlin_history_append(state, path));
+    check_file(path, "a\nb\nc\nd\n");
+
+    // Then the file is rewritten with only the current history
+    assert(!comlin_history_add(state, "e"));
+    assert(!comlin_history_append(state, path));
+    check_file(path, "d\ne\n");
+
+    // Loaded entries aren't appended again
+    ComlinState* const loaded = comlin_new_state(ifd, ofd, "> ", 2U);
+    assert(loaded);
+    assert(!comlin_history_load(loaded, path));
+    assert(!comlin_history_add(loaded, "f"));
+    assert(!comlin_history_append(loaded, path));
+    check_file(path, "d\ne\nf\n");
+
+    assert(!remove(path));
+    comlin_free_state(loaded);
+    comlin_free_state(state);
+}
+
+static void
+test_unique(void)
+{
+    static char const* const path = "test_history_unique.txt";
+    static char const* const lines[] = {"a", "b", "c", "d", "b", "a", "e"};
+
+    ComlinState* const state = comlin_new_state(ifd, ofd, "> ", 4U);
+    assert(state);
+    assert(!comlin_set_mode(state, COMLIN_MODE_UNIQUE_HISTORY));
+    for (size_t i = 0U; i < sizeof(lines) / sizeof(lines[0]); ++i) {
+        assert(!comlin_history_add(state, lines[i]));
+    }
+
+    assert(!comlin_history_save(state, path));
+    check_file(path, "d\nb\na\ne\n");
+
+    assert(!remove(path));
+    comlin_free_state(state);
+}
+
+static void
+test_tail(void)
+{
+    static char const* const path = "test_history_tail.txt";
+
+    FILE* const file = fopen(path, "w");
+    assert(file);
+    fputs("1\n2\n3\n\n4\n4\nf\tiv\x7f" "e\n\n\xc3\xa9\nunterminated", file);
+    assert(!fclose(file));
+
+    // Only the newest lines are loaded, and runs of duplicates count as one
+    ComlinState* const state = comlin_new_state(ifd, ofd, "> ", 3U);
+    assert(state);
+    assert(!comlin_history_load(state, path));
+    assert(!comlin_history_save(state, path));
+    check_file(path, "4\nfive\n\xc3\xa9\n");
+
+    assert(!remove(path));
+    comlin_free_state(state);
+}
+
+// Feed input to a state that is editing a line
+static ComlinStatus
+feed(ComlinState* const state, char const* const text)
+{
+    size_t n_used = 0U;
+    return comlin_edit_feed_bytes(state, text, strlen(text), &n_used);
+}
+
+static void
+test_interrupted(void)
+{
+    int const output = open("/dev/null", O_WRONLY);
+    assert(output >= 0);
+    ComlinState* const state = comlin_new_state(ifd, output, "vt100", 4U);
+    assert(state);
+    assert(!comlin_set_mode(state, COMLIN_MODE_UNIQUE_HISTORY));
+    assert(!comlin_history_add(state, "a"));
+    assert(!comlin_history_add(state, "b"));
+
+    // An interrupted edit doesn't leave the next one on an erased entry
+    assert(!comlin_edit_start(state, "> "));
+    assert(feed(state, "\x1B[A\x1B[A\x03") == COMLIN_INTERRUPTED);
+    assert(!comlin_edit_stop(state));
+    assert(!comlin_history_add(state, "a"));
+    assert(!comlin_edit_start(state, "> "));
+    assert(feed(state, "\x1B[B\x1B[A\r") == COMLIN_SUCCESS);
+    assert(!strcmp(comlin_text(state), "a"));
+    assert(!comlin_edit_stop(state));
+
+    comlin_free_state(state);
+    assert(!close(output));
+}
+
+static void
+test_shared(void)
+{
+    static char const* const path = "test_history_shared.txt";
+
+    // Make a shared history from a state that has its own entries
+    ComlinState* const loader = comlin_new_state(ifd, ofd, "> ", 4U);
+    assert(loader);
+    assert(!comlin_history_add(loader, "one"));
+    assert(!comlin_history_add(loader, "two"));
+    ComlinHistory* const shared = comlin_new_shared_history(loader);
+    assert(shared);
+    comlin_free_state(loader);
+
+    int const output = open("/dev/null", O_WRONLY);
+    assert(output >= 0);
+    ComlinState* const state = comlin_new_state(ifd, output, "vt100", 2U);
+    assert(state);
+    comlin_set_shared_history(state, shared);
+    assert(!comlin_history_add(state, "three"));
+
+    // Stepping goes through the state's own entries, then the shared ones
+    assert(!comlin_edit_start(state, "> "));
+    assert(feed(state, "\x1B[A\x1B[A\x1B[A\x1B[A") == COMLIN_EDITING);
+    assert(!strcmp(comlin_text(state), "one"));
+
+    // Edits to shared entries aren't kept
+    assert(feed(state, "x\x1B[B\x1B[A") == COMLIN_EDITING);
+    assert(feed(state, "\r") == COMLIN_SUCCESS);
+    assert(!strcmp(comlin_text(state), "one"));
+    assert(!comlin_edit_stop(state));
+
+    // Searching finds both, with and without the index
+    assert(!comlin_edit_start(state, "> "));
+    assert(feed(state, "\x12tw\r") == COMLIN_SUCCESS);
+    assert(!strcmp(comlin_text(state), "two"));
+    assert(!comlin_edit_stop(state));
+    assert(!comlin_edit_start(state, "> "));
+    assert(feed(state, "\x12" "e\x12\x12\x12\r") == COMLIN_SUCCESS);
+    assert(!strcmp(comlin_text(state), "one"));
+    assert(!comlin_edit_stop(state));
+    assert(!comlin_edit_start(state, "> "));
+    assert(feed(state, "\x12hre\r") == COMLIN_SUCCESS);
+    assert(!strcmp(comlin_text(state), "three"));
+    assert(!comlin_edit_stop(state));
+
+    // A state without its own entries searches the shared ones too
+    ComlinState* const fresh = comlin_new_state(ifd, output, "vt100", 2U);
+    assert(fresh);
+    comlin_set_shared_history(fresh, shared);
+    assert(!comlin_edit_start(fresh, "> "));
+    assert(feed(fresh, "\x12two\r") == COMLIN_SUCCESS);
+    assert(!strcmp(comlin_text(fresh), "two"));
+    assert(!comlin_edit_stop(fresh));
+    assert(!comlin_edit_start(fresh, "> "));
+    assert(feed(fresh, "\x12o\x12\x7Fone\r") == COMLIN_SUCCESS);
+    assert(!strcmp(comlin_text(fresh), "one"));
+    assert(!comlin_edit_stop(fresh));
+    comlin_free_state(fresh);
+
+    // Saving writes shared entries first, but appending only writes new ones
+    assert(!comlin_history_save(state, path));
+    check_file(path, "one\ntwo\nthree\n");
+    assert(!comlin_history_add(state, "four"));
+    assert(!comlin_history_append(state, path));
+    check_file(path, "one\ntwo\nthree\nfour\n");
+
+    // Without the shared history, only the state's own entries are left
+    comlin_set_shared_history(state, NULL);
+    comlin_free_shared_history(shared);
+    assert(!comlin_history_save(state, path));
+    check_file(path, "three\nfour\n");
+
+    assert(!remove(path));
+    comlin_free_state(state);
+    assert(!close(output));
+}
+
+static void
+test_search_evicted(void)
+{
+    int const output = open("/dev/null", O_WRONLY);
+    assert(output >= 0);
+    ComlinState* const state = comlin_new_state(ifd, output, "vt100", 4U);
+    assert(state);
+
+    // Build the search index, then add more entries than fit in the history
+    assert(!comlin_history_add(state, "abc0"));
+    assert(!comlin_edit_start(state, "> "));
+    assert(feed(state, "\x12\x07\r") == COMLIN_SUCCESS);
+    assert(!comlin_edit_stop(state));
+    char line[] = "abc0";
+    for (char c = '1'; c <= '5'; ++c) {
+        line[3] = c;
+        assert(!comlin_history_add(state, line));
+    }
+
+    // After shortening the query, the index has more candidates than entries
+    assert(!comlin_edit_start(state, "> "));
+    assert(feed(state, "\x12" "abcx\x7F\x12\x12\x12\x12\r") == COMLIN_SUCCESS);
+    assert(!strcmp(comlin_text(state), "abc3"));
+    assert(!comlin_edit_stop(state));
+
+    comlin_free_state(state);
+    assert(!close(output));
+}
+
+static void
+test_prefix(void)
+{
+    int const output = open("/dev/null", O_WRONLY);
+    assert(output >= 0);
+
+    ComlinState* const loader = comlin_new_state(ifd, ofd, "> ", 4U);
+    assert(loader);
+    assert(!comlin_history_add(loader, "git clone"));
+    assert(!comlin_history_add(loader, "make"));
+    ComlinHistory* const shared = comlin_new_shared_history(loader);
+    assert(shared);
+    comlin_free_state(loader);
+
+    ComlinState* const state = comlin_new_state(ifd, output, "vt100", 8U);
+    assert(state);
+    comlin_set_shared_history(state, shared);
+    assert(!comlin_set_mode(state, COMLIN_MODE_PREFIX_HISTORY));
+    assert(!comlin_history_add(state, "git status"));
+    assert(!comlin_history_add(state, "git log"));
+    assert(!comlin_history_add(state, "ls"));
+    assert(!comlin_history_add(state, "git log"));
+
+    // Stepping back only visits matches, skips repeats, and keeps the cursor
+    assert(!comlin_edit_start(state, "> "));
+    assert(feed(state, "gi\x1B[A") == COMLIN_EDITING);
+    assert(!strcmp(comlin_text(state), "git log"));
+    assert(feed(state, "\x1B[A") == COMLIN_EDITING);
+    assert(!strcmp(comlin_text(state), "git status"));
+    assert(feed(state, "\x1B[A") == COMLIN_EDITING);
+    assert(!strcmp(comlin_text(state), "git clone"));
+    assert(feed(state, "\x1B[A") == COMLIN_EDITING);
+    assert(!strcmp(comlin_text(state), "git clone"));
+
+    // Stepping forward past the newest match returns to the edited line
+    assert(feed(state, "\x1B[B\x1B[B") == COMLIN_EDITING);
+    assert(!strcmp(comlin_text(state), "git log"));
+    assert(feed(state, "\x1B[B") == COMLIN_EDITING);
+    assert(!strcmp(comlin_text(state), "gi"));
+
+    // Typing narrows the prefix, which is the text before the cursor
+    assert(feed(state, "t s\x1B[A") == COMLIN_EDITING);
+    assert(!strcmp(comlin_text(state), "git status"));
+    assert(feed(state, "\x1B[D\x1B[D\x1B[D\x1B[A") == COMLIN_EDITING);
+    assert(!strcmp(comlin_text(state), "git clone"));
+    assert(feed(state, "\r") == COMLIN_SUCCESS);
+    assert(!strcmp(comlin_text(state), "git clone"));
+    assert(!comlin_edit_stop(state));
+
+    // An entry that was edited no longer matches its old prefix
+    assert(!comlin_edit_start(state, "> "));
+    assert(feed(state, "\x1B[A\x1B[A\x1B[A\x1B[A") == COMLIN_EDITING);
+    assert(!strcmp(comlin_text(state), "git status"));
+    assert(feed(state, "\x01\x0B" "cd\x01") == COMLIN_EDITING);
+    assert(feed(state, "\x1B[B\x1B[B\x1B[B\x1B[B") == COMLIN_EDITING);
+    assert(!strcmp(comlin_text(state), ""));
+    assert(feed(state, "gi\x1B[A\x1B[A") == COMLIN_EDITING);
+    assert(!strcmp(comlin_text(state), "git clone"));
+    assert(feed(state, "\r") == COMLIN_SUCCESS);
+    assert(!comlin_edit_stop(state));
+
+    // A line added since the last steps is found with the same prefix
+    assert(!comlin_history_add(state, "git push"));
+    assert(!comlin_edit_start(state, "> "));
+    assert(feed(state, "gi\x1B[A") == COMLIN_EDITING);
+    assert(!strcmp(comlin_text(state), "git push"));
+    assert(feed(state, "\x1B[A") == COMLIN_EDITING);
+    assert(!strcmp(comlin_text(state), "git log"));
+    assert(feed(state, "\r") == COMLIN_SUCCESS);
+    assert(!comlin_edit_stop(state));
+
+    // Without the mode, stepping visits every entry and moves the cursor
+    assert(!comlin_set_mode(state, 0U));
+    assert(!comlin_edit_start(state, "> "));
+    assert(feed(state, "gi\x1B[A") == COMLIN_EDITING);
+    assert(!strcmp(comlin_text(state), "git push"));
+    assert(feed(state, "\x1B[A") == COMLIN_EDITING);
+    assert(!strcmp(comlin_text(state), "git log"));
+    assert(feed(state, "\r") == COMLIN_SUCCESS);
+    assert(!comlin_edit_stop(state));
+
+    comlin_free_state(state);
+    comlin_free_shared_history(shared);
+    assert(!close(output));
+}
+
 int
 main(void)
 {
     test_empty();
     test_bad_load();
     test_bad_save();
+    test_wrap();
+    test_arena();
+    test_append();
+    test_unique();
+    test_tail();
+    test_interrupted();
+    test_shared();
+    test_search_evicted();
+    test_prefix();
     return 0;
 }
@@ -0,0 +1,91 @@
+// Copyright 2024 David Robillard <d@drobilla.net>
+// SPDX-License-Identifier: BSD-2-Clause
+
+#undef NDEBUG
+
+#include "session.h"
+
+#include "comlin/comlin.h"
+
+#include <assert.h>
+#include <string.h>
+
+static Session
+start(ComlinModeFlags const flags)
+{
+    Session session = session_open(true, 8U);
+    assert(!comlin_set_mode(session.state, flags));
+    assert(!comlin_edit_start(session.state, "> "));
+    return session;
+}
+
+static void
+finish(Session* const session)
+{
+    assert(!comlin_edit_stop(session->state));
+    session_close(session);
+}
+
+static void
+test_single_line(void)
+{
+    Session session = start(0U);
+    assert(session_feed(&session, "abcdefgh") == COMLIN_EDITING);
+    session_output(&session);
+
+    // The same width does nothing
+    assert(!comlin_notify_resize(session.state, 80U));
+    assert(!strcmp(session_output(&session), ""));
+
+    // A new width clears the line and redraws it scrolled to fit
+    assert(!comlin_notify_resize(session.state, 6U));
+    assert(!strcmp(session_output(&session), "\r\x1B[0J> fgh"));
+    assert(session_feed(&session, "\x01") == COMLIN_EDITING); // Ctrl-A
+    assert(!strcmp(session_output(&session), "\x1B[3Dabcd\r\x1B[2C"));
+    finish(&session);
+}
+
+static void
+test_multi_line(void)
+{
+    Session session = start(COMLIN_MODE_MULTI_LINE);
+    assert(session_feed(&session, "abcdefgh") == COMLIN_EDITING);
+    session_output(&session);
+
+    // The line is drawn again from the first row
+    assert(!comlin_notify_resize(session.state, 4U));
+    assert(!strcmp(session_output(&session), "\r\x1B[0J> ab\r\ncdef\r\ngh"));
+    assert(!comlin_notify_resize(session.state, 80U));
+    assert(!strcmp(session_output(&session), "\x1B[2A\r\x1B[0J> abcdefgh"));
+    finish(&session);
+}
+
+static void
+test_not_editing(void)
+{
+    // Nothing is written when no line is shown
+    Session session = start(0U);
+    assert(!comlin_hide(session.state));
+    session_output(&session);
+    assert(!comlin_notify_resize(session.state, 10U));
+    assert(!strcmp(session_output(&session), ""));
+    assert(!comlin_show(session.state));
+
+    // Or after the edit is finished
+    assert(session_feed(&session, "\r") == COMLIN_SUCCESS);
+    assert(!comlin_edit_stop(session.state));
+    session_output(&session);
+    assert(!comlin_notify_resize(session.state, 20U));
+    assert(!strcmp(session_output(&session), ""));
+    assert(!comlin_edit_start(session.state, "> "));
+    finish(&session);
+}
+
+int
+main(void)
+{
+    test_single_line();
+    test_multi_line();
+    test_not_editing();
+    return 0;
+}
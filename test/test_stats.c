@@ -0,0 +1,91 @@
+// Copyright 2024 David Robillard <d@drobilla.net>
+// SPDX-License-Identifier: BSD-2-Clause
+
+#undef NDEBUG
+
+#include "session.h"
+
+#include "comlin/comlin.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <string.h>
+
+static void
+completion(char const* const line, ComlinCompletions* const lc)
+{
+    (void)line;
+    comlin_add_static_completion(lc, "abc");
+}
+
+static Session
+start(void)
+{
+    Session session = session_open(false, 2U);
+    comlin_set_completion_callback(session.state, completion);
+    return session;
+}
+
+static bool
+is_zero(ComlinStats const* const stats)
+{
+    static ComlinStats const zero = {
+      0U, 0U, 0U, 0U, 0U, 0U, 0U, 0U, 0U, 0U, 0U, 0.0};
+
+    return !memcmp(stats, &zero, sizeof(ComlinStats));
+}
+
+static void
+test_counts(void)
+{
+    Session session = start();
+    ComlinStats stats;
+    memset(&stats, 0xFF, sizeof(stats));
+
+    // Edit a line, with a completion and a full refresh
+    assert(!comlin_edit_start(session.state, "> "));
+    assert(session_feed(&session, "ab") == COMLIN_EDITING);
+    assert(session_feed(&session, "\t") == COMLIN_EDITING);
+    assert(!comlin_hide(session.state));
+    assert(!comlin_show(session.state));
+    assert(session_feed(&session, "\r") == COMLIN_SUCCESS);
+    assert(!strcmp(comlin_text(session.state), "abc"));
+    assert(!comlin_edit_stop(session.state));
+
+    // Fill the history so the oldest entry is dropped
+    assert(!comlin_history_add(session.state, "one"));
+    assert(!comlin_history_add(session.state, "two"));
+    assert(!comlin_history_add(session.state, "two"));
+    assert(!comlin_history_add(session.state, "three"));
+
+    comlin_get_stats(session.state, &stats);
+#ifndef COMLIN_NO_STATS
+    assert(stats.n_reads == 3U);
+    assert(stats.n_bytes_read == 4U);
+    assert(stats.n_writes >= 5U);
+    assert(stats.n_bytes_written > 4U);
+    assert(stats.n_full_refreshes == 1U);
+    assert(stats.n_partial_refreshes >= 3U);
+    assert(stats.n_allocations > 1U);
+    assert(stats.n_bytes_allocated > sizeof(ComlinStats));
+    assert(stats.n_history_adds == 3U);
+    assert(stats.n_history_evictions == 1U);
+    assert(stats.n_completion_calls == 1U);
+    assert(stats.completion_seconds >= 0.0);
+#else
+    assert(is_zero(&stats));
+#endif
+
+    // Resetting sets everything to zero
+    comlin_reset_stats(session.state);
+    comlin_get_stats(session.state, &stats);
+    assert(is_zero(&stats));
+    session_close(&session);
+}
+
+int
+main(void)
+{
+    test_counts();
+    return 0;
+}